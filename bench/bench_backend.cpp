@@ -0,0 +1,165 @@
+//
+// Benchmark backend
+//
+// A libevent server for driving tcpproxy in benchmarks. Every thread runs
+// its own event loop with its own SO_REUSEPORT listener, like the proxy's
+// workers, so the backend is not the bottleneck being measured.
+//
+//   echo    writes back everything it reads
+//   sink    reads and discards
+//   source  writes an endless stream and ignores its input
+//
+// usage: bench_backend <host> <port> echo|sink|source [threads, default 2]
+//
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+
+extern "C" {
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+}
+
+namespace
+{
+   enum backend_mode
+   {
+      mode_echo,
+      mode_sink,
+      mode_source
+   };
+
+   const size_t source_chunk = 65536;
+   const size_t source_queue = 4 * source_chunk;
+
+   struct server
+   {
+      backend_mode mode;
+      struct event_base* evbase;
+      struct evconnlistener* listener;
+      std::vector<char> chunk;
+   };
+
+   void on_read(struct bufferevent* bev, void* arg)
+   {
+      server* s = static_cast<server*>(arg);
+      struct evbuffer* input = bufferevent_get_input(bev);
+      if(s->mode == mode_echo) {
+         struct evbuffer* output = bufferevent_get_output(bev);
+         evbuffer_add_buffer(output, input);
+         if(evbuffer_get_length(output) >= source_queue)
+            bufferevent_disable(bev, EV_READ);
+      } else
+         evbuffer_drain(input, evbuffer_get_length(input));
+   }
+
+   // In echo mode this keeps a slow reader from making us buffer without
+   // bound; in source mode it tops the output queue back up.
+   void on_write(struct bufferevent* bev, void* arg)
+   {
+      server* s = static_cast<server*>(arg);
+      if(s->mode == mode_source) {
+         struct evbuffer* output = bufferevent_get_output(bev);
+         while(evbuffer_get_length(output) < source_queue)
+            evbuffer_add(output, &s->chunk[0], s->chunk.size());
+      } else {
+         bufferevent_enable(bev, EV_READ);
+      }
+   }
+
+   void on_event(struct bufferevent* bev, short events, void* arg)
+   {
+      if(events & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT))
+         bufferevent_free(bev);
+   }
+
+   void on_accept(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* address,
+                  int socklen, void* arg)
+   {
+      server* s = static_cast<server*>(arg);
+      struct bufferevent* bev = bufferevent_socket_new(s->evbase, fd, BEV_OPT_CLOSE_ON_FREE);
+      if(!bev) {
+         evutil_closesocket(fd);
+         return;
+      }
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      bufferevent_setcb(bev, on_read, on_write, on_event, s);
+      bufferevent_setwatermark(bev, EV_WRITE, source_queue / 2, 0);
+      bufferevent_enable(bev, EV_READ | EV_WRITE);
+      if(s->mode == mode_source)
+         on_write(bev, s);
+   }
+
+   void run(server* s)
+   {
+      event_base_dispatch(s->evbase);
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   if(argc < 4) {
+      std::cerr << "usage: bench_backend <host> <port> echo|sink|source [threads, default 2]" << std::endl;
+      return 1;
+   }
+   const std::string mode_name = argv[3];
+   backend_mode mode;
+   if(mode_name == "echo")
+      mode = mode_echo;
+   else if(mode_name == "sink")
+      mode = mode_sink;
+   else if(mode_name == "source")
+      mode = mode_source;
+   else {
+      std::cerr << "Error: Unknown mode " << mode_name << std::endl;
+      return 1;
+   }
+   const int num_threads = (argc > 4) ? std::max(1, ::atoi(argv[4])) : 2;
+   signal(SIGPIPE, SIG_IGN);
+
+   struct sockaddr_storage addr;
+   int addr_len = sizeof(addr);
+   const std::string endpoint = std::string(argv[1]) + ":" + argv[2];
+   if(evutil_parse_sockaddr_port(endpoint.c_str(), (struct sockaddr*)&addr, &addr_len) != 0) {
+      std::cerr << "Error: Invalid address " << endpoint << std::endl;
+      return 1;
+   }
+
+   std::vector<boost::shared_ptr<server> > servers;
+   for(int i = 0; i < num_threads; ++i) {
+      boost::shared_ptr<server> s(new server());
+      s->mode = mode;
+      s->evbase = event_base_new();
+      s->chunk.assign(source_chunk, 'x');
+      s->listener = evconnlistener_new_bind(s->evbase, on_accept, s.get(),
+                                            LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT, -1,
+                                            (struct sockaddr*)&addr, addr_len);
+      if(!s->listener) {
+         std::cerr << "Error: Could not listen on " << endpoint << ": "
+                   << evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()) << std::endl;
+         return 1;
+      }
+      servers.push_back(s);
+   }
+   boost::thread_group threads;
+   for(size_t i = 0; i < servers.size(); ++i)
+      threads.create_thread(boost::bind(run, servers[i].get()));
+   // Runs until killed; the benchmark driver terminates it
+   threads.join_all();
+   return 0;
+}
@@ -0,0 +1,377 @@
+//
+// Load generator
+//
+// Drives a TCP endpoint (normally tcpproxy in front of bench_backend) from
+// several threads, one blocking connection per thread, and prints one JSON
+// object per run so results can be collected and compared across versions.
+//
+//   stream  each thread writes as fast as it can (backend: sink)
+//   rr      each thread sends a request and waits for the echo (backend: echo)
+//   churn   like rr, but every request uses a fresh connection (backend: echo)
+//   tls-full     like churn over TLS, with a full handshake every time
+//                (tcpproxy --tls-cert; backend: echo)
+//   tls-resumed  like tls-full, resuming the previous connection's session
+//
+// usage: loadgen <host> <port> stream|rr|churn|tls-full|tls-resumed
+//                [--threads n] [--duration s] [--size bytes] [--label text]
+//
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <atomic>
+
+extern "C" {
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <event2/util.h>
+}
+
+#include <openssl/ssl.h>
+
+#include "../latency_histogram.h"
+#include "../proxy_clock.h"
+
+namespace
+{
+   using tcp_proxy::latency_histogram;
+   using tcp_proxy::monotonic_usec;
+
+   struct config
+   {
+      config()
+         : threads(8), duration_s(5), size(64)
+         {}
+
+      struct sockaddr_storage addr;
+      int addr_len;
+      std::string scenario;
+      unsigned int threads;
+      unsigned int duration_s;
+      size_t size;
+      std::string label;
+   };
+
+   // What one thread measured; only that thread writes it
+   struct thread_result
+   {
+      thread_result()
+         : bytes(0), requests(0), connections(0), resumed(0), errors(0)
+         {}
+
+      uint64_t bytes;
+      uint64_t requests;
+      uint64_t connections;
+      uint64_t resumed;   // TLS handshakes that resumed a session
+      uint64_t errors;
+      latency_histogram latency_usec;
+   };
+
+   std::atomic<bool> running(true);
+
+   int open_connection(const config& cfg)
+   {
+      int fd = socket(cfg.addr.ss_family, SOCK_STREAM, 0);
+      if(fd < 0)
+         return -1;
+      if(connect(fd, (struct sockaddr*)&cfg.addr, cfg.addr_len) != 0) {
+         close(fd);
+         return -1;
+      }
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      // Never hang the run on a stuck connection
+      struct timeval tv = { 5, 0 };
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+      return fd;
+   }
+
+   // Resets instead of closing, so the client side leaves no TIME_WAIT
+   // behind and churn runs do not exhaust the ephemeral ports.
+   void abort_connection(int fd)
+   {
+      struct linger l = { 1, 0 };
+      setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+      close(fd);
+   }
+
+   bool send_all(int fd, const char* data, size_t len)
+   {
+      while(len > 0) {
+         ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+         if(n <= 0) {
+            if(n < 0 && errno == EINTR)
+               continue;
+            return false;
+         }
+         data += n;
+         len -= n;
+      }
+      return true;
+   }
+
+   bool recv_all(int fd, char* data, size_t len)
+   {
+      while(len > 0) {
+         ssize_t n = recv(fd, data, len, 0);
+         if(n <= 0) {
+            if(n < 0 && errno == EINTR)
+               continue;
+            return false;
+         }
+         data += n;
+         len -= n;
+      }
+      return true;
+   }
+
+   void run_stream(const config& cfg, thread_result& r)
+   {
+      std::vector<char> chunk(std::max<size_t>(cfg.size, 65536), 'x');
+      int fd = open_connection(cfg);
+      if(fd < 0) {
+         r.errors++;
+         return;
+      }
+      r.connections++;
+      while(running.load(std::memory_order_relaxed)) {
+         ssize_t n = send(fd, &chunk[0], chunk.size(), MSG_NOSIGNAL);
+         if(n <= 0) {
+            if(n < 0 && errno == EINTR)
+               continue;
+            r.errors++;
+            break;
+         }
+         r.bytes += n;
+      }
+      abort_connection(fd);
+   }
+
+   // One request per connection when `churn` is set
+   void run_request_response(const config& cfg, thread_result& r, bool churn)
+   {
+      std::vector<char> request(cfg.size, 'x'), reply(cfg.size);
+      int fd = -1;
+      while(running.load(std::memory_order_relaxed)) {
+         const uint64_t start = monotonic_usec();
+         if(fd < 0) {
+            fd = open_connection(cfg);
+            if(fd < 0) {
+               r.errors++;
+               usleep(1000);
+               continue;
+            }
+            r.connections++;
+         }
+         if(!send_all(fd, &request[0], request.size()) || !recv_all(fd, &reply[0], reply.size())) {
+            r.errors++;
+            abort_connection(fd);
+            fd = -1;
+            continue;
+         }
+         r.latency_usec.record(monotonic_usec() - start);
+         r.requests++;
+         r.bytes += 2 * cfg.size;
+         if(churn) {
+            abort_connection(fd);
+            fd = -1;
+         }
+      }
+      if(fd >= 0)
+         abort_connection(fd);
+   }
+
+   bool tls_write_all(SSL* ssl, const char* data, size_t len)
+   {
+      while(len > 0) {
+         const int n = SSL_write(ssl, data, static_cast<int>(len));
+         if(n <= 0)
+            return false;
+         data += n;
+         len -= n;
+      }
+      return true;
+   }
+
+   bool tls_read_all(SSL* ssl, char* data, size_t len)
+   {
+      while(len > 0) {
+         const int n = SSL_read(ssl, data, static_cast<int>(len));
+         if(n <= 0)
+            return false;
+         data += n;
+         len -= n;
+      }
+      return true;
+   }
+
+   // One handshake and one request per connection; the latency includes
+   // the handshake. Resuming offers the session of the last connection,
+   // whose tickets (TLS 1.3) have arrived by the time its reply has.
+   void run_tls(const config& cfg, thread_result& r, SSL_CTX* ctx, bool resume)
+   {
+      std::vector<char> request(cfg.size, 'x'), reply(cfg.size);
+      SSL_SESSION* session = NULL;
+      while(running.load(std::memory_order_relaxed)) {
+         const uint64_t start = monotonic_usec();
+         int fd = open_connection(cfg);
+         if(fd < 0) {
+            r.errors++;
+            usleep(1000);
+            continue;
+         }
+         r.connections++;
+         SSL* ssl = SSL_new(ctx);
+         SSL_set_fd(ssl, fd);
+         if(session)
+            SSL_set_session(ssl, session);
+         if(SSL_connect(ssl) != 1 || !tls_write_all(ssl, &request[0], request.size()) ||
+            !tls_read_all(ssl, &reply[0], reply.size())) {
+            r.errors++;
+         } else {
+            r.latency_usec.record(monotonic_usec() - start);
+            r.requests++;
+            r.bytes += 2 * cfg.size;
+            if(SSL_session_reused(ssl))
+               r.resumed++;
+            if(resume) {
+               if(session)
+                  SSL_SESSION_free(session);
+               session = SSL_get1_session(ssl);
+            }
+         }
+         // Freed without a shutdown, the session would no longer resume
+         SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN);
+         SSL_free(ssl);
+         abort_connection(fd);
+      }
+      if(session)
+         SSL_SESSION_free(session);
+   }
+
+   void run_thread(const config& cfg, thread_result* r, SSL_CTX* tls)
+   {
+      if(cfg.scenario == "stream")
+         run_stream(cfg, *r);
+      else if(tls)
+         run_tls(cfg, *r, tls, cfg.scenario == "tls-resumed");
+      else
+         run_request_response(cfg, *r, cfg.scenario == "churn");
+   }
+
+   bool parse(int argc, char* argv[], config& cfg)
+   {
+      if(argc < 4)
+         return false;
+      const std::string endpoint = std::string(argv[1]) + ":" + argv[2];
+      cfg.addr_len = sizeof(cfg.addr);
+      if(evutil_parse_sockaddr_port(endpoint.c_str(), (struct sockaddr*)&cfg.addr, &cfg.addr_len) != 0) {
+         std::cerr << "Error: Invalid address " << endpoint << std::endl;
+         return false;
+      }
+      cfg.scenario = argv[3];
+      if(cfg.scenario != "stream" && cfg.scenario != "rr" && cfg.scenario != "churn" &&
+         cfg.scenario != "tls-full" && cfg.scenario != "tls-resumed") {
+         std::cerr << "Error: Unknown scenario " << cfg.scenario << std::endl;
+         return false;
+      }
+      cfg.label = cfg.scenario;
+      for(int i = 4; i + 1 < argc; i += 2) {
+         const std::string name = argv[i], value = argv[i + 1];
+         try
+         {
+            if(name == "--threads")
+               cfg.threads = std::max(1u, boost::lexical_cast<unsigned int>(value));
+            else if(name == "--duration")
+               cfg.duration_s = std::max(1u, boost::lexical_cast<unsigned int>(value));
+            else if(name == "--size")
+               cfg.size = std::max<size_t>(1, boost::lexical_cast<size_t>(value));
+            else if(name == "--label")
+               cfg.label = value;
+            else {
+               std::cerr << "Error: Unknown option " << name << std::endl;
+               return false;
+            }
+         } catch(boost::bad_lexical_cast&) {
+            std::cerr << "Error: Invalid value '" << value << "' for option " << name << std::endl;
+            return false;
+         }
+      }
+      return true;
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   config cfg;
+   if(!parse(argc, argv, cfg)) {
+      std::cerr << "usage: loadgen <host> <port> stream|rr|churn|tls-full|tls-resumed [--threads n] [--duration s] [--size bytes] [--label text]" << std::endl;
+      return 1;
+   }
+   signal(SIGPIPE, SIG_IGN);
+   // Shared by the threads; the proxy's certificate is self-signed in tests
+   SSL_CTX* tls = NULL;
+   if(cfg.scenario.compare(0, 4, "tls-") == 0) {
+      tls = SSL_CTX_new(TLS_client_method());
+      SSL_CTX_set_verify(tls, SSL_VERIFY_NONE, NULL);
+   }
+
+   std::vector<boost::shared_ptr<thread_result> > results;
+   boost::thread_group threads;
+   const uint64_t start = monotonic_usec();
+   for(unsigned int i = 0; i < cfg.threads; ++i) {
+      results.push_back(boost::shared_ptr<thread_result>(new thread_result()));
+      threads.create_thread(boost::bind(run_thread, boost::cref(cfg), results.back().get(), tls));
+   }
+   usleep(cfg.duration_s * 1000000);
+   running.store(false);
+   // Threads blocked on a stalled peer give up after the socket timeouts
+   threads.join_all();
+   const double elapsed = (monotonic_usec() - start) / 1e6;
+
+   if(tls)
+      SSL_CTX_free(tls);
+
+   uint64_t bytes = 0, requests = 0, connections = 0, resumed = 0, errors = 0;
+   latency_histogram::snapshot latency;
+   for(size_t i = 0; i < results.size(); ++i) {
+      bytes += results[i]->bytes;
+      requests += results[i]->requests;
+      connections += results[i]->connections;
+      resumed += results[i]->resumed;
+      errors += results[i]->errors;
+      latency.add(results[i]->latency_usec);
+   }
+   std::cout << "{\"label\":\"" << cfg.label << "\""
+             << ",\"scenario\":\"" << cfg.scenario << "\""
+             << ",\"threads\":" << cfg.threads
+             << ",\"size\":" << cfg.size
+             << ",\"seconds\":" << elapsed
+             << ",\"bytes\":" << bytes
+             << ",\"gbit_per_sec\":" << bytes * 8 / elapsed / 1e9
+             << ",\"requests\":" << requests
+             << ",\"requests_per_sec\":" << requests / elapsed
+             << ",\"connections\":" << connections
+             << ",\"connections_per_sec\":" << connections / elapsed
+             << ",\"resumed\":" << resumed
+             << ",\"errors\":" << errors
+             << ",\"p50_us\":" << latency.quantile(0.5)
+             << ",\"p99_us\":" << latency.quantile(0.99)
+             << ",\"p999_us\":" << latency.quantile(0.999)
+             << "}" << std::endl;
+   return errors && !requests && !bytes ? 1 : 0;
+}
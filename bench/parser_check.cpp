@@ -0,0 +1,310 @@
+//
+// Parser check
+//
+// Feeds the ClientHello SNI parser and the PROXY header parser truncated,
+// oversized and malformed input and checks that each is reported as
+// incomplete, invalid or not found. Every input is copied into a heap
+// buffer of exactly its size, so built with -fsanitize=address (as the
+// Makefile does) any read past the end aborts the run.
+//
+// usage: parser_check [random mutations per input, default 100000]
+//
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../sni_router.h"
+#include "../proxy_protocol.h"
+
+namespace
+{
+   typedef std::vector<unsigned char> bytes;
+
+   int failures = 0;
+
+   void check(bool ok, const std::string& what)
+   {
+      if(!ok) {
+         std::cerr << "FAIL: " << what << std::endl;
+         ++failures;
+      }
+   }
+
+   void put16(bytes& b, size_t n)
+   {
+      b.push_back(static_cast<unsigned char>(n >> 8));
+      b.push_back(static_cast<unsigned char>(n));
+   }
+
+   // Rewrites the 16-bit length at `at`
+   void set16(bytes& b, size_t at, size_t n)
+   {
+      b[at] = static_cast<unsigned char>(n >> 8);
+      b[at + 1] = static_cast<unsigned char>(n);
+   }
+
+   // The parsers only ever see data[0, len), held here in a buffer of
+   // exactly that size
+   tcp_proxy::sni_parse_result sni(const bytes& in, std::string* found = NULL)
+   {
+      char* buf = new char[in.size() ? in.size() : 1];
+      if(!in.empty())
+         memcpy(buf, &in[0], in.size());
+      const char* name = NULL;
+      size_t name_len = 0;
+      const tcp_proxy::sni_parse_result r = tcp_proxy::parse_client_hello_sni(buf, in.size(), name, name_len);
+      if(r == tcp_proxy::sni_found) {
+         check(name >= buf && name + name_len <= buf + in.size(), "sni name points outside the input");
+         if(found)
+            found->assign(name, name_len);
+      }
+      delete[] buf;
+      return r;
+   }
+
+   tcp_proxy::proxy_parse_result proxy(const bytes& in, size_t* consumed = NULL)
+   {
+      char* buf = new char[in.size() ? in.size() : 1];
+      if(!in.empty())
+         memcpy(buf, &in[0], in.size());
+      struct sockaddr_storage src, dst;
+      size_t n = 0;
+      const tcp_proxy::proxy_parse_result r = tcp_proxy::parse_proxy_header(buf, in.size(), src, dst, n);
+      if(r == tcp_proxy::proxy_parse_done) {
+         check(n > 0 && n <= in.size(), "proxy header consumed more than the input");
+         if(consumed)
+            *consumed = n;
+      }
+      delete[] buf;
+      return r;
+   }
+
+   bytes text(const std::string& s)
+   {
+      return bytes(s.begin(), s.end());
+   }
+
+   // Offsets of the length fields in the hello built below
+   struct hello_layout
+   {
+      size_t session_id, cipher_suites, compression, extensions, server_name, server_name_list;
+   };
+
+   // A ClientHello in one record: an unrelated extension, then server_name
+   // carrying `host`
+   bytes client_hello(const std::string& host, hello_layout& at)
+   {
+      bytes b;
+      b.push_back(0x16); b.push_back(0x03); b.push_back(0x01);
+      put16(b, 0);                               // record length
+      b.push_back(0x01);                         // ClientHello
+      b.push_back(0); put16(b, 0);               // handshake length, unchecked
+      b.push_back(0x03); b.push_back(0x03);
+      b.insert(b.end(), 32, 0xab);               // random
+      at.session_id = b.size();
+      b.push_back(32); b.insert(b.end(), 32, 0xcd);
+      at.cipher_suites = b.size();
+      put16(b, 4); put16(b, 0x1301); put16(b, 0x1302);
+      at.compression = b.size();
+      b.push_back(1); b.push_back(0);
+      at.extensions = b.size();
+      put16(b, 0);
+      put16(b, 0x002b); put16(b, 3); b.push_back(2); put16(b, 0x0304);   // supported_versions
+      put16(b, 0x0000);
+      at.server_name = b.size();
+      put16(b, 2 + 3 + host.size());
+      at.server_name_list = b.size();
+      put16(b, 3 + host.size());
+      b.push_back(0x00); put16(b, host.size());
+      b.insert(b.end(), host.begin(), host.end());
+      set16(b, at.extensions, b.size() - at.extensions - 2);
+      set16(b, 3, b.size() - 5);
+      return b;
+   }
+
+   void check_sni(unsigned int mutations)
+   {
+      using namespace tcp_proxy;
+      hello_layout at;
+      const bytes hello = client_hello("backend.example.com", at);
+      std::string name;
+      check(sni(hello, &name) == sni_found && name == "backend.example.com", "sni: well-formed hello");
+
+      // Truncated: every prefix of the record is still arriving
+      for(size_t len = 0; len < hello.size(); ++len)
+         check(sni(bytes(hello.begin(), hello.begin() + len)) == sni_incomplete, "sni: truncated hello");
+
+      bytes b = hello;
+      b[0] = 0x17;
+      check(sni(b) == sni_not_found, "sni: not a handshake record");
+      b = hello;
+      b[1] = 0x02;
+      check(sni(b) == sni_not_found, "sni: not TLS 1.x");
+      b = hello;
+      b[5] = 0x02;
+      check(sni(b) == sni_not_found, "sni: not a ClientHello");
+
+      // Oversized: a record longer than TLS allows, complete or not
+      b = hello;
+      set16(b, 3, tls_record_max - 5 + 1);
+      check(sni(b) == sni_not_found, "sni: oversized record");
+      b.resize(tls_record_max + 1, 0);
+      check(sni(b) == sni_not_found, "sni: oversized record, fully present");
+
+      // A record too short for the fixed part of the hello
+      b = bytes(hello.begin(), hello.begin() + 5 + 10);
+      set16(b, 3, 10);
+      check(sni(b) == sni_not_found, "sni: record shorter than a hello");
+
+      // Lengths pointing past the end of the record
+      b = hello;
+      b[at.session_id] = 0xff;
+      check(sni(b) == sni_not_found, "sni: session id past the end");
+      b = hello;
+      set16(b, at.cipher_suites, 0xfff0);
+      check(sni(b) == sni_not_found, "sni: cipher suites past the end");
+      b = hello;
+      b[at.compression] = 0xff;
+      check(sni(b) == sni_not_found, "sni: compression methods past the end");
+      b = hello;
+      set16(b, at.server_name, 0x4000);
+      check(sni(b) == sni_not_found, "sni: extension past the end");
+      b = hello;
+      set16(b, at.server_name_list + 3, 0x4000);
+      check(sni(b) == sni_not_found, "sni: host name past the end");
+
+      // The record ends inside the extensions
+      for(size_t cut = at.extensions; cut < hello.size(); ++cut) {
+         b = bytes(hello.begin(), hello.begin() + cut);
+         set16(b, 3, cut - 5);
+         check(sni(b) == sni_not_found, "sni: record cut inside the extensions");
+      }
+
+      // A server_name extension shorter than its 2-byte list length, last
+      // in the record
+      for(size_t n = 0; n < 2; ++n) {
+         b = bytes(hello.begin(), hello.begin() + at.server_name);
+         put16(b, n);
+         b.insert(b.end(), n, 0);
+         set16(b, at.extensions, b.size() - at.extensions - 2);
+         set16(b, 3, b.size() - 5);
+         check(sni(b) == sni_not_found, "sni: server_name list shorter than 2 bytes");
+      }
+
+      // An empty host name, and only names of another type
+      hello_layout empty_at;
+      check(sni(client_hello("", empty_at)) == sni_not_found, "sni: empty host name");
+      b = hello;
+      b[at.server_name_list + 2] = 0x01;
+      check(sni(b) == sni_not_found, "sni: no host_name entry");
+
+      srand(42);
+      for(unsigned int i = 0; i < mutations; ++i) {
+         b = hello;
+         for(int k = 1 + rand() % 4; k > 0; --k)
+            b[5 + rand() % (b.size() - 5)] = static_cast<unsigned char>(rand());
+         if(rand() % 2)
+            b.resize(rand() % (b.size() + 1));
+         sni(b);   // any result will do, so long as nothing outside is read
+      }
+   }
+
+   bytes proxy_v2(unsigned char version_command, unsigned char family, const bytes& addresses)
+   {
+      bytes b(tcp_proxy::proxy_v2_signature, tcp_proxy::proxy_v2_signature + sizeof(tcp_proxy::proxy_v2_signature));
+      b.push_back(version_command);
+      b.push_back(family);
+      put16(b, addresses.size());
+      b.insert(b.end(), addresses.begin(), addresses.end());
+      return b;
+   }
+
+   void check_proxy(unsigned int mutations)
+   {
+      using namespace tcp_proxy;
+      const bytes v1 = text("PROXY TCP4 192.0.2.1 198.51.100.7 51234 443\r\n");
+      size_t consumed = 0;
+      check(proxy(v1, &consumed) == proxy_parse_done && consumed == v1.size(), "proxy: well-formed v1");
+      for(size_t len = 0; len < v1.size(); ++len)
+         check(proxy(bytes(v1.begin(), v1.begin() + len)) == proxy_parse_incomplete, "proxy: truncated v1");
+
+      // v1 lines without the \r
+      check(proxy(text("PROXY TCP4 192.0.2.1 198.51.100.7 51234 443\n")) == proxy_parse_invalid, "proxy: v1 without \\r");
+      check(proxy(text("PROXY UNKNOWN\n")) == proxy_parse_invalid, "proxy: v1 UNKNOWN without \\r");
+      check(proxy(text("PROXY \n")) == proxy_parse_invalid, "proxy: empty v1 without \\r");
+
+      // Oversized: no line end within the longest v1 line
+      check(proxy(text("PROXY " + std::string(proxy_header_max, 'x'))) == proxy_parse_invalid, "proxy: v1 without a line end");
+      check(proxy(text("PROXY " + std::string(proxy_header_max, 'x') + "\r\n")) == proxy_parse_invalid, "proxy: v1 too long");
+
+      // Malformed v1
+      check(proxy(text("GET / HTTP/1.1\r\n")) == proxy_parse_invalid, "proxy: not a PROXY line");
+      check(proxy(text("PROXY\r\n")) == proxy_parse_invalid, "proxy: v1 without a protocol");
+      check(proxy(text("PROXY \r\n")) == proxy_parse_invalid, "proxy: v1 with an empty protocol");
+      check(proxy(text("PROXY TCP5 192.0.2.1 198.51.100.7 1 2\r\n")) == proxy_parse_invalid, "proxy: v1 unknown protocol");
+      check(proxy(text("PROXY TCP4 192.0.2.1 198.51.100.7 1\r\n")) == proxy_parse_invalid, "proxy: v1 missing a port");
+      check(proxy(text("PROXY TCP4 192.0.2.1 198.51.100.7 70000 2\r\n")) == proxy_parse_invalid, "proxy: v1 port out of range");
+      check(proxy(text("PROXY TCP4 192.0.2.256 198.51.100.7 1 2\r\n")) == proxy_parse_invalid, "proxy: v1 bad address");
+      check(proxy(text("PROXY TCP6 192.0.2.1 198.51.100.7 1 2\r\n")) == proxy_parse_invalid, "proxy: v1 address of the wrong family");
+      check(proxy(text("PROXY TCP4 " + std::string(60, '1') + " 198.51.100.7 1 2\r\n")) == proxy_parse_invalid,
+            "proxy: v1 address too long");
+
+      bytes addresses(12, 0);
+      addresses[0] = 192; addresses[3] = 1; addresses[4] = 198; addresses[7] = 7;
+      const bytes v2 = proxy_v2(0x21, 0x11, addresses);
+      check(proxy(v2, &consumed) == proxy_parse_done && consumed == v2.size(), "proxy: well-formed v2");
+      for(size_t len = 0; len < v2.size(); ++len)
+         check(proxy(bytes(v2.begin(), v2.begin() + len)) == proxy_parse_incomplete, "proxy: truncated v2");
+
+      // v2 headers whose length runs past the 1024 bytes accepted
+      bytes b = v2;
+      set16(b, 14, proxy_header_accept_max - 16 + 1);
+      check(proxy(b) == proxy_parse_invalid, "proxy: v2 longer than accepted");
+      b.resize(proxy_header_accept_max + 1, 0);
+      check(proxy(b) == proxy_parse_invalid, "proxy: v2 longer than accepted, fully present");
+      b = v2;
+      set16(b, 14, 0xffff);
+      check(proxy(b) == proxy_parse_invalid, "proxy: v2 with the largest length");
+      // The longest accepted header is still waiting for its TLVs
+      b = v2;
+      set16(b, 14, proxy_header_accept_max - 16);
+      check(proxy(b) == proxy_parse_incomplete, "proxy: v2 at the accepted maximum");
+
+      // Malformed v2
+      b = v2;
+      b[7] = 'q';
+      check(proxy(b) == proxy_parse_invalid, "proxy: v2 bad signature");
+      check(proxy(proxy_v2(0x11, 0x11, addresses)) == proxy_parse_invalid, "proxy: v2 bad version");
+      check(proxy(proxy_v2(0x22, 0x11, addresses)) == proxy_parse_invalid, "proxy: v2 bad command");
+      check(proxy(proxy_v2(0x21, 0x11, bytes(4, 0))) == proxy_parse_invalid, "proxy: v2 TCP4 addresses cut short");
+      check(proxy(proxy_v2(0x21, 0x21, bytes(12, 0))) == proxy_parse_invalid, "proxy: v2 TCP6 addresses cut short");
+
+      srand(42);
+      for(unsigned int i = 0; i < mutations; ++i) {
+         b = rand() % 2 ? v1 : v2;
+         for(int k = 1 + rand() % 4; k > 0; --k)
+            b[rand() % b.size()] = static_cast<unsigned char>(rand());
+         if(rand() % 2)
+            b.resize(rand() % (proxy_header_accept_max + 64), static_cast<unsigned char>(rand()));
+         proxy(b);
+      }
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   const unsigned int mutations = argc > 1 ? static_cast<unsigned int>(atoi(argv[1])) : 100000;
+
+   check_sni(mutations);
+   check_proxy(mutations);
+
+   if(failures) {
+      std::cerr << failures << " check(s) failed" << std::endl;
+      return 1;
+   }
+   std::cout << "parser checks passed" << std::endl;
+   return 0;
+}
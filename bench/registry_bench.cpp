@@ -0,0 +1,103 @@
+//
+// Bridge registry benchmark
+//
+// Measures the per-bridge cost of registering and tearing down bridges as
+// the number of live bridges grows. The slot map used by the acceptor is
+// compared against the linear vector scan it replaced (only up to a size
+// where the quadratic scan still finishes in reasonable time).
+//
+// usage: registry_bench [max live bridges, default 1000000]
+//
+
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <boost/shared_ptr.hpp>
+
+extern "C" {
+#include <time.h>
+}
+
+#include "../slot_map.h"
+
+namespace
+{
+   struct fake_bridge
+   {
+      tcp_proxy::slot_map<boost::shared_ptr<fake_bridge> >::handle_type handle;
+   };
+
+   typedef boost::shared_ptr<fake_bridge> bridge_ptr;
+
+   double now_ns()
+   {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec * 1e9 + ts.tv_nsec;
+   }
+
+   // Teardown order is shuffled: connections do not close in accept order.
+   std::vector<size_t> shuffled_order(size_t n)
+   {
+      std::vector<size_t> order(n);
+      for(size_t i = 0; i < n; ++i)
+         order[i] = i;
+      srand(42);
+      for(size_t i = n - 1; i > 0; --i)
+         std::swap(order[i], order[rand() % (i + 1)]);
+      return order;
+   }
+
+   void bench_slot_map(size_t n, const std::vector<bridge_ptr>& bridges, const std::vector<size_t>& order)
+   {
+      tcp_proxy::slot_map<bridge_ptr> registry;
+      double t0 = now_ns();
+      for(size_t i = 0; i < n; ++i)
+         bridges[i]->handle = registry.insert(bridges[i]);
+      double t1 = now_ns();
+      for(size_t i = 0; i < n; ++i)
+         registry.erase(bridges[order[i]]->handle);
+      double t2 = now_ns();
+      std::cout << "slot_map     " << n << "\t" << (t1 - t0) / n << "\t" << (t2 - t1) / n << std::endl;
+   }
+
+   void bench_vector_scan(size_t n, const std::vector<bridge_ptr>& bridges, const std::vector<size_t>& order)
+   {
+      std::vector<bridge_ptr> registry;
+      double t0 = now_ns();
+      for(size_t i = 0; i < n; ++i)
+         registry.push_back(bridges[i]);
+      double t1 = now_ns();
+      for(size_t i = 0; i < n; ++i) {
+         fake_bridge* b = bridges[order[i]].get();
+         for(std::vector<bridge_ptr>::iterator it = registry.begin(); it < registry.end(); it++) {
+            if((*it).get() == b) {
+               registry.erase(it);
+               break;
+            }
+         }
+      }
+      double t2 = now_ns();
+      std::cout << "vector_scan  " << n << "\t" << (t1 - t0) / n << "\t" << (t2 - t1) / n << std::endl;
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   const size_t max_live = (argc > 1) ? static_cast<size_t>(::atol(argv[1])) : 1000000;
+   const size_t max_scan = 100000;
+
+   std::cout << "registry     live\tinsert ns/op\tteardown ns/op" << std::endl;
+   for(size_t n = 1000; n <= max_live; n *= 10) {
+      std::vector<bridge_ptr> bridges(n);
+      for(size_t i = 0; i < n; ++i)
+         bridges[i].reset(new fake_bridge());
+      const std::vector<size_t> order = shuffled_order(n);
+
+      bench_slot_map(n, bridges, order);
+      if(n <= max_scan)
+         bench_vector_scan(n, bridges, order);
+   }
+   return 0;
+}
@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# End-to-end benchmark: runs every load generator scenario against
+# bench_backend directly and through tcpproxy, over loopback, and prints
+# one JSON object per run. Arguments are passed on to tcpproxy. With the
+# openssl tool at hand, full and resumed TLS handshakes are measured as
+# well, against a terminating tcpproxy with a throwaway self-signed
+# certificate.
+#
+# usage: bench/run_bench.sh [tcpproxy options]
+#
+# Environment:
+#   BENCH_DURATION  seconds per run (default 5)
+#   BENCH_THREADS   load generator threads (default 8)
+#   BENCH_OUT       file the JSON lines are appended to as well
+#
+
+cd "$(dirname "$0")/.." || exit 1
+
+DURATION=${BENCH_DURATION:-5}
+THREADS=${BENCH_THREADS:-8}
+HOST=127.0.0.1
+SINK_PORT=19001
+ECHO_PORT=19002
+PROXY_SINK_PORT=19101
+PROXY_ECHO_PORT=19102
+PROXY_TLS_PORT=19103
+TLS_DIR=""
+
+PIDS=""
+cleanup()
+{
+   if [ -n "$PIDS" ]; then
+      kill $PIDS 2>/dev/null
+   fi
+   wait 2>/dev/null
+   if [ -n "$TLS_DIR" ]; then
+      rm -rf "$TLS_DIR"
+   fi
+}
+trap cleanup EXIT INT TERM
+
+./bench/bench_backend $HOST $SINK_PORT sink & PIDS="$PIDS $!"
+./bench/bench_backend $HOST $ECHO_PORT echo & PIDS="$PIDS $!"
+./tcpproxy $HOST $PROXY_SINK_PORT $HOST $SINK_PORT 0 --log-level error "$@" & PIDS="$PIDS $!"
+./tcpproxy $HOST $PROXY_ECHO_PORT $HOST $ECHO_PORT 0 --log-level error "$@" & PIDS="$PIDS $!"
+if command -v openssl >/dev/null 2>&1; then
+   TLS_DIR=$(mktemp -d)
+   if openssl req -x509 -newkey rsa:2048 -nodes -keyout "$TLS_DIR/key.pem" -out "$TLS_DIR/cert.pem" \
+         -days 1 -subj /CN=localhost >/dev/null 2>&1; then
+      ./tcpproxy $HOST $PROXY_TLS_PORT $HOST $ECHO_PORT 0 --log-level error "$@" \
+         --tls-cert "$TLS_DIR/cert.pem" --tls-key "$TLS_DIR/key.pem" & PIDS="$PIDS $!"
+   else
+      TLS_DIR=""
+   fi
+fi
+sleep 1
+
+run()
+{
+   # run <label> <port> <scenario> <size>
+   line=$(./bench/loadgen $HOST "$2" "$3" --threads "$THREADS" --duration "$DURATION" --size "$4" --label "$1")
+   echo "$line"
+   if [ -n "$BENCH_OUT" ]; then
+      echo "$line" >> "$BENCH_OUT"
+   fi
+}
+
+for target in direct proxy; do
+   if [ $target = direct ]; then
+      sink=$SINK_PORT; echo_port=$ECHO_PORT
+   else
+      sink=$PROXY_SINK_PORT; echo_port=$PROXY_ECHO_PORT
+   fi
+   run "$target-stream" $sink stream 65536
+   run "$target-rr" $echo_port rr 64
+   run "$target-churn" $echo_port churn 64
+done
+if [ -n "$TLS_DIR" ]; then
+   # Handshakes per second are the requests per second here
+   run "proxy-tls-full" $PROXY_TLS_PORT tls-full 64
+   run "proxy-tls-resumed" $PROXY_TLS_PORT tls-resumed 64
+fi
@@ -0,0 +1,166 @@
+#ifndef _CPU_AFFINITY_H
+#define _CPU_AFFINITY_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <linux/filter.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+}
+
+#include <boost/lexical_cast.hpp>
+
+#include "proxy_log.h"
+
+namespace tcp_proxy
+{
+   // How a new connection finds the worker on the CPU that took its packets
+   enum steering_mode
+   {
+      steer_off,            // the kernel's reuseport hash picks the listener
+      steer_incoming_cpu,   // each listener claims its worker's CPU (SO_INCOMING_CPU)
+      steer_bpf             // a reuseport program maps the receiving CPU to a listener
+   };
+
+   // Worker i is pinned to cpus[i % cpus.size()]; no pinning when empty
+   struct affinity_options
+   {
+      affinity_options()
+         : steering(steer_off)
+         {}
+
+      int cpu_of(unsigned int worker) const
+         {
+            return cpus.empty() ? -1 : cpus[worker % cpus.size()];
+         }
+
+      std::vector<int> cpus;
+      steering_mode steering;
+   };
+
+   // The CPUs this process may run on, in ascending order
+   inline std::vector<int> allowed_cpus()
+   {
+      std::vector<int> cpus;
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+         for(int c = 0; c < CPU_SETSIZE; ++c) {
+            if(CPU_ISSET(c, &set))
+               cpus.push_back(c);
+         }
+      }
+      return cpus;
+   }
+
+   // Parses "0-3,8,10-11"
+   inline bool parse_cpu_list(const std::string& value, std::vector<int>& cpus)
+   {
+      cpus.clear();
+      size_t start = 0;
+      while(start <= value.size()) {
+         size_t end = value.find(',', start);
+         if(end == std::string::npos)
+            end = value.size();
+         const std::string item = value.substr(start, end - start);
+         const size_t dash = item.find('-');
+         try
+         {
+            const int first = boost::lexical_cast<int>(item.substr(0, dash));
+            const int last = (dash == std::string::npos) ? first : boost::lexical_cast<int>(item.substr(dash + 1));
+            if(first < 0 || last < first || last >= CPU_SETSIZE)
+               return false;
+            for(int c = first; c <= last; ++c)
+               cpus.push_back(c);
+         } catch(boost::bad_lexical_cast&) {
+            return false;
+         }
+         start = end + 1;
+      }
+      return !cpus.empty();
+   }
+
+   inline bool pin_current_thread(int cpu)
+   {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      if(err) {
+         PROXY_LOG_WARN("Could not pin thread to CPU %d: %s", cpu, strerror(err));
+         return false;
+      }
+      return true;
+   }
+
+   // The CPU that last processed packets for the socket, -1 if unknown
+   inline int incoming_cpu(int fd)
+   {
+      int cpu = -1;
+      socklen_t len = sizeof(cpu);
+      if(getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0)
+         return -1;
+      return cpu;
+   }
+
+   // Since Linux 6.1 a reuseport group prefers the listener whose
+   // SO_INCOMING_CPU matches the CPU handling the SYN
+   inline bool set_incoming_cpu(int fd, int cpu)
+   {
+      if(setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) != 0) {
+         PROXY_LOG_WARN("Could not set SO_INCOMING_CPU on the listener: %s", strerror(errno));
+         return false;
+      }
+      return true;
+   }
+
+   // Attaches a classic BPF program to the reuseport group of `fd` that
+   // returns the index of the listener whose worker runs on the receiving
+   // CPU. Listeners are indexed in the order they started listening, so
+   // cpu_of_index[i] is the CPU of the i-th listener; a CPU without a
+   // worker falls back to cpu % listeners. Works from Linux 4.5.
+   inline bool attach_cpu_steering(int fd, const std::vector<int>& cpu_of_index)
+   {
+      const size_t n = cpu_of_index.size();
+      // Jump offsets are 8 bits wide
+      if(n == 0 || n > 250) {
+         PROXY_LOG_WARN("CPU steering supports 1 to 250 listeners, not %zu", n);
+         return false;
+      }
+      // ld cpu; jeq cpu_i -> ret i (for every i); A %= n; ret A
+      std::vector<struct sock_filter> code;
+      struct sock_filter ld = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU));
+      code.push_back(ld);
+      for(size_t i = 0; i < n; ++i) {
+         // From the i-th test, "ret i" is n + 1 instructions further on
+         struct sock_filter jeq = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(cpu_of_index[i]),
+                                           static_cast<uint8_t>(n + 1), 0);
+         code.push_back(jeq);
+      }
+      struct sock_filter mod = BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(n));
+      struct sock_filter ret_a = BPF_STMT(BPF_RET | BPF_A, 0);
+      code.push_back(mod);
+      code.push_back(ret_a);
+      for(size_t i = 0; i < n; ++i) {
+         struct sock_filter ret_i = BPF_STMT(BPF_RET | BPF_K, static_cast<uint32_t>(i));
+         code.push_back(ret_i);
+      }
+      struct sock_fprog prog;
+      prog.len = static_cast<unsigned short>(code.size());
+      prog.filter = &code[0];
+      if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+         PROXY_LOG_WARN("Could not attach the CPU steering program: %s", strerror(errno));
+         return false;
+      }
+      return true;
+   }
+}
+
+#endif // _CPU_AFFINITY_H
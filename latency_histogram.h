@@ -0,0 +1,112 @@
+#ifndef _LATENCY_HISTOGRAM_H
+#define _LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+namespace tcp_proxy
+{
+   // Log-bucketed histogram of microsecond latencies in the style of
+   // HdrHistogram: every power of two is split into 16 linear sub-buckets,
+   // so any recorded value is reported within 1/16 (6.25%) of itself
+   // across the whole 64-bit range. Like `counter`, it has one writer (the
+   // owning worker) and lock-free readers.
+   class latency_histogram
+   {
+   public:
+      static const unsigned int sub_bucket_bits = 4;
+      static const size_t sub_buckets = size_t(1) << sub_bucket_bits;
+      static const size_t num_buckets = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+      latency_histogram()
+         : count_(0), sum_(0)
+         {
+            for(size_t i = 0; i < num_buckets; ++i)
+               buckets_[i].store(0, std::memory_order_relaxed);
+         }
+
+      void record(uint64_t usec)
+         {
+            std::atomic<uint64_t>& b = buckets_[bucket_of(usec)];
+            b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            count_.store(count_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            sum_.store(sum_.load(std::memory_order_relaxed) + usec, std::memory_order_relaxed);
+         }
+
+      static size_t bucket_of(uint64_t v)
+         {
+            if(v < sub_buckets)
+               return static_cast<size_t>(v);
+            const unsigned int shift = (63 - __builtin_clzll(v)) - sub_bucket_bits;
+            return (shift + 1) * sub_buckets + static_cast<size_t>((v >> shift) - sub_buckets);
+         }
+
+      // Largest value that lands in bucket i
+      static uint64_t bucket_upper(size_t i)
+         {
+            if(i < 2 * sub_buckets)
+               return i;
+            const unsigned int shift = static_cast<unsigned int>(i / sub_buckets) - 1;
+            const uint64_t lower = uint64_t(i % sub_buckets + sub_buckets) << shift;
+            return lower + ((uint64_t(1) << shift) - 1);
+         }
+
+      // A point-in-time copy that several histograms (one per worker) can
+      // be merged into before asking for percentiles
+      class snapshot
+      {
+      public:
+         snapshot()
+            : buckets_(num_buckets, 0), count_(0), sum_(0)
+            {}
+
+         void add(const latency_histogram& h)
+            {
+               for(size_t i = 0; i < num_buckets; ++i)
+                  buckets_[i] += h.buckets_[i].load(std::memory_order_relaxed);
+               count_ += h.count_.load(std::memory_order_relaxed);
+               sum_ += h.sum_.load(std::memory_order_relaxed);
+            }
+
+         uint64_t count() const { return count_; }
+         uint64_t sum() const { return sum_; }
+
+         // Value at quantile q (0..1), as the upper bound of its bucket
+         uint64_t quantile(double q) const
+            {
+               uint64_t total = 0;
+               for(size_t i = 0; i < num_buckets; ++i)
+                  total += buckets_[i];
+               if(total == 0)
+                  return 0;
+               uint64_t rank = static_cast<uint64_t>(q * total + 0.5);
+               if(rank == 0)
+                  rank = 1;
+               uint64_t seen = 0;
+               for(size_t i = 0; i < num_buckets; ++i) {
+                  seen += buckets_[i];
+                  if(seen >= rank)
+                     return bucket_upper(i);
+               }
+               return bucket_upper(num_buckets - 1);
+            }
+
+      private:
+         std::vector<uint64_t> buckets_;
+         uint64_t count_;
+         uint64_t sum_;
+      };
+
+   private:
+      latency_histogram(const latency_histogram&);
+      latency_histogram& operator=(const latency_histogram&);
+
+      std::atomic<uint64_t> buckets_[num_buckets];
+      std::atomic<uint64_t> count_;
+      std::atomic<uint64_t> sum_;
+   };
+}
+
+#endif // _LATENCY_HISTOGRAM_H
@@ -556,6 +556,10 @@ public:
     {
         return evconnlistener_get_base(mPtr);
     }
+    inline evutil_socket_t fd()
+    {
+        return evconnlistener_get_fd(mPtr);
+    }
     void setTcpNoDelay(int fd)
     {
         int one = 1;
@@ -153,9 +153,14 @@ public:
         }
         return false;
     }
-    inline bool bind(const IpAddr& sa)
+    inline bool bind(const IpAddr& sa, EvConnListener* connout = NULL)
     {
-        return bind(sa.toString().c_str(), sa.port());
+        return bind(sa.toString().c_str(), sa.port(), connout);
+    }
+    // Serves on a socket that is already listening
+    bool accept(evutil_socket_t fd)
+    {
+        return evhttp_accept_socket(mServer, fd) == 0;
     }
 
     static
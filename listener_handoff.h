@@ -0,0 +1,408 @@
+#ifndef _LISTENER_HANDOFF_H
+#define _LISTENER_HANDOFF_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+}
+
+#include "./lev-master/include/lev.h"
+#include "proxy_log.h"
+
+extern char** environ;
+
+namespace tcp_proxy
+{
+   // Reloading without dropping a connection: the running proxy passes its
+   // listening sockets to the process replacing it over a Unix socket
+   // (SCM_RIGHTS). The successor starts relaying on the very same sockets,
+   // so nothing queued on them is lost, and only then confirms; the old
+   // process stops accepting at that point and exits once its bridges have
+   // drained. A successor that dies before confirming leaves the old
+   // process serving as if nothing had happened.
+   //
+   // The exchange is one message from the old process, a fixed header with
+   // the listeners (one per worker) and the admin socket attached, and one
+   // byte back from the new one.
+   struct handoff_header
+   {
+      char magic[8];
+      uint32_t listeners;
+      uint32_t admin;   // 1 when the admin socket follows the listeners
+   };
+
+   static const char handoff_magic[8] = { 'T', 'C', 'P', 'P', 'X', 'Y', '0', '1' };
+   static const char handoff_ready = 'R';
+   // A successor started by the proxy itself finds its end of the socket here
+   static const char* const handoff_fd_env = "TCPPROXY_HANDOFF_FD";
+   static const int handoff_child_fd = 3;
+   // SCM_MAX_FD is 253 per message
+   static const size_t handoff_max_fds = 253;
+   // How long each side waits for the other
+   static const int handoff_timeout_s = 30;
+
+   inline bool send_handoff(int sock, const std::vector<int>& listeners, int admin_fd)
+   {
+      std::vector<int> fds(listeners);
+      if(admin_fd >= 0)
+         fds.push_back(admin_fd);
+      if(fds.empty() || fds.size() > handoff_max_fds) {
+         PROXY_LOG_ERROR("Cannot hand over %zu sockets in one message", fds.size());
+         return false;
+      }
+      handoff_header header;
+      memcpy(header.magic, handoff_magic, sizeof(header.magic));
+      header.listeners = static_cast<uint32_t>(listeners.size());
+      header.admin = admin_fd >= 0 ? 1 : 0;
+
+      std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()), 0);
+      struct iovec iov;
+      iov.iov_base = &header;
+      iov.iov_len = sizeof(header);
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = &control[0];
+      msg.msg_controllen = control.size();
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+      memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int) * fds.size());
+      if(sendmsg(sock, &msg, MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(header))) {
+         PROXY_LOG_ERROR("Could not send the listening sockets: %s", strerror(errno));
+         return false;
+      }
+      return true;
+   }
+
+   // The received descriptors are close-on-exec; admin_fd is -1 when the
+   // old process had no admin endpoint
+   inline bool receive_handoff(int sock, std::vector<int>& listeners, int& admin_fd)
+   {
+      listeners.clear();
+      admin_fd = -1;
+      handoff_header header;
+      std::vector<char> control(CMSG_SPACE(sizeof(int) * handoff_max_fds), 0);
+      struct iovec iov;
+      iov.iov_base = &header;
+      iov.iov_len = sizeof(header);
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = &control[0];
+      msg.msg_controllen = control.size();
+      const ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+      if(n < 0) {
+         PROXY_LOG_ERROR("Could not receive the listening sockets: %s", strerror(errno));
+         return false;
+      }
+      std::vector<int> fds;
+      for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+         if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+         const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+         const int* data = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+         fds.insert(fds.end(), data, data + count);
+      }
+      if(n != static_cast<ssize_t>(sizeof(header)) || memcmp(header.magic, handoff_magic, sizeof(handoff_magic)) != 0 ||
+         (msg.msg_flags & MSG_CTRUNC) || fds.size() != header.listeners + header.admin || !header.listeners) {
+         PROXY_LOG_ERROR("Malformed hand-off message (%zd bytes, %zu sockets)", n, fds.size());
+         for(size_t i = 0; i < fds.size(); ++i)
+            close(fds[i]);
+         return false;
+      }
+      listeners.assign(fds.begin(), fds.begin() + header.listeners);
+      if(header.admin)
+         admin_fd = fds.back();
+      return true;
+   }
+
+   // Tells the old process that the listeners are being served
+   inline bool send_handoff_ready(int sock)
+   {
+      if(send(sock, &handoff_ready, 1, MSG_NOSIGNAL) != 1) {
+         PROXY_LOG_ERROR("Could not confirm the hand-off: %s", strerror(errno));
+         return false;
+      }
+      return true;
+   }
+
+   inline bool unix_address(const std::string& path, struct sockaddr_un& addr)
+   {
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      if(path.size() >= sizeof(addr.sun_path)) {
+         PROXY_LOG_ERROR("Hand-off socket path is too long: %s", path.c_str());
+         return false;
+      }
+      memcpy(addr.sun_path, path.c_str(), path.size());
+      return true;
+   }
+
+   // The new process' side: a socket connected to the proxy to take over,
+   // either inherited from it or found at `path`; -1 when there is none
+   inline int handoff_connect(const std::string& path)
+   {
+      int sock = -1;
+      if(const char* inherited = getenv(handoff_fd_env)) {
+         sock = atoi(inherited);
+         unsetenv(handoff_fd_env);
+         if(sock < 0 || fcntl(sock, F_SETFD, FD_CLOEXEC) != 0) {
+            PROXY_LOG_ERROR("Invalid %s: %s", handoff_fd_env, inherited);
+            return -1;
+         }
+      } else {
+         struct sockaddr_un addr;
+         if(path.empty() || !unix_address(path, addr))
+            return -1;
+         sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+         if(sock < 0 || connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+            // No file, or a stale one left by a proxy that did not exit cleanly
+            if(errno != ENOENT && errno != ECONNREFUSED)
+               PROXY_LOG_WARN("Could not reach %s: %s", path.c_str(), strerror(errno));
+            if(sock >= 0)
+               close(sock);
+            return -1;
+         }
+      }
+      struct timeval tv = { handoff_timeout_s, 0 };
+      setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      return sock;
+   }
+
+   // Whether an inherited listener is bound to `local`
+   inline bool listening_on(int fd, const lev::IpAddr& local)
+   {
+      struct sockaddr_storage bound;
+      socklen_t len = sizeof(bound);
+      if(getsockname(fd, reinterpret_cast<struct sockaddr*>(&bound), &len) != 0 || bound.ss_family != AF_INET)
+         return false;
+      return lev::IpAddr(*reinterpret_cast<struct sockaddr*>(&bound)).toStringFull() == local.toStringFull();
+   }
+
+   // The old process' side. Runs on the main thread's loop; serves one
+   // request at a time, coming either from a process started with the same
+   // --handoff-socket or from the successor spawn() starts on SIGHUP.
+   class handoff_server
+   {
+   public:
+      typedef void (*handed_over_cb)(void* arg);
+
+      handoff_server(struct event_base* evbase, handed_over_cb cb, void* cbarg)
+         : evbase_(evbase), cb_(cb), cbarg_(cbarg), listener_(NULL), admin_fd_(-1), sock_(-1),
+           reply_ev_(NULL), child_(-1), handed_over_(false)
+         {}
+
+      ~handoff_server()
+         {
+            end_request();
+            close_listener();
+            // The path only still names our socket if nobody took over
+            if(!path_.empty() && !handed_over_)
+               unlink(path_.c_str());
+         }
+
+      // The sockets to pass on, which must stay open while this serves
+      void set_sockets(const std::vector<int>& listeners, int admin_fd)
+         {
+            listeners_ = listeners;
+            admin_fd_ = admin_fd;
+         }
+
+      bool handed_over() const
+         {
+            return handed_over_;
+         }
+
+      bool listen(const std::string& path)
+         {
+            struct sockaddr_un addr;
+            if(!unix_address(path, addr))
+               return false;
+            // Whoever owned the file before has either handed over to us or died
+            unlink(path.c_str());
+            listener_ = evconnlistener_new_bind(evbase_, on_request, this,
+                                                LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC, -1,
+                                                reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+            if(!listener_) {
+               PROXY_LOG_ERROR("Could not listen for hand-off requests on %s: %s", path.c_str(),
+                               evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+               return false;
+            }
+            path_ = path;
+            PROXY_LOG_INFO("Accepting hand-off requests on %s", path.c_str());
+            return true;
+         }
+
+      // Re-executes the proxy with the same arguments (argv[0] is looked up
+      // again, so an upgraded binary is picked up) and hands over to it
+      bool spawn(char* const argv[])
+         {
+            if(handed_over_ || sock_ >= 0) {
+               PROXY_LOG_WARN("A hand-off is already %s", handed_over_ ? "done" : "in progress");
+               return false;
+            }
+            // Everything the child needs is built before forking, since only
+            // async-signal-safe calls may follow a fork in a threaded process
+            const char* path = strchr(argv[0], '/') ? argv[0] : "/proc/self/exe";
+            const std::string fd_var = std::string(handoff_fd_env) + "=" + std::to_string(handoff_child_fd);
+            std::vector<char*> envp;
+            for(char** e = environ; *e; ++e) {
+               if(strncmp(*e, handoff_fd_env, strlen(handoff_fd_env)) != 0)
+                  envp.push_back(*e);
+            }
+            envp.push_back(const_cast<char*>(fd_var.c_str()));
+            envp.push_back(NULL);
+
+            int sv[2];
+            if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+               PROXY_LOG_ERROR("Could not create the hand-off socket: %s", strerror(errno));
+               return false;
+            }
+            const pid_t pid = fork();
+            if(pid < 0) {
+               PROXY_LOG_ERROR("Could not fork: %s", strerror(errno));
+               close(sv[0]);
+               close(sv[1]);
+               return false;
+            }
+            if(pid == 0) {
+               // dup2 onto itself would keep close-on-exec set
+               if(sv[1] == handoff_child_fd)
+                  fcntl(sv[1], F_SETFD, 0);
+               else
+                  dup2(sv[1], handoff_child_fd);
+               close_from(handoff_child_fd + 1);
+               execve(path, argv, &envp[0]);
+               _exit(127);
+            }
+            close(sv[1]);
+            child_ = pid;
+            PROXY_LOG_INFO("Started %s (pid %d) to take over", path, (int)pid);
+            adopt(sv[0]);
+            return true;
+         }
+
+      // Serves one request on a connected socket
+      void adopt(int sock)
+         {
+            if(handed_over_ || sock_ >= 0) {
+               PROXY_LOG_WARN("Refusing a hand-off request: one is already %s", handed_over_ ? "done" : "in progress");
+               close(sock);
+               return;
+            }
+            // The message is small enough to go out in one blocking send
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+            if(!send_handoff(sock, listeners_, admin_fd_)) {
+               close(sock);
+               return;
+            }
+            PROXY_LOG_INFO("Handed %zu listening socket(s) to the new process, waiting for it to take over",
+                           listeners_.size());
+            sock_ = sock;
+            reply_ev_ = event_new(evbase_, sock_, EV_READ, on_reply, this);
+            struct timeval tv = { handoff_timeout_s, 0 };
+            event_add(reply_ev_, &tv);
+         }
+
+      // The path belongs to the successor once it has taken over
+      void close_listener()
+         {
+            if(listener_) {
+               evconnlistener_free(listener_);
+               listener_ = NULL;
+            }
+         }
+
+   private:
+      static void on_request(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* address,
+                             int socklen, void* cbarg)
+         {
+            static_cast<handoff_server*>(cbarg)->adopt(fd);
+         }
+
+      static void on_reply(evutil_socket_t fd, short what, void* arg)
+         {
+            handoff_server* self = static_cast<handoff_server*>(arg);
+            char reply = 0;
+            const bool ready = (what & EV_READ) && recv(fd, &reply, 1, MSG_DONTWAIT) == 1 && reply == handoff_ready;
+            self->end_request();
+            if(!ready) {
+               PROXY_LOG_ERROR("The new process did not take over%s; still serving",
+                               (what & EV_TIMEOUT) ? " in time" : "");
+               // Reap it if it is already gone
+               if(self->child_ > 0)
+                  waitpid(self->child_, NULL, WNOHANG);
+               self->child_ = -1;
+               return;
+            }
+            PROXY_LOG_INFO("The new process has taken over");
+            self->handed_over_ = true;
+            self->close_listener();
+            self->cb_(self->cbarg_);
+         }
+
+      void end_request()
+         {
+            if(reply_ev_) {
+               event_free(reply_ev_);
+               reply_ev_ = NULL;
+            }
+            if(sock_ >= 0) {
+               close(sock_);
+               sock_ = -1;
+            }
+         }
+
+      // Keeps bridge sockets out of the successor, which would otherwise
+      // hold them open past their close here
+      static void close_from(int first)
+         {
+#ifdef SYS_close_range
+            if(syscall(SYS_close_range, first, ~0U, 0) == 0)
+               return;
+#endif
+            struct rlimit rl;
+            if(getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur > 1048576)
+               rl.rlim_cur = 1048576;
+            for(int fd = first; fd < static_cast<int>(rl.rlim_cur); ++fd)
+               close(fd);
+         }
+
+      handoff_server(const handoff_server&);
+      handoff_server& operator=(const handoff_server&);
+
+      struct event_base* evbase_;
+      handed_over_cb cb_;
+      void* cbarg_;
+      struct evconnlistener* listener_;
+      std::string path_;
+      std::vector<int> listeners_;
+      int admin_fd_;
+      int sock_;                // the request being served, -1 when idle
+      struct event* reply_ev_;
+      pid_t child_;             // the successor spawn() started, if any
+      bool handed_over_;
+   };
+}
+
+#endif // _LISTENER_HANDOFF_H
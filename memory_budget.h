@@ -0,0 +1,152 @@
+#ifndef _MEMORY_BUDGET_H
+#define _MEMORY_BUDGET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <string>
+
+#include <boost/lexical_cast.hpp>
+
+#include "proxy_metrics.h"
+
+namespace tcp_proxy
+{
+   // A process-wide cap on the bytes waiting in relay buffers. Workers
+   // lease it in quanta (see budget_lease), so the shared counter is only
+   // touched when a worker's buffers grow or shrink by a quantum, and the
+   // cap holds to within two quanta per worker.
+   class memory_budget
+   {
+   public:
+      static const uint64_t quantum = 65536;
+
+      explicit memory_budget(uint64_t limit)
+         : limit_(limit), leased_(0)
+         {}
+
+      bool enabled() const
+         {
+            return limit_ != 0;
+         }
+
+      // Over the limit, new data should not be read
+      bool over() const
+         {
+            return enabled() && leased_.load(std::memory_order_relaxed) > limit_;
+         }
+
+      // Reading resumes once leases have dropped to three quarters of the
+      // limit, so a budget at the edge does not flap
+      bool can_resume() const
+         {
+            return leased_.load(std::memory_order_relaxed) <= limit_ - limit_ / 4;
+         }
+
+      void lease(uint64_t n)
+         {
+            leased_.fetch_add(n, std::memory_order_relaxed);
+         }
+
+      void release(uint64_t n)
+         {
+            leased_.fetch_sub(n, std::memory_order_relaxed);
+         }
+
+      // Parses a byte count with an optional k, m or g suffix (powers of 1024)
+      static bool parse_size(const std::string& value, uint64_t& bytes)
+         {
+            if(value.empty())
+               return false;
+            uint64_t scale = 1;
+            std::string digits = value;
+            switch(value[value.size() - 1]) {
+            case 'k': case 'K': scale = 1ULL << 10; break;
+            case 'm': case 'M': scale = 1ULL << 20; break;
+            case 'g': case 'G': scale = 1ULL << 30; break;
+            default: break;
+            }
+            if(scale != 1)
+               digits.erase(digits.size() - 1);
+            try
+            {
+               bytes = boost::lexical_cast<uint64_t>(digits) * scale;
+            } catch(boost::bad_lexical_cast&) {
+               return false;
+            }
+            return true;
+         }
+
+   private:
+      memory_budget(const memory_budget&);
+      memory_budget& operator=(const memory_budget&);
+
+      const uint64_t limit_;
+      std::atomic<uint64_t> leased_;
+   };
+
+   // One worker's share of the budget, used from its thread only. Counts
+   // the bytes the worker has buffered (also published as a gauge) and
+   // holds a lease on the budget rounded up to a quantum; a lease more
+   // than two quanta too large is handed back.
+   class budget_lease
+   {
+   public:
+      budget_lease(memory_budget* budget, counter& buffered)
+         : budget_(budget && budget->enabled() ? budget : NULL), buffered_(buffered), used_(0), held_(0)
+         {}
+
+      ~budget_lease()
+         {
+            if(budget_)
+               budget_->release(held_);
+         }
+
+      // Bytes that already sit in a buffer, so they are always counted
+      void charge(uint64_t n)
+         {
+            used_ += n;
+            buffered_.add(n);
+            if(budget_ && used_ > held_) {
+               const uint64_t grow = (used_ - held_ + memory_budget::quantum - 1) / memory_budget::quantum *
+                                     memory_budget::quantum;
+               held_ += grow;
+               budget_->lease(grow);
+            }
+         }
+
+      void discharge(uint64_t n)
+         {
+            used_ -= n;
+            buffered_.sub(n);
+            if(budget_ && held_ - used_ > 2 * memory_budget::quantum) {
+               const uint64_t shrink = (held_ - used_ - memory_budget::quantum) / memory_budget::quantum *
+                                       memory_budget::quantum;
+               held_ -= shrink;
+               budget_->release(shrink);
+            }
+         }
+
+      bool over() const
+         {
+            return budget_ && budget_->over();
+         }
+
+      bool can_resume() const
+         {
+            return !budget_ || budget_->can_resume();
+         }
+
+   private:
+      budget_lease(const budget_lease&);
+      budget_lease& operator=(const budget_lease&);
+
+      memory_budget* budget_;   // NULL when there is no limit
+      counter& buffered_;
+      uint64_t used_;
+      uint64_t held_;
+   };
+}
+
+#endif // _MEMORY_BUDGET_H
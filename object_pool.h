@@ -0,0 +1,174 @@
+#ifndef _OBJECT_POOL_H
+#define _OBJECT_POOL_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace tcp_proxy
+{
+   // Free list of equally sized blocks, carved out of chunks that are only
+   // returned when the pool is destroyed. Not thread safe: a pool belongs
+   // to one event loop, and so do the objects allocated from it.
+   class block_pool
+   {
+   public:
+      explicit block_pool(size_t blocks_per_chunk = 64)
+         : block_size_(0), blocks_per_chunk_(blocks_per_chunk), free_(NULL), in_use_(0)
+         {}
+
+      ~block_pool()
+         {
+            for(size_t i = 0; i < chunks_.size(); ++i)
+               ::operator delete(chunks_[i]);
+         }
+
+      // The first request fixes the block size; the pool serves exactly one
+      // type, so every later request has the same size.
+      bool fits(size_t bytes)
+         {
+            if(!block_size_)
+               block_size_ = round_up(bytes < sizeof(free_block) ? sizeof(free_block) : bytes);
+            return bytes <= block_size_;
+         }
+
+      void* allocate()
+         {
+            if(!free_)
+               grow();
+            free_block* b = free_;
+            free_ = b->next;
+            in_use_++;
+            return b;
+         }
+
+      void release(void* p)
+         {
+            free_block* b = static_cast<free_block*>(p);
+            b->next = free_;
+            free_ = b;
+            in_use_--;
+         }
+
+      size_t in_use() const { return in_use_; }
+      size_t capacity() const { return chunks_.size() * blocks_per_chunk_; }
+
+   private:
+      struct free_block
+      {
+         free_block* next;
+      };
+
+      static size_t round_up(size_t bytes)
+         {
+            const size_t align = sizeof(void*) * 2;
+            return (bytes + align - 1) & ~(align - 1);
+         }
+
+      void grow()
+         {
+            char* chunk = static_cast<char*>(::operator new(block_size_ * blocks_per_chunk_));
+            chunks_.push_back(chunk);
+            for(size_t i = blocks_per_chunk_; i-- > 0;) {
+               free_block* b = reinterpret_cast<free_block*>(chunk + i * block_size_);
+               b->next = free_;
+               free_ = b;
+            }
+         }
+
+      block_pool(const block_pool&);
+      block_pool& operator=(const block_pool&);
+
+      size_t block_size_;
+      size_t blocks_per_chunk_;
+      free_block* free_;
+      size_t in_use_;
+      std::vector<char*> chunks_;
+   };
+
+   // Standard allocator over a block_pool. Handing it to allocate_shared
+   // puts an object and its reference counts in a single pooled block;
+   // requests the pool cannot serve fall back to operator new.
+   template <typename T>
+   class pool_allocator
+   {
+   public:
+      typedef T value_type;
+      typedef T* pointer;
+      typedef const T* const_pointer;
+      typedef T& reference;
+      typedef const T& const_reference;
+      typedef size_t size_type;
+      typedef ptrdiff_t difference_type;
+
+      template <typename U>
+      struct rebind
+      {
+         typedef pool_allocator<U> other;
+      };
+
+      explicit pool_allocator(block_pool* pool)
+         : pool_(pool)
+         {}
+
+      template <typename U>
+      pool_allocator(const pool_allocator<U>& other)
+         : pool_(other.pool())
+         {}
+
+      T* allocate(size_t n)
+         {
+            if(n == 1 && pool_->fits(sizeof(T)))
+               return static_cast<T*>(pool_->allocate());
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+         }
+
+      void deallocate(T* p, size_t n)
+         {
+            if(n == 1 && pool_->fits(sizeof(T)))
+               pool_->release(p);
+            else
+               ::operator delete(p);
+         }
+
+      template <typename U, typename... Args>
+      void construct(U* p, Args&&... args)
+         {
+            ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);
+         }
+
+      template <typename U>
+      void destroy(U* p)
+         {
+            p->~U();
+         }
+
+      size_t max_size() const
+         {
+            return size_t(-1) / sizeof(T);
+         }
+
+      block_pool* pool() const
+         {
+            return pool_;
+         }
+
+      template <typename U>
+      bool operator==(const pool_allocator<U>& other) const
+         {
+            return pool_ == other.pool();
+         }
+
+      template <typename U>
+      bool operator!=(const pool_allocator<U>& other) const
+         {
+            return pool_ != other.pool();
+         }
+
+   private:
+      block_pool* pool_;
+   };
+}
+
+#endif // _OBJECT_POOL_H
@@ -0,0 +1,19 @@
+#ifndef _PROXY_CLOCK_H
+#define _PROXY_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+namespace tcp_proxy
+{
+   // Monotonic timestamp in microseconds; clock_gettime is served from the
+   // vDSO, so this is cheap enough for per-connection bookkeeping.
+   inline uint64_t monotonic_usec()
+   {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+   }
+}
+
+#endif // _PROXY_CLOCK_H
@@ -0,0 +1,269 @@
+#ifndef _PROXY_LOG_H
+#define _PROXY_LOG_H
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace tcp_proxy
+{
+   enum log_level
+   {
+      log_trace = 0,
+      log_debug,
+      log_info,
+      log_warn,
+      log_error,
+      log_off
+   };
+
+// Messages below this level are compiled out entirely
+#ifndef TCPPROXY_LOG_MIN_LEVEL
+#define TCPPROXY_LOG_MIN_LEVEL 0
+#endif
+
+// The runtime level check happens before any argument is evaluated, so a
+// disabled message costs one relaxed load and a compare.
+#define PROXY_LOG(level, ...)                                           \
+   do {                                                                 \
+      if((level) >= TCPPROXY_LOG_MIN_LEVEL && tcp_proxy::logger::enabled(level)) \
+         tcp_proxy::logger::write((level), __VA_ARGS__);                \
+   } while(0)
+
+#define PROXY_LOG_TRACE(...) PROXY_LOG(tcp_proxy::log_trace, __VA_ARGS__)
+#define PROXY_LOG_DEBUG(...) PROXY_LOG(tcp_proxy::log_debug, __VA_ARGS__)
+#define PROXY_LOG_INFO(...)  PROXY_LOG(tcp_proxy::log_info, __VA_ARGS__)
+#define PROXY_LOG_WARN(...)  PROXY_LOG(tcp_proxy::log_warn, __VA_ARGS__)
+#define PROXY_LOG_ERROR(...) PROXY_LOG(tcp_proxy::log_error, __VA_ARGS__)
+
+   // Single-producer/single-consumer ring of formatted records. Each thread
+   // that logs owns one; only the background writer drains it.
+   class log_ring
+   {
+   public:
+      static const size_t num_records = 1024;     // power of two
+      static const size_t max_text = 232;
+
+      struct record
+      {
+         struct timespec when;
+         uint8_t level;
+         uint16_t length;
+         char text[max_text];
+      };
+
+      log_ring(const std::string& name)
+         : name_(name), head_(0), tail_(0), dropped_(0)
+         {}
+
+      // Called by the owning thread only. Never blocks: a full ring drops
+      // the message and counts it.
+      void push(log_level level, const char* fmt, va_list args)
+         {
+            const size_t head = head_.load(std::memory_order_relaxed);
+            if(head - tail_.load(std::memory_order_acquire) == num_records) {
+               dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+               return;
+            }
+            record& r = records_[head & (num_records - 1)];
+            clock_gettime(CLOCK_REALTIME, &r.when);
+            r.level = static_cast<uint8_t>(level);
+            int n = vsnprintf(r.text, max_text, fmt, args);
+            r.length = static_cast<uint16_t>(n < 0 ? 0 : (static_cast<size_t>(n) >= max_text ? max_text - 1 : n));
+            head_.store(head + 1, std::memory_order_release);
+         }
+
+      // Called by the writer thread only
+      template <typename F>
+      size_t drain(F f)
+         {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            const size_t head = head_.load(std::memory_order_acquire);
+            const size_t count = head - tail;
+            for(; tail != head; ++tail)
+               f(name_, records_[tail & (num_records - 1)]);
+            tail_.store(tail, std::memory_order_release);
+            return count;
+         }
+
+      const std::string& name() const
+         {
+            return name_;
+         }
+
+      uint64_t take_dropped()
+         {
+            return dropped_.exchange(0, std::memory_order_relaxed);
+         }
+
+   private:
+      record records_[num_records];
+      std::string name_;
+      std::atomic<size_t> head_;
+      std::atomic<size_t> tail_;
+      std::atomic<uint64_t> dropped_;
+   };
+
+   // Process-wide logger. Producers format into their thread's ring; a
+   // background thread writes the records out, so no relay thread ever
+   // blocks on terminal or file I/O.
+   class logger
+   {
+   public:
+      static bool enabled(log_level level)
+         {
+            return level >= instance().level_.load(std::memory_order_relaxed);
+         }
+
+      static void set_level(log_level level)
+         {
+            instance().level_.store(level, std::memory_order_relaxed);
+         }
+
+      static bool parse_level(const std::string& name, log_level& level)
+         {
+            static const char* const names[] = { "trace", "debug", "info", "warn", "error", "off" };
+            for(int i = log_trace; i <= log_off; ++i) {
+               if(name == names[i]) {
+                  level = static_cast<log_level>(i);
+                  return true;
+               }
+            }
+            return false;
+         }
+
+      // Names the calling thread's ring; call before the thread first logs
+      static void set_thread_name(const std::string& name)
+         {
+            thread_ring(&name);
+         }
+
+      __attribute__((format(printf, 2, 3)))
+      static void write(log_level level, const char* fmt, ...)
+         {
+            va_list args;
+            va_start(args, fmt);
+            thread_ring(NULL)->push(level, fmt, args);
+            va_end(args);
+         }
+
+      // Starts the writer thread. With an empty path, warnings and errors go
+      // to stderr and everything else to stdout.
+      static bool start(const std::string& path)
+         {
+            logger& l = instance();
+            if(!path.empty()) {
+               l.file_ = fopen(path.c_str(), "a");
+               if(!l.file_) {
+                  fprintf(stderr, "Error: Could not open log file %s: %s\n", path.c_str(), strerror(errno));
+                  return false;
+               }
+            }
+            l.running_ = true;
+            l.writer_ = boost::thread(boost::bind(&logger::run, &l));
+            return true;
+         }
+
+      // Flushes everything logged so far and stops the writer thread
+      static void stop()
+         {
+            logger& l = instance();
+            if(!l.running_)
+               return;
+            l.running_ = false;
+            l.writer_.join();
+            l.flush();
+            if(l.file_)
+               fclose(l.file_);
+            l.file_ = NULL;
+         }
+
+   private:
+      logger()
+         : level_(log_info), running_(false), file_(NULL)
+         {}
+
+      static logger& instance()
+         {
+            static logger l;
+            return l;
+         }
+
+      static log_ring* thread_ring(const std::string* name)
+         {
+            static __thread log_ring* ring = NULL;
+            if(!ring) {
+               logger& l = instance();
+               boost::mutex::scoped_lock lock(l.rings_mutex_);
+               boost::shared_ptr<log_ring> r(new log_ring(name ? *name : "thread-" + std::to_string(l.rings_.size())));
+               l.rings_.push_back(r);
+               ring = r.get();
+            }
+            return ring;
+         }
+
+      void run()
+         {
+            while(running_) {
+               if(flush() == 0)
+                  usleep(5000);
+            }
+         }
+
+      size_t flush()
+         {
+            std::vector<boost::shared_ptr<log_ring> > rings;
+            {
+               boost::mutex::scoped_lock lock(rings_mutex_);
+               rings = rings_;
+            }
+            size_t total = 0;
+            for(size_t i = 0; i < rings.size(); ++i) {
+               total += rings[i]->drain(boost::bind(&logger::emit, this, _1, _2));
+               const uint64_t dropped = rings[i]->take_dropped();
+               if(dropped)
+                  fprintf(file_ ? file_ : stderr, "WARN  [%s] dropped %llu log messages (ring full)\n",
+                          rings[i]->name().c_str(), static_cast<unsigned long long>(dropped));
+            }
+            if(total) {
+               fflush(file_ ? file_ : stdout);
+               if(!file_)
+                  fflush(stderr);
+            }
+            return total;
+         }
+
+      void emit(const std::string& thread, const log_ring::record& r)
+         {
+            static const char* const names[] = { "TRACE", "DEBUG", "INFO ", "WARN ", "ERROR" };
+            struct tm tm;
+            char stamp[32];
+            localtime_r(&r.when.tv_sec, &tm);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+            FILE* out = file_ ? file_ : (r.level >= log_warn ? stderr : stdout);
+            fprintf(out, "%s.%03ld %s [%s] %.*s\n", stamp, r.when.tv_nsec / 1000000, names[r.level],
+                    thread.c_str(), static_cast<int>(r.length), r.text);
+         }
+
+      std::atomic<int> level_;
+      std::atomic<bool> running_;
+      FILE* file_;
+      boost::thread writer_;
+      boost::mutex rings_mutex_;
+      std::vector<boost::shared_ptr<log_ring> > rings_;
+   };
+}
+
+#endif // _PROXY_LOG_H
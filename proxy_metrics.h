@@ -0,0 +1,404 @@
+#ifndef _PROXY_METRICS_H
+#define _PROXY_METRICS_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "./lev-master/include/lev.h"
+#include "./lev-master/include/levhttp.h"
+#include "latency_histogram.h"
+#include "rate_limit.h"
+#include "upstream_health.h"
+#include "proxy_log.h"
+
+namespace tcp_proxy
+{
+   // A counter with a single writer (the owning worker thread) and any
+   // number of readers. Updates are a relaxed load and store, not a locked
+   // read-modify-write, so counting on the relay path stays cheap.
+   class counter
+   {
+   public:
+      counter()
+         : value_(0)
+         {}
+
+      void add(uint64_t n = 1)
+         {
+            value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+         }
+
+      void sub(uint64_t n = 1)
+         {
+            value_.store(value_.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+         }
+
+      uint64_t get() const
+         {
+            return value_.load(std::memory_order_relaxed);
+         }
+
+   private:
+      counter(const counter&);
+      counter& operator=(const counter&);
+
+      std::atomic<uint64_t> value_;
+   };
+
+   struct upstream_metrics
+   {
+      counter connections_total;    // connects that completed, pooled ones included
+      counter connections_active;
+      counter connect_errors;
+      counter bytes_sent;           // client -> upstream
+      counter bytes_received;       // upstream -> client
+      // Lifecycle latencies in microseconds. Time to first byte is measured
+      // from the accept, in each direction; the duration runs to close.
+      latency_histogram connect_usec;
+      latency_histogram first_byte_sent_usec;
+      latency_histogram first_byte_received_usec;
+      latency_histogram duration_usec;
+   };
+
+   // The lifecycle histograms by name, for reporting
+   struct latency_metric
+   {
+      const char* name;
+      const char* label;
+      const char* help;
+      latency_histogram upstream_metrics::* member;
+   };
+
+   static const latency_metric latency_metrics[] = {
+      { "tcpproxy_upstream_connect_seconds", "connect",
+        "Time from starting the upstream connect to its completion.",
+        &upstream_metrics::connect_usec },
+      { "tcpproxy_first_byte_sent_seconds", "first byte sent",
+        "Time from accept to the first client byte read.",
+        &upstream_metrics::first_byte_sent_usec },
+      { "tcpproxy_first_byte_received_seconds", "first byte received",
+        "Time from accept to the first upstream byte read.",
+        &upstream_metrics::first_byte_received_usec },
+      { "tcpproxy_connection_duration_seconds", "duration",
+        "Time from accept to close.",
+        &upstream_metrics::duration_usec },
+   };
+
+   static const double latency_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+   // Everything one worker counts for one route; the admin endpoint sums
+   // over workers
+   struct worker_metrics
+   {
+      explicit worker_metrics(size_t num_upstreams)
+         : upstreams(num_upstreams)
+         {}
+
+      counter downstream_total;
+      counter downstream_active;
+      counter failed;               // bridges closed by an error or timeout
+      // Accepted flows whose packets were last processed on the worker's
+      // own CPU, and on another one; only counted for pinned workers
+      counter flows_local;
+      counter flows_remote;
+      // Bridges closed by each kind of timeout (also counted in `failed`)
+      counter timeouts_connect;
+      counter timeouts_idle_read;
+      counter timeouts_idle_write;
+      counter timeouts_lifetime;
+      counter timeouts_linger;
+      // EOFs passed on with shutdown(SHUT_WR) once the data before them was written
+      counter half_closes;
+      // Accepted connections closed for a missing or malformed PROXY header
+      counter proxy_header_errors;
+      // Connections routed by a ClientHello's server name, balanced because
+      // no route matched (or it was not TLS), and closed before sending one
+      counter sni_matched;
+      counter sni_default;
+      counter sni_incomplete;
+      // TLS handshakes on the listener, and the sessions handed to kTLS
+      counter tls_full;
+      counter tls_resumed;
+      counter tls_failed;
+      counter tls_ktls;
+      // Relay bytes waiting to be written, and the times a source stopped
+      // being read because the memory budget was used up
+      counter buffered_bytes;
+      counter budget_pauses;
+      std::vector<upstream_metrics> upstreams;
+   };
+
+   // The counters of one listen address (a route) and its backends, one
+   // worker_metrics per worker; the workers must outlive whoever reads them
+   struct route_metrics
+   {
+      route_metrics(const std::string& n, const std::vector<lev::IpAddr>& u, const upstream_health* h,
+                    const rate_group_set* r)
+         : name(n), upstreams(u), health(h), rates(r)
+         {}
+
+      std::string name;
+      std::vector<lev::IpAddr> upstreams;
+      const upstream_health* health;   // NULL when active checks are off
+      const rate_group_set* rates;     // shared by the workers, so counted once
+      std::vector<const worker_metrics*> workers;
+   };
+
+   // Serves GET /metrics in the Prometheus text format from the main
+   // thread's loop, reading the workers' counters without stopping them,
+   // and whatever other admin routes the owner adds. Every series carries
+   // the route it was counted for.
+   class metrics_endpoint
+   {
+   public:
+      metrics_endpoint(struct event_base* evbase, const std::vector<route_metrics>& routes)
+         : server_(evbase), routes_(routes), listen_fd_(-1)
+         {
+            server_.addRoute("/metrics", on_metrics, this);
+            server_.setDefaultRoute(on_unknown, this);
+         }
+
+      bool bind(const lev::IpAddr& address)
+         {
+            lev::EvConnListener listener;
+            if(!server_.bind(address, &listener)) {
+               PROXY_LOG_ERROR("Could not bind the admin endpoint to %s", address.toStringFull().c_str());
+               return false;
+            }
+            listen_fd_ = listener.fd();
+            PROXY_LOG_INFO("Serving metrics on http://%s/metrics", address.toStringFull().c_str());
+            return true;
+         }
+
+      // Serves on the admin socket of the process this one took over from
+      bool adopt(evutil_socket_t fd, const lev::IpAddr& address)
+         {
+            if(!server_.accept(fd)) {
+               PROXY_LOG_ERROR("Could not serve the inherited admin socket");
+               return false;
+            }
+            listen_fd_ = fd;
+            PROXY_LOG_INFO("Serving metrics on http://%s/metrics (inherited)", address.toStringFull().c_str());
+            return true;
+         }
+
+      evutil_socket_t listen_fd() const
+         {
+            return listen_fd_;
+         }
+
+      bool add_route(const char* path, lev::EvHttpServer::RouteCallback cb, void* arg)
+         {
+            return server_.addRoute(path, cb, arg);
+         }
+
+      // Logs the lifecycle latency percentiles of every upstream of every
+      // route, merged over all workers
+      static void log_latencies(const std::vector<route_metrics>& routes)
+         {
+            for(size_t r = 0; r < routes.size(); ++r)
+               log_latencies(routes[r]);
+         }
+
+      static void log_latencies(const route_metrics& route)
+         {
+            for(size_t u = 0; u < route.upstreams.size(); ++u) {
+               for(size_t m = 0; m < sizeof(latency_metrics) / sizeof(latency_metrics[0]); ++m) {
+                  const latency_histogram::snapshot snap = merge(route.workers, u, latency_metrics[m].member);
+                  if(!snap.count())
+                     continue;
+                  PROXY_LOG_INFO("%s %s %s: n=%llu mean=%lluus p50=%lluus p99=%lluus p999=%lluus", route.name.c_str(),
+                                 route.upstreams[u].toStringFull().c_str(), latency_metrics[m].label,
+                                 (unsigned long long)snap.count(), (unsigned long long)(snap.sum() / snap.count()),
+                                 (unsigned long long)snap.quantile(0.5), (unsigned long long)snap.quantile(0.99),
+                                 (unsigned long long)snap.quantile(0.999));
+               }
+            }
+         }
+
+   private:
+      static latency_histogram::snapshot merge(const std::vector<const worker_metrics*>& workers, size_t upstream,
+                                               latency_histogram upstream_metrics::* member)
+         {
+            latency_histogram::snapshot snap;
+            for(size_t i = 0; i < workers.size(); ++i)
+               snap.add(workers[i]->upstreams[upstream].*member);
+            return snap;
+         }
+
+      static void on_unknown(struct evhttp_request* req, void* arg)
+         {
+            lev::EvHttpRequest(req).sendError(HTTP_NOTFOUND, "Not Found");
+         }
+
+      static void on_metrics(struct evhttp_request* req, void* arg)
+         {
+            metrics_endpoint* self = static_cast<metrics_endpoint*>(arg);
+            lev::EvHttpRequest request(req);
+            if(request.cmd() != EVHTTP_REQ_GET) {
+               request.sendError(405, "Method Not Allowed");
+               return;
+            }
+            evhttp_add_header(request.outputHdrs(), "Content-Type", "text/plain; version=0.0.4");
+            self->render(evhttp_request_get_output_buffer(req));
+            request.sendReply(HTTP_OK, "OK");
+         }
+
+      static void header(struct evbuffer* out, const char* name, const char* type, const char* help)
+         {
+            evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+         }
+
+      static uint64_t sum(const route_metrics& route, counter worker_metrics::* member)
+         {
+            uint64_t total = 0;
+            for(size_t i = 0; i < route.workers.size(); ++i)
+               total += (route.workers[i]->*member).get();
+            return total;
+         }
+
+      void scalar(struct evbuffer* out, const char* name, const char* type, const char* help,
+                  counter worker_metrics::* member) const
+         {
+            header(out, name, type, help);
+            for(size_t r = 0; r < routes_.size(); ++r)
+               evbuffer_add_printf(out, "%s{route=\"%s\"} %llu\n", name, routes_[r].name.c_str(),
+                                   (unsigned long long)sum(routes_[r], member));
+         }
+
+      // The series of a metric split by a further label, e.g.
+      // name{route="r",label="value"}
+      void labelled(struct evbuffer* out, const char* name, const char* label, const char* value,
+                    counter worker_metrics::* member) const
+         {
+            for(size_t r = 0; r < routes_.size(); ++r)
+               evbuffer_add_printf(out, "%s{route=\"%s\",%s=\"%s\"} %llu\n", name, routes_[r].name.c_str(),
+                                   label, value, (unsigned long long)sum(routes_[r], member));
+         }
+
+      void per_upstream(struct evbuffer* out, const char* name, const char* type, const char* help,
+                        counter upstream_metrics::* member, const char* extra_label = NULL) const
+         {
+            if(help)
+               header(out, name, type, help);
+            for(size_t r = 0; r < routes_.size(); ++r) {
+               const route_metrics& route = routes_[r];
+               for(size_t u = 0; u < route.upstreams.size(); ++u) {
+                  uint64_t total = 0;
+                  for(size_t i = 0; i < route.workers.size(); ++i)
+                     total += (route.workers[i]->upstreams[u].*member).get();
+                  evbuffer_add_printf(out, "%s{route=\"%s\",upstream=\"%s\"%s%s} %llu\n", name, route.name.c_str(),
+                                      route.upstreams[u].toStringFull().c_str(), extra_label ? "," : "",
+                                      extra_label ? extra_label : "", (unsigned long long)total);
+               }
+            }
+         }
+
+      void render(struct evbuffer* out) const
+         {
+            scalar(out, "tcpproxy_downstream_connections_total", "counter",
+                   "Client connections accepted.", &worker_metrics::downstream_total);
+            scalar(out, "tcpproxy_downstream_connections_active", "gauge",
+                   "Client connections currently open.", &worker_metrics::downstream_active);
+            scalar(out, "tcpproxy_failed_connections_total", "counter",
+                   "Bridges closed by an error or timeout on either side.", &worker_metrics::failed);
+            scalar(out, "tcpproxy_buffered_bytes", "gauge",
+                   "Relay bytes read from one side and not yet written to the other.", &worker_metrics::buffered_bytes);
+            scalar(out, "tcpproxy_budget_pauses_total", "counter",
+                   "Times reading from a connection stopped because the memory budget was used up.",
+                   &worker_metrics::budget_pauses);
+            header(out, "tcpproxy_flows_steered_total", "counter",
+                   "Client connections accepted by a pinned worker, by whether their packets arrived on its CPU.");
+            labelled(out, "tcpproxy_flows_steered_total", "cpu", "local", &worker_metrics::flows_local);
+            labelled(out, "tcpproxy_flows_steered_total", "cpu", "remote", &worker_metrics::flows_remote);
+            header(out, "tcpproxy_timeouts_total", "counter", "Bridges closed by a timeout, by kind.");
+            labelled(out, "tcpproxy_timeouts_total", "kind", "connect", &worker_metrics::timeouts_connect);
+            labelled(out, "tcpproxy_timeouts_total", "kind", "idle_read", &worker_metrics::timeouts_idle_read);
+            labelled(out, "tcpproxy_timeouts_total", "kind", "idle_write", &worker_metrics::timeouts_idle_write);
+            labelled(out, "tcpproxy_timeouts_total", "kind", "lifetime", &worker_metrics::timeouts_lifetime);
+            labelled(out, "tcpproxy_timeouts_total", "kind", "linger", &worker_metrics::timeouts_linger);
+            scalar(out, "tcpproxy_half_closes_total", "counter",
+                   "EOFs passed on to the other side once everything sent before them was written.",
+                   &worker_metrics::half_closes);
+            scalar(out, "tcpproxy_proxy_header_errors_total", "counter",
+                   "Connections closed because they did not start with a valid PROXY header.",
+                   &worker_metrics::proxy_header_errors);
+            header(out, "tcpproxy_sni_routes_total", "counter",
+                   "Connections by how the server name in their ClientHello picked the backend.");
+            labelled(out, "tcpproxy_sni_routes_total", "result", "matched", &worker_metrics::sni_matched);
+            labelled(out, "tcpproxy_sni_routes_total", "result", "default", &worker_metrics::sni_default);
+            labelled(out, "tcpproxy_sni_routes_total", "result", "incomplete", &worker_metrics::sni_incomplete);
+            header(out, "tcpproxy_tls_handshakes_total", "counter", "TLS handshakes with clients, by outcome.");
+            labelled(out, "tcpproxy_tls_handshakes_total", "result", "full", &worker_metrics::tls_full);
+            labelled(out, "tcpproxy_tls_handshakes_total", "result", "resumed", &worker_metrics::tls_resumed);
+            labelled(out, "tcpproxy_tls_handshakes_total", "result", "failed", &worker_metrics::tls_failed);
+            scalar(out, "tcpproxy_tls_ktls_total", "counter",
+                   "TLS sessions whose records the kernel took over (kTLS), relayed as plain TCP.",
+                   &worker_metrics::tls_ktls);
+            header(out, "tcpproxy_throttled_seconds_total", "counter",
+                   "Connection-seconds spent held back by a bandwidth limit, by what the limit is shared by.");
+            for(int t = 0; t < tier_count; ++t) {
+               for(size_t r = 0; r < routes_.size(); ++r) {
+                  const rate_group_set* rates = routes_[r].rates;
+                  evbuffer_add_printf(out, "tcpproxy_throttled_seconds_total{route=\"%s\",tier=\"%s\"} %.6f\n",
+                                      routes_[r].name.c_str(), rate_tier_name(rate_tier(t)),
+                                      (rates ? rates->throttled_usec(rate_tier(t)) : 0) / 1e6);
+               }
+            }
+            per_upstream(out, "tcpproxy_upstream_connections_total", "counter",
+                         "Upstream connections established.", &upstream_metrics::connections_total);
+            per_upstream(out, "tcpproxy_upstream_connections_active", "gauge",
+                         "Upstream connections currently open.", &upstream_metrics::connections_active);
+            per_upstream(out, "tcpproxy_upstream_connect_errors_total", "counter",
+                         "Upstream connects that failed or timed out.", &upstream_metrics::connect_errors);
+            header(out, "tcpproxy_upstream_bytes_total", "counter",
+                   "Payload bytes relayed; direction is relative to the upstream.");
+            per_upstream(out, "tcpproxy_upstream_bytes_total", "counter", NULL,
+                         &upstream_metrics::bytes_sent, "direction=\"sent\"");
+            per_upstream(out, "tcpproxy_upstream_bytes_total", "counter", NULL,
+                         &upstream_metrics::bytes_received, "direction=\"received\"");
+            // Histograms are exported as summaries: the log buckets are far
+            // too many to expose one time series each
+            for(size_t m = 0; m < sizeof(latency_metrics) / sizeof(latency_metrics[0]); ++m) {
+               const char* name = latency_metrics[m].name;
+               header(out, name, "summary", latency_metrics[m].help);
+               for(size_t r = 0; r < routes_.size(); ++r) {
+                  const route_metrics& route = routes_[r];
+                  for(size_t u = 0; u < route.upstreams.size(); ++u) {
+                     const std::string labels = "route=\"" + route.name + "\",upstream=\"" +
+                                                route.upstreams[u].toStringFull() + "\"";
+                     const latency_histogram::snapshot snap = merge(route.workers, u, latency_metrics[m].member);
+                     for(size_t q = 0; q < sizeof(latency_quantiles) / sizeof(latency_quantiles[0]); ++q)
+                        evbuffer_add_printf(out, "%s{%s,quantile=\"%g\"} %.6f\n", name, labels.c_str(),
+                                            latency_quantiles[q], snap.quantile(latency_quantiles[q]) / 1e6);
+                     evbuffer_add_printf(out, "%s_sum{%s} %.6f\n", name, labels.c_str(), snap.sum() / 1e6);
+                     evbuffer_add_printf(out, "%s_count{%s} %llu\n", name, labels.c_str(),
+                                         (unsigned long long)snap.count());
+                  }
+               }
+            }
+            bool probed = false;
+            for(size_t r = 0; r < routes_.size(); ++r)
+               probed = probed || routes_[r].health;
+            if(probed) {
+               header(out, "tcpproxy_upstream_up", "gauge", "1 when the upstream passes its health checks.");
+               for(size_t r = 0; r < routes_.size(); ++r) {
+                  const route_metrics& route = routes_[r];
+                  for(size_t u = 0; route.health && u < route.upstreams.size(); ++u)
+                     evbuffer_add_printf(out, "tcpproxy_upstream_up{route=\"%s\",upstream=\"%s\"} %d\n",
+                                         route.name.c_str(), route.upstreams[u].toStringFull().c_str(),
+                                         route.health->up(u) ? 1 : 0);
+               }
+            }
+         }
+
+      lev::EvHttpServer server_;
+      std::vector<route_metrics> routes_;
+      evutil_socket_t listen_fd_;
+   };
+}
+
+#endif // _PROXY_METRICS_H
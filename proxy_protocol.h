@@ -0,0 +1,260 @@
+#ifndef _PROXY_PROTOCOL_H
+#define _PROXY_PROTOCOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+extern "C" {
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+}
+
+namespace tcp_proxy
+{
+   // The PROXY protocol (haproxy.org/download/2.9/doc/proxy-protocol.txt)
+   // tells a backend which client a proxied connection comes from, in a
+   // header sent ahead of the client's bytes
+   enum proxy_protocol_version
+   {
+      proxy_protocol_off,
+      proxy_protocol_v1,   // one text line
+      proxy_protocol_v2    // binary
+   };
+
+   // The longest header written: a v1 line is at most 107 bytes
+   static const size_t proxy_header_max = 108;
+   // The longest header accepted, TLVs included
+   static const size_t proxy_header_accept_max = 1024;
+
+   static const char proxy_v2_signature[12] = { '\r', '\n', '\r', '\n', '\0', '\r', '\n', 'Q', 'U', 'I', 'T', '\n' };
+
+   // Writes the headers for connections accepted on one local address.
+   // The v2 header is kept preformatted per address family with the
+   // destination filled in when the listener has a specific address, so
+   // a connection only copies it and fills in the source.
+   class proxy_header_writer
+   {
+   public:
+      proxy_header_writer(proxy_protocol_version version, const struct sockaddr* local)
+         : version_(version), fixed_destination_(false)
+         {
+            init_v2(v4_, 0x11, 12);
+            init_v2(v6_, 0x21, 36);
+            if(local->sa_family == AF_INET) {
+               const struct sockaddr_in* in = reinterpret_cast<const struct sockaddr_in*>(local);
+               fixed_destination_ = in->sin_addr.s_addr != htonl(INADDR_ANY);
+               memcpy(v4_ + 20, &in->sin_addr, 4);
+               memcpy(v4_ + 26, &in->sin_port, 2);
+            } else if(local->sa_family == AF_INET6) {
+               const struct sockaddr_in6* in6 = reinterpret_cast<const struct sockaddr_in6*>(local);
+               fixed_destination_ = !IN6_IS_ADDR_UNSPECIFIED(&in6->sin6_addr);
+               memcpy(v6_ + 32, &in6->sin6_addr, 16);
+               memcpy(v6_ + 50, &in6->sin6_port, 2);
+            }
+         }
+
+      proxy_protocol_version version() const
+         {
+            return version_;
+         }
+
+      // Whether write() needs the address each connection arrived on, i.e.
+      // the listener is bound to a wildcard address
+      bool needs_destination() const
+         {
+            return !fixed_destination_;
+         }
+
+      // Writes the header for a connection from `src` to `dst` (NULL when
+      // the listener's address will do) into out[proxy_header_max] and
+      // returns its length. Addresses of mixed or unknown families make an
+      // UNKNOWN header, which leaves the backend to use the connection's own.
+      size_t write(const struct sockaddr* src, const struct sockaddr* dst, char* out) const
+         {
+            const int family = src->sa_family;
+            if((family != AF_INET && family != AF_INET6) || (dst && dst->sa_family != family))
+               return write_unknown(out);
+            if(version_ == proxy_protocol_v1)
+               return write_v1(src, dst, out);
+            if(family == AF_INET) {
+               memcpy(out, v4_, sizeof(v4_));
+               memcpy(out + 16, &reinterpret_cast<const struct sockaddr_in*>(src)->sin_addr, 4);
+               memcpy(out + 24, &reinterpret_cast<const struct sockaddr_in*>(src)->sin_port, 2);
+               if(dst) {
+                  memcpy(out + 20, &reinterpret_cast<const struct sockaddr_in*>(dst)->sin_addr, 4);
+                  memcpy(out + 26, &reinterpret_cast<const struct sockaddr_in*>(dst)->sin_port, 2);
+               }
+               return sizeof(v4_);
+            }
+            memcpy(out, v6_, sizeof(v6_));
+            memcpy(out + 16, &reinterpret_cast<const struct sockaddr_in6*>(src)->sin6_addr, 16);
+            memcpy(out + 48, &reinterpret_cast<const struct sockaddr_in6*>(src)->sin6_port, 2);
+            if(dst) {
+               memcpy(out + 32, &reinterpret_cast<const struct sockaddr_in6*>(dst)->sin6_addr, 16);
+               memcpy(out + 50, &reinterpret_cast<const struct sockaddr_in6*>(dst)->sin6_port, 2);
+            }
+            return sizeof(v6_);
+         }
+
+   private:
+      // Signature, version 2 / PROXY command, family and address length
+      static void init_v2(char* header, char family, uint16_t length)
+         {
+            memset(header, 0, 16 + length);
+            memcpy(header, proxy_v2_signature, sizeof(proxy_v2_signature));
+            header[12] = 0x21;
+            header[13] = family;
+            header[14] = static_cast<char>(length >> 8);
+            header[15] = static_cast<char>(length & 0xff);
+         }
+
+      size_t write_unknown(char* out) const
+         {
+            if(version_ == proxy_protocol_v1) {
+               memcpy(out, "PROXY UNKNOWN\r\n", 15);
+               return 15;
+            }
+            init_v2(out, 0x00, 0);
+            return 16;
+         }
+
+      size_t write_v1(const struct sockaddr* src, const struct sockaddr* dst, char* out) const
+         {
+            const bool v4 = src->sa_family == AF_INET;
+            char src_text[INET6_ADDRSTRLEN], dst_text[INET6_ADDRSTRLEN];
+            uint16_t src_port, dst_port;
+            if(v4) {
+               const struct sockaddr_in* s = reinterpret_cast<const struct sockaddr_in*>(src);
+               inet_ntop(AF_INET, &s->sin_addr, src_text, sizeof(src_text));
+               src_port = ntohs(s->sin_port);
+               inet_ntop(AF_INET, v4_ + 20, dst_text, sizeof(dst_text));
+               dst_port = static_cast<uint16_t>((uint8_t(v4_[26]) << 8) | uint8_t(v4_[27]));
+               if(dst) {
+                  const struct sockaddr_in* d = reinterpret_cast<const struct sockaddr_in*>(dst);
+                  inet_ntop(AF_INET, &d->sin_addr, dst_text, sizeof(dst_text));
+                  dst_port = ntohs(d->sin_port);
+               }
+            } else {
+               const struct sockaddr_in6* s = reinterpret_cast<const struct sockaddr_in6*>(src);
+               inet_ntop(AF_INET6, &s->sin6_addr, src_text, sizeof(src_text));
+               src_port = ntohs(s->sin6_port);
+               inet_ntop(AF_INET6, v6_ + 32, dst_text, sizeof(dst_text));
+               dst_port = static_cast<uint16_t>((uint8_t(v6_[50]) << 8) | uint8_t(v6_[51]));
+               if(dst) {
+                  const struct sockaddr_in6* d = reinterpret_cast<const struct sockaddr_in6*>(dst);
+                  inet_ntop(AF_INET6, &d->sin6_addr, dst_text, sizeof(dst_text));
+                  dst_port = ntohs(d->sin6_port);
+               }
+            }
+            const int n = snprintf(out, proxy_header_max, "PROXY %s %s %s %u %u\r\n", v4 ? "TCP4" : "TCP6",
+                                   src_text, dst_text, (unsigned int)src_port, (unsigned int)dst_port);
+            return n > 0 && size_t(n) < proxy_header_max ? size_t(n) : write_unknown(out);
+         }
+
+      proxy_protocol_version version_;
+      bool fixed_destination_;
+      char v4_[16 + 12];
+      char v6_[16 + 36];
+   };
+
+   enum proxy_parse_result
+   {
+      proxy_parse_incomplete,   // a valid start; more bytes are needed
+      proxy_parse_invalid,
+      proxy_parse_done
+   };
+
+   // Parses a v1 or v2 header at the start of data[0, len). When done,
+   // `consumed` is the header's length and src/dst are the addresses it
+   // carries; they are AF_UNSPEC for a LOCAL or UNKNOWN header, after which
+   // the connection's own addresses apply.
+   inline proxy_parse_result parse_proxy_header(const char* data, size_t len, struct sockaddr_storage& src,
+                                                struct sockaddr_storage& dst, size_t& consumed)
+   {
+      memset(&src, 0, sizeof(src));
+      memset(&dst, 0, sizeof(dst));
+      if(len > 0 && data[0] == proxy_v2_signature[0]) {
+         if(memcmp(data, proxy_v2_signature, std::min(len, sizeof(proxy_v2_signature))) != 0)
+            return proxy_parse_invalid;
+         if(len < 16)
+            return proxy_parse_incomplete;
+         const unsigned int version = uint8_t(data[12]) >> 4, command = uint8_t(data[12]) & 0x0f;
+         const size_t length = (size_t(uint8_t(data[14])) << 8) | uint8_t(data[15]);
+         if(version != 2 || command > 1 || 16 + length > proxy_header_accept_max)
+            return proxy_parse_invalid;
+         if(len < 16 + length)
+            return proxy_parse_incomplete;
+         consumed = 16 + length;
+         const uint8_t family = uint8_t(data[13]);
+         // A PROXY header for TCP must hold both addresses
+         if(command == 1 && ((family == 0x11 && length < 12) || (family == 0x21 && length < 36)))
+            return proxy_parse_invalid;
+         if(command == 1 && family == 0x11) {
+            struct sockaddr_in* s = reinterpret_cast<struct sockaddr_in*>(&src);
+            struct sockaddr_in* d = reinterpret_cast<struct sockaddr_in*>(&dst);
+            s->sin_family = d->sin_family = AF_INET;
+            memcpy(&s->sin_addr, data + 16, 4);
+            memcpy(&d->sin_addr, data + 20, 4);
+            memcpy(&s->sin_port, data + 24, 2);
+            memcpy(&d->sin_port, data + 26, 2);
+         } else if(command == 1 && family == 0x21) {
+            struct sockaddr_in6* s = reinterpret_cast<struct sockaddr_in6*>(&src);
+            struct sockaddr_in6* d = reinterpret_cast<struct sockaddr_in6*>(&dst);
+            s->sin6_family = d->sin6_family = AF_INET6;
+            memcpy(&s->sin6_addr, data + 16, 16);
+            memcpy(&d->sin6_addr, data + 32, 16);
+            memcpy(&s->sin6_port, data + 48, 2);
+            memcpy(&d->sin6_port, data + 50, 2);
+         }
+         return proxy_parse_done;
+      }
+      // v1: "PROXY TCP4|TCP6|UNKNOWN ...\r\n"
+      static const char prefix[] = "PROXY ";
+      if(memcmp(data, prefix, std::min(len, sizeof(prefix) - 1)) != 0)
+         return proxy_parse_invalid;
+      const char* end = static_cast<const char*>(memchr(data, '\n', std::min(len, proxy_header_max - 1)));
+      if(!end)
+         return len < proxy_header_max - 1 ? proxy_parse_incomplete : proxy_parse_invalid;
+      if(end == data || end[-1] != '\r')
+         return proxy_parse_invalid;
+      consumed = end - data + 1;
+      char line[proxy_header_max];
+      memcpy(line, data, consumed - 2);
+      line[consumed - 2] = '\0';
+      char protocol[8], src_text[INET6_ADDRSTRLEN], dst_text[INET6_ADDRSTRLEN];
+      unsigned int src_port, dst_port;
+      if(sscanf(line, "PROXY %7s", protocol) != 1)
+         return proxy_parse_invalid;
+      if(strcmp(protocol, "UNKNOWN") == 0)
+         return proxy_parse_done;
+      const int family = strcmp(protocol, "TCP4") == 0 ? AF_INET : strcmp(protocol, "TCP6") == 0 ? AF_INET6 : AF_UNSPEC;
+      if(family == AF_UNSPEC ||
+         sscanf(line, "PROXY %7s %45s %45s %5u %5u", protocol, src_text, dst_text, &src_port, &dst_port) != 5 ||
+         src_port > 65535 || dst_port > 65535)
+         return proxy_parse_invalid;
+      if(family == AF_INET) {
+         struct sockaddr_in* s = reinterpret_cast<struct sockaddr_in*>(&src);
+         struct sockaddr_in* d = reinterpret_cast<struct sockaddr_in*>(&dst);
+         s->sin_family = d->sin_family = AF_INET;
+         s->sin_port = htons(static_cast<uint16_t>(src_port));
+         d->sin_port = htons(static_cast<uint16_t>(dst_port));
+         if(inet_pton(AF_INET, src_text, &s->sin_addr) != 1 || inet_pton(AF_INET, dst_text, &d->sin_addr) != 1)
+            return proxy_parse_invalid;
+      } else {
+         struct sockaddr_in6* s = reinterpret_cast<struct sockaddr_in6*>(&src);
+         struct sockaddr_in6* d = reinterpret_cast<struct sockaddr_in6*>(&dst);
+         s->sin6_family = d->sin6_family = AF_INET6;
+         s->sin6_port = htons(static_cast<uint16_t>(src_port));
+         d->sin6_port = htons(static_cast<uint16_t>(dst_port));
+         if(inet_pton(AF_INET6, src_text, &s->sin6_addr) != 1 || inet_pton(AF_INET6, dst_text, &d->sin6_addr) != 1)
+            return proxy_parse_invalid;
+      }
+      return proxy_parse_done;
+   }
+}
+
+#endif // _PROXY_PROTOCOL_H
@@ -0,0 +1,394 @@
+#ifndef _RATE_LIMIT_H
+#define _RATE_LIMIT_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <netinet/in.h>
+#include <sys/socket.h>
+}
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+namespace tcp_proxy
+{
+   // What a bandwidth limit is shared by
+   enum rate_tier
+   {
+      tier_client,     // the connections of one client address
+      tier_upstream,   // the connections to one backend
+      tier_global,     // everything the proxy relays
+      tier_count
+   };
+
+   inline const char* rate_tier_name(rate_tier t)
+   {
+      static const char* const names[tier_count] = { "client", "upstream", "global" };
+      return names[t];
+   }
+
+   // Limits in bytes per second, 0 = unlimited
+   struct rate_limit_options
+   {
+      rate_limit_options()
+         {
+            for(int t = 0; t < tier_count; ++t)
+               bytes_per_sec[t] = 0;
+         }
+
+      bool any() const
+         {
+            return bytes_per_sec[tier_client] || bytes_per_sec[tier_upstream] || bytes_per_sec[tier_global];
+         }
+
+      uint64_t bytes_per_sec[tier_count];
+   };
+
+   // The limits in force. The admin endpoint changes them on the main
+   // thread and then applies them to the route's rate_group_set.
+   class rate_limits
+   {
+   public:
+      explicit rate_limits(const rate_limit_options& options)
+         {
+            for(int t = 0; t < tier_count; ++t)
+               rates_[t].store(options.bytes_per_sec[t], std::memory_order_relaxed);
+         }
+
+      uint64_t get(rate_tier t) const
+         {
+            return rates_[t].load(std::memory_order_relaxed);
+         }
+
+      void set(rate_tier t, uint64_t bytes_per_sec)
+         {
+            rates_[t].store(bytes_per_sec, std::memory_order_relaxed);
+         }
+
+   private:
+      rate_limits(const rate_limits&);
+      rate_limits& operator=(const rate_limits&);
+
+      std::atomic<uint64_t> rates_[tier_count];
+   };
+
+   // The address part of a client's sockaddr, which keys its group
+   inline std::string client_key(const struct sockaddr* sa)
+   {
+      if(sa->sa_family == AF_INET)
+         return std::string(reinterpret_cast<const char*>(&reinterpret_cast<const sockaddr_in*>(sa)->sin_addr), 4);
+      if(sa->sa_family == AF_INET6)
+         return std::string(reinterpret_cast<const char*>(&reinterpret_cast<const sockaddr_in6*>(sa)->sin6_addr), 16);
+      return std::string();
+   }
+
+   // A libevent rate-limit group: a read and a write token bucket shared
+   // by the member bufferevents, refilled every tick by a timer on the
+   // event_base it was made on. The members may live on any other base;
+   // libevent locks the group, but a refill suspends and resumes members
+   // from the group's thread, so they must be made with BEV_OPT_THREADSAFE.
+   // libevent takes a bufferevent into one group at most.
+   class rate_group
+   {
+   public:
+      static const int tick_ms = 100;
+
+      rate_group(struct event_base* evbase, rate_tier tier, uint64_t rate, const std::string& key = std::string())
+         : group_(NULL), tier_(tier), key_(key), members_(0)
+         {
+            struct ev_token_bucket_cfg* cfg = make_cfg(rate);
+            group_ = bufferevent_rate_limit_group_new(evbase, cfg);
+            ev_token_bucket_cfg_free(cfg);
+         }
+
+      ~rate_group()
+         {
+            if(group_)
+               bufferevent_rate_limit_group_free(group_);
+         }
+
+      // 0 lifts the limit from the current members
+      void set_rate(uint64_t rate)
+         {
+            struct ev_token_bucket_cfg* cfg = make_cfg(rate);
+            // libevent copies the configuration
+            bufferevent_rate_limit_group_set_cfg(group_, cfg);
+            ev_token_bucket_cfg_free(cfg);
+         }
+
+      // Both called with the owning rate_group_set's lock held
+      bool add(struct bufferevent* bev)
+         {
+            if(!group_ || bufferevent_add_to_rate_limit_group(bev, group_) != 0)
+               return false;
+            ++members_;
+            return true;
+         }
+
+      void remove(struct bufferevent* bev)
+         {
+            bufferevent_remove_from_rate_limit_group(bev);
+            --members_;
+         }
+
+      // An empty bucket holds back every member until the next refill
+      bool throttled() const
+         {
+            return bufferevent_rate_limit_group_get_read_limit(group_) <= 0 ||
+                   bufferevent_rate_limit_group_get_write_limit(group_) <= 0;
+         }
+
+      rate_tier tier() const
+         {
+            return tier_;
+         }
+
+      const std::string& key() const
+         {
+            return key_;
+         }
+
+      size_t members() const
+         {
+            return members_;
+         }
+
+   private:
+      rate_group(const rate_group&);
+      rate_group& operator=(const rate_group&);
+
+      // Refills a tick's worth of the rate, bursting up to a second's worth
+      static struct ev_token_bucket_cfg* make_cfg(uint64_t rate)
+         {
+            const uint64_t max = EV_RATE_LIMIT_MAX;
+            uint64_t per_tick = rate * tick_ms / 1000;
+            if(per_tick == 0)
+               per_tick = 1;
+            if(rate == 0 || rate > max)
+               per_tick = rate = max;
+            struct timeval tick = { 0, tick_ms * 1000 };
+            return ev_token_bucket_cfg_new(per_tick, rate, per_tick, rate, &tick);
+         }
+
+      struct bufferevent_rate_limit_group* group_;
+      rate_tier tier_;
+      std::string key_;   // the client address for tier_client
+      size_t members_;
+   };
+
+   // A token bucket for a limit libevent's groups cannot add: a bridge's
+   // two legs are already in their client's and their backend's group, so
+   // the global limit is drawn from here on every relayed read. Any
+   // thread may take; one thread refills every tick. Taking may run the
+   // bucket into debt, which the refills pay off before anyone reads again.
+   class shared_bucket
+   {
+   public:
+      explicit shared_bucket(uint64_t rate)
+         : rate_(rate), tokens_(int64_t(std::min<uint64_t>(rate, INT64_MAX)))
+         {}
+
+      void set_rate(uint64_t rate)
+         {
+            rate_.store(rate, std::memory_order_relaxed);
+         }
+
+      bool limited() const
+         {
+            return rate_.load(std::memory_order_relaxed) != 0;
+         }
+
+      // Takes n bytes' worth; false once the bucket is empty, when the
+      // taker should stop reading until it has tokens again
+      bool take(uint64_t n)
+         {
+            if(!limited())
+               return true;
+            return tokens_.fetch_sub(int64_t(n), std::memory_order_relaxed) - int64_t(n) > 0;
+         }
+
+      bool empty() const
+         {
+            return limited() && tokens_.load(std::memory_order_relaxed) <= 0;
+         }
+
+      // A tick's worth of the rate, bursting up to a second's worth
+      void refill(unsigned int tick_ms)
+         {
+            const int64_t rate = int64_t(std::min<uint64_t>(rate_.load(std::memory_order_relaxed), INT64_MAX / 2));
+            if(!rate)
+               return;
+            const int64_t per_tick = std::max<int64_t>(1, rate * tick_ms / 1000);
+            int64_t t = tokens_.load(std::memory_order_relaxed);
+            while(!tokens_.compare_exchange_weak(t, std::min(t + per_tick, rate), std::memory_order_relaxed))
+               ;
+         }
+
+   private:
+      shared_bucket(const shared_bucket&);
+      shared_bucket& operator=(const shared_bucket&);
+
+      std::atomic<uint64_t> rate_;
+      std::atomic<int64_t> tokens_;
+   };
+
+   // Everything enforcing one set of limits, shared by all workers: a
+   // group per client and per backend, made on the main thread's loop on
+   // first use, and the global bucket. However the kernel spreads a
+   // client's connections over the workers, they draw from one budget.
+   class rate_group_set
+   {
+   public:
+      rate_group_set(struct event_base* evbase, const rate_limits& limits, size_t upstreams)
+         : evbase_(evbase), limits_(limits), upstream_groups_(upstreams), global_(limits.get(tier_global))
+         {
+            for(int t = 0; t < tier_count; ++t)
+               throttled_usec_[t].store(0, std::memory_order_relaxed);
+            tick_ev_ = event_new(evbase_, -1, EV_PERSIST, on_tick, this);
+            struct timeval tv = { 0, rate_group::tick_ms * 1000 };
+            event_add(tick_ev_, &tv);
+         }
+
+      // Every member must have left
+      ~rate_group_set()
+         {
+            event_free(tick_ev_);
+            for(client_group_map::iterator it = client_groups_.begin(); it != client_groups_.end(); ++it)
+               delete it->second;
+            for(size_t i = 0; i < upstream_groups_.size(); ++i)
+               delete upstream_groups_[i];
+         }
+
+      // Whether a new bridge's bufferevents will join a group, and so need
+      // BEV_OPT_THREADSAFE
+      bool grouped() const
+         {
+            return limits_.get(tier_client) || limits_.get(tier_upstream);
+         }
+
+      // The group for the client leg of a bridge, NULL if clients are not
+      // limited. May be called from any thread.
+      rate_group* join_client(struct bufferevent* bev, const std::string& client)
+         {
+            const uint64_t rate = limits_.get(tier_client);
+            if(!rate)
+               return NULL;
+            std::lock_guard<std::mutex> lock(mutex_);
+            rate_group*& g = client_groups_[client];
+            if(!g)
+               g = new rate_group(evbase_, tier_client, rate, client);
+            return add(g, bev);
+         }
+
+      // Likewise for the upstream leg and the backend's limit
+      rate_group* join_upstream(struct bufferevent* bev, size_t upstream)
+         {
+            const uint64_t rate = limits_.get(tier_upstream);
+            if(!rate)
+               return NULL;
+            std::lock_guard<std::mutex> lock(mutex_);
+            rate_group*& g = upstream_groups_[upstream];
+            if(!g)
+               g = new rate_group(evbase_, tier_upstream, rate);
+            return add(g, bev);
+         }
+
+      void leave(rate_group* g, struct bufferevent* bev)
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            g->remove(bev);
+            // Clients come and go, so their groups do too
+            if(g->tier() == tier_client && !g->members()) {
+               client_groups_.erase(g->key());
+               delete g;
+            }
+         }
+
+      shared_bucket& global()
+         {
+            return global_;
+         }
+
+      // Applies changed limits to the existing groups and the bucket. A
+      // client or backend limit switched on only applies to bridges
+      // connected from then on. Runs on the main thread.
+      void apply()
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            global_.set_rate(limits_.get(tier_global));
+            for(size_t i = 0; i < upstream_groups_.size(); ++i) {
+               if(upstream_groups_[i])
+                  upstream_groups_[i]->set_rate(limits_.get(tier_upstream));
+            }
+            for(client_group_map::iterator it = client_groups_.begin(); it != client_groups_.end(); ++it)
+               it->second->set_rate(limits_.get(tier_client));
+         }
+
+      // Connection-microseconds held back by each tier's limits
+      void add_throttled(rate_tier t, uint64_t usec)
+         {
+            throttled_usec_[t].fetch_add(usec, std::memory_order_relaxed);
+         }
+
+      uint64_t throttled_usec(rate_tier t) const
+         {
+            return throttled_usec_[t].load(std::memory_order_relaxed);
+         }
+
+   private:
+      typedef std::map<std::string, rate_group*> client_group_map;
+
+      rate_group_set(const rate_group_set&);
+      rate_group_set& operator=(const rate_group_set&);
+
+      rate_group* add(rate_group* g, struct bufferevent* bev)
+         {
+            if(g->add(bev))
+               return g;
+            if(g->tier() == tier_client && !g->members()) {
+               client_groups_.erase(g->key());
+               delete g;
+            }
+            return NULL;
+         }
+
+      // Refills the bucket, and counts the members of every group with an
+      // empty bucket as throttled for the tick
+      static void on_tick(evutil_socket_t fd, short what, void* arg)
+         {
+            rate_group_set* self = static_cast<rate_group_set*>(arg);
+            self->global_.refill(rate_group::tick_ms);
+            std::lock_guard<std::mutex> lock(self->mutex_);
+            for(size_t i = 0; i < self->upstream_groups_.size(); ++i)
+               self->sample(self->upstream_groups_[i]);
+            for(client_group_map::iterator it = self->client_groups_.begin(); it != self->client_groups_.end(); ++it)
+               self->sample(it->second);
+         }
+
+      void sample(const rate_group* g)
+         {
+            if(g && g->members() && g->throttled())
+               add_throttled(g->tier(), uint64_t(g->members()) * rate_group::tick_ms * 1000);
+         }
+
+      struct event_base* evbase_;
+      const rate_limits& limits_;
+      std::mutex mutex_;   // guards the groups and their member counts
+      client_group_map client_groups_;
+      std::vector<rate_group*> upstream_groups_;   // indexed like the balancer
+      shared_bucket global_;
+      std::atomic<uint64_t> throttled_usec_[tier_count];
+      struct event* tick_ev_;
+   };
+}
+
+#endif // _RATE_LIMIT_H
@@ -0,0 +1,157 @@
+#ifndef _SLAB_ALLOC_H
+#define _SLAB_ALLOC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+namespace tcp_proxy
+{
+   // Size-class allocator for libevent's own memory (events, bufferevents,
+   // evbuffer chains), installed with event_set_mem_functions. Freed blocks
+   // go to a per-thread cache for their class and are handed out again, so
+   // a worker that keeps accepting and closing connections stops calling
+   // malloc once its caches are warm. Every block starts with a small
+   // header naming its class, since libevent frees without a size.
+   class slab
+   {
+   public:
+      // Must run before anything else touches libevent
+      static void install()
+         {
+            event_set_mem_functions(allocate, reallocate, release);
+         }
+
+      struct stats
+      {
+         uint64_t allocations;   // requests served
+         uint64_t heap_calls;    // requests that had to go to malloc
+      };
+
+      // Counters of the calling thread
+      static stats thread_stats()
+         {
+            stats s = { cache().allocations, cache().heap_calls };
+            return s;
+         }
+
+   private:
+      static const unsigned int min_shift = 5;           // 32 bytes
+      static const unsigned int max_shift = 17;          // 128 KiB
+      static const unsigned int num_classes = max_shift - min_shift + 1;
+      static const uint32_t large = ~uint32_t(0);        // malloc'ed, not cached
+      // Each class keeps at most this many bytes cached per thread
+      static const size_t max_cached_bytes = 4 * 1024 * 1024;
+
+      // 16 bytes keep the payload as aligned as malloc's
+      struct header
+      {
+         uint32_t size_class;
+         uint32_t pad[3];
+      };
+
+      struct free_block
+      {
+         free_block* next;
+      };
+
+      struct thread_cache
+      {
+         free_block* lists[num_classes];
+         size_t counts[num_classes];
+         uint64_t allocations;
+         uint64_t heap_calls;
+      };
+
+      // Zero initialised and never destroyed: blocks cached by a thread that
+      // exits stay with it, and threads only exit at shutdown.
+      static thread_cache& cache()
+         {
+            static __thread thread_cache c;
+            return c;
+         }
+
+      static uint32_t class_of(size_t bytes)
+         {
+            const size_t total = bytes + sizeof(header);
+            if(total > (size_t(1) << max_shift))
+               return large;
+            unsigned int shift = min_shift;
+            while((size_t(1) << shift) < total)
+               ++shift;
+            return shift - min_shift;
+         }
+
+      static size_t usable_size(uint32_t size_class)
+         {
+            return (size_t(1) << (size_class + min_shift)) - sizeof(header);
+         }
+
+      static void* allocate(size_t bytes)
+         {
+            thread_cache& c = cache();
+            c.allocations++;
+            const uint32_t size_class = class_of(bytes);
+            header* h;
+            if(size_class == large) {
+               c.heap_calls++;
+               h = static_cast<header*>(malloc(bytes + sizeof(header)));
+            } else if(c.lists[size_class]) {
+               free_block* b = c.lists[size_class];
+               c.lists[size_class] = b->next;
+               c.counts[size_class]--;
+               h = reinterpret_cast<header*>(b);
+            } else {
+               c.heap_calls++;
+               h = static_cast<header*>(malloc(size_t(1) << (size_class + min_shift)));
+            }
+            if(!h)
+               return NULL;
+            h->size_class = size_class;
+            return h + 1;
+         }
+
+      static void release(void* p)
+         {
+            if(!p)
+               return;
+            header* h = static_cast<header*>(p) - 1;
+            const uint32_t size_class = h->size_class;
+            thread_cache& c = cache();
+            if(size_class == large ||
+               c.counts[size_class] * (size_t(1) << (size_class + min_shift)) >= max_cached_bytes) {
+               free(h);
+               return;
+            }
+            free_block* b = reinterpret_cast<free_block*>(h);
+            b->next = c.lists[size_class];
+            c.lists[size_class] = b;
+            c.counts[size_class]++;
+         }
+
+      static void* reallocate(void* p, size_t bytes)
+         {
+            if(!p)
+               return allocate(bytes);
+            header* h = static_cast<header*>(p) - 1;
+            if(h->size_class != large && bytes <= usable_size(h->size_class))
+               return p;
+            if(h->size_class == large) {
+               cache().heap_calls++;
+               // Stays a malloc'ed block whatever its new size; realloc keeps the header
+               header* n = static_cast<header*>(realloc(h, bytes + sizeof(header)));
+               return n ? n + 1 : NULL;
+            }
+            void* n = allocate(bytes);
+            if(!n)
+               return NULL;
+            memcpy(n, p, usable_size(h->size_class));
+            release(p);
+            return n;
+         }
+   };
+}
+
+#endif // _SLAB_ALLOC_H
@@ -0,0 +1,131 @@
+#ifndef _SLOT_MAP_H
+#define _SLOT_MAP_H
+
+#include <stdint.h>
+#include <cassert>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace tcp_proxy
+{
+   // A slot map stores values in a dense array and hands out handles that
+   // stay valid until the value is erased. Insert and erase are O(1) (erase
+   // swaps the last value into the hole), iteration walks the dense array,
+   // and a stale handle is detected through the slot's generation counter.
+   template <typename T>
+   class slot_map
+   {
+   public:
+      typedef uint64_t handle_type;
+      typedef typename std::vector<T>::iterator iterator;
+      typedef typename std::vector<T>::const_iterator const_iterator;
+
+      static const handle_type invalid_handle = ~handle_type(0);
+
+      slot_map()
+         : free_head_(npos)
+         {}
+
+      handle_type insert(const T& value)
+         {
+            uint32_t slot_index;
+            if(free_head_ != npos) {
+               slot_index = free_head_;
+               free_head_ = slots_[slot_index].next_free;
+            } else {
+               slot_index = static_cast<uint32_t>(slots_.size());
+               slots_.push_back(slot());
+            }
+            slot& s = slots_[slot_index];
+            s.dense_index = static_cast<uint32_t>(values_.size());
+            values_.push_back(value);
+            dense_to_slot_.push_back(slot_index);
+            return make_handle(slot_index, s.generation);
+         }
+
+      bool contains(handle_type h) const
+         {
+            const uint32_t slot_index = index_of(h);
+            return slot_index < slots_.size() &&
+               slots_[slot_index].generation == generation_of(h) &&
+               slots_[slot_index].dense_index != npos;
+         }
+
+      T* find(handle_type h)
+         {
+            return contains(h) ? &values_[slots_[index_of(h)].dense_index] : NULL;
+         }
+
+      bool erase(handle_type h)
+         {
+            if(!contains(h))
+               return false;
+            const uint32_t slot_index = index_of(h);
+            slot& s = slots_[slot_index];
+            const uint32_t hole = s.dense_index;
+            const uint32_t last = static_cast<uint32_t>(values_.size() - 1);
+            s.dense_index = npos;
+            s.generation++;
+            s.next_free = free_head_;
+            free_head_ = slot_index;
+            // Move the value out before popping: destroying it may re-enter
+            // the map (a bridge erasing itself), which must see a consistent state.
+            T victim(std::move(values_[hole]));
+            if(hole != last) {
+               values_[hole] = std::move(values_[last]);
+               dense_to_slot_[hole] = dense_to_slot_[last];
+               slots_[dense_to_slot_[hole]].dense_index = hole;
+            }
+            values_.pop_back();
+            dense_to_slot_.pop_back();
+            return true;
+         }
+
+      void clear()
+         {
+            while(!values_.empty())
+               erase(make_handle(dense_to_slot_.back(), slots_[dense_to_slot_.back()].generation));
+         }
+
+      size_t size() const { return values_.size(); }
+      bool empty() const { return values_.empty(); }
+      T& back() { return values_.back(); }
+      iterator begin() { return values_.begin(); }
+      iterator end() { return values_.end(); }
+      const_iterator begin() const { return values_.begin(); }
+      const_iterator end() const { return values_.end(); }
+
+      void reserve(size_t n)
+         {
+            values_.reserve(n);
+            dense_to_slot_.reserve(n);
+            slots_.reserve(n);
+         }
+
+   private:
+      static const uint32_t npos = ~uint32_t(0);
+
+      struct slot
+      {
+         slot() : dense_index(npos), generation(0), next_free(npos) {}
+         uint32_t dense_index;
+         uint32_t generation;
+         uint32_t next_free;
+      };
+
+      static handle_type make_handle(uint32_t index, uint32_t generation)
+         {
+            return (static_cast<handle_type>(generation) << 32) | index;
+         }
+      static uint32_t index_of(handle_type h) { return static_cast<uint32_t>(h); }
+      static uint32_t generation_of(handle_type h) { return static_cast<uint32_t>(h >> 32); }
+
+      std::vector<T> values_;
+      std::vector<uint32_t> dense_to_slot_;
+      std::vector<slot> slots_;
+      uint32_t free_head_;
+   };
+}
+
+#endif // _SLOT_MAP_H
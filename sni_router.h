@@ -0,0 +1,161 @@
+#ifndef _SNI_ROUTER_H
+#define _SNI_ROUTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+
+#include <string>
+#include <unordered_map>
+
+namespace tcp_proxy
+{
+   // A TLS record carries at most 2^14 bytes; the ClientHello is looked for
+   // in the first one only
+   static const size_t tls_record_max = 5 + 16384;
+
+   enum sni_parse_result
+   {
+      sni_incomplete,   // the first record has not fully arrived
+      sni_not_found,    // not a ClientHello, or one without a host name
+      sni_found
+   };
+
+   // Finds the server name in the ClientHello at the start of data[0, len)
+   // without copying: `name` points into `data`. Every length is checked
+   // against the record, so a malformed hello reads nothing outside it.
+   inline sni_parse_result parse_client_hello_sni(const char* data, size_t len, const char*& name, size_t& name_len)
+   {
+      const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+      // Handshake record, TLS 1.x
+      if(len >= 1 && p[0] != 0x16)
+         return sni_not_found;
+      if(len >= 2 && p[1] != 0x03)
+         return sni_not_found;
+      if(len < 5)
+         return sni_incomplete;
+      const size_t record_len = (size_t(p[3]) << 8) | p[4];
+      if(record_len > tls_record_max - 5)
+         return sni_not_found;
+      if(len < 5 + record_len)
+         return sni_incomplete;
+      const unsigned char* end = p + 5 + record_len;
+      p += 5;
+      // ClientHello: type, length, version, random
+      if(end - p < 4 + 2 + 32 || p[0] != 0x01)
+         return sni_not_found;
+      p += 4 + 2 + 32;
+      // Session id, cipher suites and compression methods
+      if(end - p < 1 || end - p < 1 + p[0])
+         return sni_not_found;
+      p += 1 + p[0];
+      if(end - p < 2)
+         return sni_not_found;
+      size_t n = (size_t(p[0]) << 8) | p[1];
+      if(size_t(end - p) < 2 + n)
+         return sni_not_found;
+      p += 2 + n;
+      if(end - p < 1 || end - p < 1 + p[0])
+         return sni_not_found;
+      p += 1 + p[0];
+      // Extensions, which may run on into the next record; those are not
+      // searched
+      if(end - p < 2)
+         return sni_not_found;
+      p += 2;
+      while(end - p >= 4) {
+         const unsigned int type = (unsigned int)(p[0] << 8) | p[1];
+         n = (size_t(p[2]) << 8) | p[3];
+         p += 4;
+         if(size_t(end - p) < n)
+            return sni_not_found;
+         if(type == 0x0000) {
+            // server_name: a list of (type, name); the first host_name wins
+            if(n < 2)
+               return sni_not_found;
+            const unsigned char* q = p + 2;
+            const unsigned char* list_end = p + n;
+            while(list_end - q >= 3) {
+               const size_t l = (size_t(q[1]) << 8) | q[2];
+               if(size_t(list_end - q - 3) < l)
+                  return sni_not_found;
+               if(q[0] == 0x00 && l > 0) {
+                  name = reinterpret_cast<const char*>(q + 3);
+                  name_len = l;
+                  return sni_found;
+               }
+               q += 3 + l;
+            }
+            return sni_not_found;
+         }
+         p += n;
+      }
+      return sni_not_found;
+   }
+
+   // Maps server names to backends (indices into the upstream list). A
+   // pattern is either an exact name or "*.<domain>", which matches any
+   // name below <domain>; the longest matching domain wins. Built before
+   // the workers start and only read afterwards.
+   class sni_router
+   {
+   public:
+      static const size_t name_max = 255;
+
+      bool empty() const
+         {
+            return exact_.empty() && wildcard_.empty();
+         }
+
+      // False for a malformed pattern
+      bool add(const std::string& pattern, size_t upstream_index)
+         {
+            std::string key;
+            const bool wildcard = pattern.compare(0, 2, "*.") == 0;
+            if(!normalize(pattern.data() + (wildcard ? 2 : 0), pattern.size() - (wildcard ? 2 : 0), key) ||
+               key.find('*') != std::string::npos)
+               return false;
+            (wildcard ? wildcard_ : exact_)[key] = upstream_index;
+            return true;
+         }
+
+      // The backend for `name`, or -1 when no pattern matches. `scratch`
+      // is reused across calls, so a warm one saves the allocation.
+      long route(const char* name, size_t len, std::string& scratch) const
+         {
+            if(!normalize(name, len, scratch))
+               return -1;
+            std::unordered_map<std::string, size_t>::const_iterator it = exact_.find(scratch);
+            if(it != exact_.end())
+               return long(it->second);
+            if(wildcard_.empty())
+               return -1;
+            for(size_t dot = scratch.find('.'); dot != std::string::npos; dot = scratch.find('.')) {
+               scratch.erase(0, dot + 1);
+               it = wildcard_.find(scratch);
+               if(it != wildcard_.end())
+                  return long(it->second);
+            }
+            return -1;
+         }
+
+   private:
+      // Lower case, without a trailing dot
+      static bool normalize(const char* name, size_t len, std::string& out)
+         {
+            if(len > 0 && name[len - 1] == '.')
+               --len;
+            if(len == 0 || len > name_max)
+               return false;
+            out.assign(name, len);
+            for(size_t i = 0; i < len; ++i)
+               out[i] = static_cast<char>(tolower(static_cast<unsigned char>(out[i])));
+            return true;
+         }
+
+      std::unordered_map<std::string, size_t> exact_;
+      std::unordered_map<std::string, size_t> wildcard_;   // keyed by the domain after "*."
+   };
+}
+
+#endif // _SNI_ROUTER_H
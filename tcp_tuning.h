@@ -0,0 +1,82 @@
+#ifndef _TCP_TUNING_H
+#define _TCP_TUNING_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+}
+
+#include "proxy_log.h"
+
+namespace tcp_proxy
+{
+   // Handshake shortcuts for the two legs of a connection, applied the same
+   // way by either engine. All of them are off by default and each one is
+   // best effort: a socket the kernel refuses an option on still relays.
+   //
+   // Both fast open on upstream connects and deferred accept wait for the
+   // client to speak first, so neither suits protocols where the server
+   // sends the first bytes (SMTP, FTP, MySQL, ...).
+   struct tcp_tuning
+   {
+      tcp_tuning()
+         : fastopen_queue(0), fastopen_connect(false), defer_accept_s(0)
+         {}
+
+      // Listener: TCP_FASTOPEN with this many pending fast open requests
+      // (0 = off), so a returning client's first payload rides in its SYN
+      unsigned int fastopen_queue;
+      // Upstream: TCP_FASTOPEN_CONNECT, so connect() returns at once and the
+      // SYN leaves with the first bytes written to the socket
+      bool fastopen_connect;
+      // Listener: TCP_DEFER_ACCEPT, so accept() only sees a connection once
+      // data has arrived on it, giving up after this many seconds (0 = off)
+      unsigned int defer_accept_s;
+
+      void apply_listener(int fd) const
+         {
+            if(fastopen_queue &&
+               setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_queue, sizeof(fastopen_queue)) != 0)
+               PROXY_LOG_WARN("Could not enable TCP fast open on the listener: %s", strerror(errno));
+            if(defer_accept_s &&
+               setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept_s, sizeof(defer_accept_s)) != 0)
+               PROXY_LOG_WARN("Could not enable deferred accept on the listener: %s", strerror(errno));
+         }
+
+      // Has to precede the connect
+      void apply_upstream(int fd) const
+         {
+            const int one = 1;
+            if(fastopen_connect &&
+               setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)) != 0)
+               PROXY_LOG_WARN("Could not enable TCP fast open on an upstream socket: %s", strerror(errno));
+         }
+
+      // The net.ipv4.tcp_fastopen sysctl gates both sides (bit 0 client,
+      // bit 1 server); the socket options succeed regardless, so say so
+      // when the kernel will ignore them
+      void check_kernel() const
+         {
+            if(!fastopen_queue && !fastopen_connect)
+               return;
+            int mode = 0;
+            FILE* f = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+            if(!f)
+               return;
+            if(fscanf(f, "%d", &mode) != 1)
+               mode = 0;
+            fclose(f);
+            if(fastopen_queue && !(mode & 2))
+               PROXY_LOG_WARN("net.ipv4.tcp_fastopen = %d: the kernel will not accept fast open from clients", mode);
+            if(fastopen_connect && !(mode & 1))
+               PROXY_LOG_WARN("net.ipv4.tcp_fastopen = %d: the kernel will not use fast open towards upstreams", mode);
+         }
+   };
+}
+
+#endif // _TCP_TUNING_H
@@ -1,37 +1,584 @@
 #include <cstdlib>
 #include <cstddef>
+#include <fstream>
 #include <iostream>
 #include <string>
+#include <map>
+#include <set>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/bind.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include "./lev-master/include/lev.h"
 #include <boost/lexical_cast.hpp>
+#include <event2/thread.h>
+#include <event2/bufferevent_ssl.h>
+#include "slot_map.h"
+#include "proxy_log.h"
+#include "proxy_clock.h"
+#include "upstream_pool.h"
+#include "upstream_balancer.h"
+#include "upstream_health.h"
+#include "proxy_metrics.h"
+#include "object_pool.h"
+#include "slab_alloc.h"
+#include "tcp_tuning.h"
+#include "cpu_affinity.h"
+#include "listener_handoff.h"
+#include "timeout_queue.h"
+#include "memory_budget.h"
+#include "rate_limit.h"
+#include "proxy_protocol.h"
+#include "sni_router.h"
+#include "tls_server.h"
+#include "uring_engine.h"
 
 extern "C" {
 #include <sys/socket.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 }
 
 using namespace lev;
 namespace tcp_proxy
 {
-   bool debug = true;
+   // How payload moves between the two sockets of a bridge
+   enum relay_mode
+   {
+      relay_bufferevent,   // libevent bufferevents (copies through user space)
+      relay_splice         // splice() through a per-direction pipe (zero copy)
+   };
+
+   // What drives a worker's sockets
+   enum io_engine
+   {
+      engine_libevent,     // readiness callbacks and a read/write call per socket
+      engine_io_uring      // completions from io_uring, submitted in batches
+   };
+
+   // Flow control for one direction of a bridge: reading from the source
+   // pauses once the destination's output buffer holds `high` bytes and
+   // resumes when it has drained to `low`. high == 0 selects the original
+   // ping-pong, where every chunk must be written before the next read.
+   struct watermarks
+   {
+      watermarks(size_t l, size_t h)
+         : low(l), high(h)
+         {}
+
+      // Parses "<low>:<high>"
+      static watermarks parse(const std::string& value)
+         {
+            const size_t colon = value.find(':');
+            if(colon == std::string::npos)
+               throw boost::bad_lexical_cast();
+            watermarks w(boost::lexical_cast<size_t>(value.substr(0, colon)),
+                         boost::lexical_cast<size_t>(value.substr(colon + 1)));
+            if(w.low > w.high)
+               throw boost::bad_lexical_cast();
+            return w;
+         }
+
+      size_t low;
+      size_t high;
+   };
+
+   struct proxy_options
+   {
+      proxy_options()
+         : num_workers(1),
+           engine(engine_libevent),
+           relay(relay_bufferevent),
+           upstream_watermarks(32768, 262144),
+           downstream_watermarks(32768, 262144),
+           min_log_level(log_info),
+           balance(balance_round_robin),
+           pool_size(0),
+           pool_max_idle_ms(30000),
+           admin_enabled(false),
+           slab_alloc(true),
+           drain_timeout_ms(30000),
+           memory_budget(0),
+           send_proxy(proxy_protocol_off),
+           accept_proxy(false)
+         {}
+
+      // Parses the optional "--name value" pairs that follow the positional arguments.
+      bool parse(int argc, char* argv[], int first)
+         {
+            std::vector<std::pair<std::string, upstream_spec> > routes;
+            for(int i = first; i < argc; ++i) {
+               const std::string name = argv[i];
+               if(i + 1 >= argc) {
+                  std::cerr << "Error: Missing value for option " << name << std::endl;
+                  return false;
+               }
+               const std::string value = argv[++i];
+               try
+               {
+                  if(name == "--workers") {
+                     num_workers = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--engine") {
+                     if(value == "libevent")
+                        engine = engine_libevent;
+                     else if(value == "io_uring")
+                        engine = engine_io_uring;
+                     else
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--relay") {
+                     if(value == "bufferevent")
+                        relay = relay_bufferevent;
+                     else if(value == "splice")
+                        relay = relay_splice;
+                     else
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--log-level") {
+                     if(!logger::parse_level(value, min_log_level))
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--log-file") {
+                     log_file = value;
+                  } else if(name == "--upstream") {
+                     upstream_spec spec(IpAddr(), 1);
+                     if(!upstream_spec::parse(value, spec))
+                        throw boost::bad_lexical_cast();
+                     upstreams.push_back(spec);
+                  } else if(name == "--sni-route") {
+                     const size_t eq = value.find('=');
+                     upstream_spec spec(IpAddr(), 1);
+                     if(eq == std::string::npos || value.find('@') != std::string::npos ||
+                        !upstream_spec::parse(value.substr(eq + 1), spec))
+                        throw boost::bad_lexical_cast();
+                     routes.push_back(std::make_pair(value.substr(0, eq), spec));
+                  } else if(name == "--tls-cert") {
+                     tls.cert_file = value;
+                  } else if(name == "--tls-key") {
+                     tls.key_file = value;
+                  } else if(name == "--tls-session-cache") {
+                     tls.session_cache = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--tls-tickets") {
+                     if(value == "on")
+                        tls.tickets = true;
+                     else if(value == "off")
+                        tls.tickets = false;
+                     else
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--tls-ticket-key") {
+                     tls.ticket_key_file = value;
+                  } else if(name == "--ktls") {
+                     if(value == "on")
+                        tls.ktls = true;
+                     else if(value == "off")
+                        tls.ktls = false;
+                     else
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--balance") {
+                     if(value == "round-robin")
+                        balance = balance_round_robin;
+                     else if(value == "least-conn")
+                        balance = balance_least_conn;
+                     else if(value == "hash")
+                        balance = balance_hash;
+                     else
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--health-interval") {
+                     health.interval_ms = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--health-timeout") {
+                     health.timeout_ms = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--health-rise") {
+                     health.rise = std::max(1u, boost::lexical_cast<unsigned int>(value));
+                  } else if(name == "--health-fall") {
+                     health.fall = std::max(1u, boost::lexical_cast<unsigned int>(value));
+                  } else if(name == "--health-send") {
+                     health.send = health_check_options::unescape(value);
+                  } else if(name == "--health-expect") {
+                     health.expect = health_check_options::unescape(value);
+                  } else if(name == "--admin") {
+                     if(!admin_address.assign(value.c_str()))
+                        throw boost::bad_lexical_cast();
+                     admin_enabled = true;
+                  } else if(name == "--allocator") {
+                     if(value == "slab")
+                        slab_alloc = true;
+                     else if(value == "malloc")
+                        slab_alloc = false;
+                     else
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--pool-size") {
+                     pool_size = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--pool-max-idle") {
+                     pool_max_idle_ms = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--cpu-affinity") {
+                     if(value == "off")
+                        affinity.cpus.clear();
+                     else if(value == "auto")
+                        affinity.cpus = allowed_cpus();
+                     else if(!parse_cpu_list(value, affinity.cpus))
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--steering") {
+                     if(value == "off")
+                        affinity.steering = steer_off;
+                     else if(value == "incoming-cpu")
+                        affinity.steering = steer_incoming_cpu;
+                     else if(value == "bpf")
+                        affinity.steering = steer_bpf;
+                     else
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--fastopen") {
+                     tcp.fastopen_queue = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--upstream-fastopen") {
+                     if(value == "on")
+                        tcp.fastopen_connect = true;
+                     else if(value == "off")
+                        tcp.fastopen_connect = false;
+                     else
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--defer-accept") {
+                     tcp.defer_accept_s = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--connect-timeout") {
+                     timeouts.connect_ms = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--idle-read-timeout") {
+                     timeouts.idle_read_ms = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--idle-write-timeout") {
+                     timeouts.idle_write_ms = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--max-lifetime") {
+                     timeouts.lifetime_ms = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--linger-timeout") {
+                     timeouts.linger_ms = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--handoff-socket") {
+                     handoff_socket = value;
+                  } else if(name == "--drain-timeout") {
+                     drain_timeout_ms = boost::lexical_cast<unsigned int>(value);
+                  } else if(name == "--memory-budget") {
+                     if(!memory_budget::parse_size(value, memory_budget))
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--rate-client") {
+                     if(!memory_budget::parse_size(value, rate_limit.bytes_per_sec[tier_client]))
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--rate-upstream") {
+                     if(!memory_budget::parse_size(value, rate_limit.bytes_per_sec[tier_upstream]))
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--rate-global") {
+                     if(!memory_budget::parse_size(value, rate_limit.bytes_per_sec[tier_global]))
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--send-proxy") {
+                     if(value == "off")
+                        send_proxy = proxy_protocol_off;
+                     else if(value == "v1")
+                        send_proxy = proxy_protocol_v1;
+                     else if(value == "v2")
+                        send_proxy = proxy_protocol_v2;
+                     else
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--accept-proxy") {
+                     if(value == "on")
+                        accept_proxy = true;
+                     else if(value == "off")
+                        accept_proxy = false;
+                     else
+                        throw boost::bad_lexical_cast();
+                  } else if(name == "--upstream-watermarks") {
+                     upstream_watermarks = watermarks::parse(value);
+                  } else if(name == "--downstream-watermarks") {
+                     downstream_watermarks = watermarks::parse(value);
+                  } else {
+                     std::cerr << "Error: Unknown option " << name << std::endl;
+                     return false;
+                  }
+               } catch(boost::bad_lexical_cast&) {
+                  std::cerr << "Error: Invalid value '" << value << "' for option " << name << std::endl;
+                  return false;
+               }
+            }
+            // A routed backend that is not also an --upstream joins the list
+            // with weight 0: it gets the pool, health checks and metrics of
+            // any backend, but only SNI routes send connections to it
+            for(size_t r = 0; r < routes.size(); ++r) {
+               size_t index = 0;
+               while(index < upstreams.size() && upstreams[index].addr.toStringFull() != routes[r].second.addr.toStringFull())
+                  ++index;
+               if(index == upstreams.size())
+                  upstreams.push_back(upstream_spec(routes[r].second.addr, 0));
+               if(!sni_routes.add(routes[r].first, index)) {
+                  std::cerr << "Error: Invalid server name '" << routes[r].first << "' for option --sni-route" << std::endl;
+                  return false;
+               }
+            }
+            if(num_workers == 0)
+               num_workers = std::max(1u, boost::thread::hardware_concurrency());
+            // Steering to a worker's CPU needs the worker to stay on it
+            if(affinity.steering != steer_off && affinity.cpus.empty())
+               affinity.cpus = allowed_cpus();
+            return true;
+         }
+
+      unsigned int num_workers;
+      // io_uring relays on its own: --relay, the upstream pool and the
+      // allocator only apply to the libevent engine
+      io_engine engine;
+      relay_mode relay;
+      // Bound the data queued towards upstream (read from downstream) and
+      // towards downstream (read from upstream) respectively
+      watermarks upstream_watermarks;
+      watermarks downstream_watermarks;
+      log_level min_log_level;
+      std::string log_file;
+      // Backends to spread connections over; the positional forward address
+      // comes first, then every --upstream
+      std::vector<upstream_spec> upstreams;
+      balance_policy balance;
+      health_check_options health;
+      // Pre-connected upstream sockets kept by each worker (0 disables the
+      // pool) and how long one may sit unused before it is closed (0 = forever)
+      unsigned int pool_size;
+      unsigned int pool_max_idle_ms;
+      // Local HTTP endpoint serving /metrics
+      bool admin_enabled;
+      IpAddr admin_address;
+      // Serve libevent's allocations from per-thread size-class caches
+      bool slab_alloc;
+      // TCP fast open and deferred accept
+      tcp_tuning tcp;
+      // Worker CPU pinning and connection steering
+      affinity_options affinity;
+      // Connect, idle and lifetime limits of every bridge
+      timeout_options timeouts;
+      // Unix socket a successor connects to for the listeners (see
+      // listener_handoff.h), and how long bridges may take to finish once
+      // it has taken over
+      std::string handoff_socket;
+      unsigned int drain_timeout_ms;
+      // Bytes all workers together may hold in relay buffers before they
+      // stop reading (0 = no limit); the watermarks bound each bridge
+      uint64_t memory_budget;
+      // Bandwidth limits at start-up; the admin endpoint can change them
+      rate_limit_options rate_limit;
+      // PROXY protocol header sent to upstreams, and whether clients
+      // (i.e. a load balancer in front) start with one
+      proxy_protocol_version send_proxy;
+      bool accept_proxy;
+      // Backends picked by the server name in the TLS ClientHello; names
+      // that match no route, and connections without one, are balanced
+      sni_router sni_routes;
+      // TLS termination on the listener; backends still get plaintext
+      tls_options tls;
+   };
+
+   // One listen address and where its connections go: the positional
+   // arguments, or a [route] section of the config file
+   struct route_config
+   {
+      route_config()
+         : local_port(0)
+         {}
+
+      std::string name;   // the route label of its metrics
+      std::string local_host;
+      unsigned short local_port;
+      proxy_options options;
+   };
+
+   // Reads a config file of "<option> <value>" lines, where <option> is a
+   // command line option without the dashes, and '#' starts a comment line:
+   //
+   //    workers 4
+   //    admin 127.0.0.1:9100
+   //    connect-timeout 5000       # a default for every route
+   //
+   //    [route web]
+   //    listen 0.0.0.0:443
+   //    upstream 10.0.0.1:443
+   //    upstream 10.0.0.2:443
+   //
+   //    [route db]
+   //    listen 0.0.0.0:5432
+   //    upstream 10.0.1.1:5432
+   //    connect-timeout 1000
+   //
+   // Options before the first route configure the process and are the
+   // defaults of every route; options of the process as a whole may only
+   // appear there, and listen, upstream and sni-route only in a route.
+   class config_file
+   {
+   public:
+      static bool load(const std::string& path, proxy_options& process, std::vector<route_config>& routes)
+         {
+            std::ifstream in(path.c_str());
+            if(!in) {
+               std::cerr << "Error: Could not read the config file " << path << std::endl;
+               return false;
+            }
+            std::vector<std::string> defaults;
+            std::vector<std::vector<std::string> > route_args;
+            std::string line;
+            for(unsigned int number = 1; std::getline(in, line); ++number) {
+               const std::string where = path + ":" + std::to_string(number);
+               line = trim(line);
+               if(line.empty() || line[0] == '#')
+                  continue;
+               if(line[0] == '[') {
+                  if(line[line.size() - 1] != ']' || line.compare(1, 6, "route ") != 0 ||
+                     !valid_name(trim(line.substr(7, line.size() - 8)))) {
+                     std::cerr << "Error: " << where << ": expected [route <name>] with a name of letters, digits, "
+                               << "'_', '-' and '.'" << std::endl;
+                     return false;
+                  }
+                  route_config route;
+                  route.name = trim(line.substr(7, line.size() - 8));
+                  for(size_t r = 0; r < routes.size(); ++r) {
+                     if(routes[r].name == route.name) {
+                        std::cerr << "Error: " << where << ": route " << route.name << " is declared twice" << std::endl;
+                        return false;
+                     }
+                  }
+                  routes.push_back(route);
+                  route_args.push_back(std::vector<std::string>());
+                  continue;
+               }
+               const size_t space = line.find_first_of(" \t");
+               const std::string name = line.substr(0, space);
+               const std::string value = space == std::string::npos ? std::string() : trim(line.substr(space));
+               if(value.empty()) {
+                  std::cerr << "Error: " << where << ": missing value for " << name << std::endl;
+                  return false;
+               }
+               if(routes.empty() ? route_only(name) : process_only(name)) {
+                  std::cerr << "Error: " << where << ": " << name << " only applies "
+                            << (routes.empty() ? "within a [route]" : "before the first [route]") << std::endl;
+                  return false;
+               }
+               if(name == "listen") {
+                  route_config& route = routes.back();
+                  IpAddr addr;
+                  if(!route.local_host.empty()) {
+                     std::cerr << "Error: " << where << ": route " << route.name << " already listens" << std::endl;
+                     return false;
+                  }
+                  if(value.find(':') == std::string::npos || !addr.assign(value.c_str()) || !addr.port()) {
+                     std::cerr << "Error: " << where << ": invalid listen address '" << value << "'" << std::endl;
+                     return false;
+                  }
+                  route.local_host = addr.toString();
+                  route.local_port = addr.port();
+                  continue;
+               }
+               std::vector<std::string> args;
+               args.push_back("--" + name);
+               args.push_back(value);
+               // Checked on its own first, so a bad value is reported with its line
+               proxy_options scratch;
+               if(!parse(scratch, args)) {
+                  std::cerr << "  in " << where << std::endl;
+                  return false;
+               }
+               std::vector<std::string>& section = routes.empty() ? defaults : route_args.back();
+               section.insert(section.end(), args.begin(), args.end());
+            }
+            if(routes.empty()) {
+               std::cerr << "Error: " << path << " declares no [route]" << std::endl;
+               return false;
+            }
+            if(!parse(process, defaults))
+               return false;
+            for(size_t r = 0; r < routes.size(); ++r) {
+               route_config& route = routes[r];
+               std::vector<std::string> args(defaults);
+               args.insert(args.end(), route_args[r].begin(), route_args[r].end());
+               if(!parse(route.options, args))
+                  return false;
+               // SNI routes alone add only weight-0 backends, which leaves
+               // nowhere to send a connection that matches none of them
+               bool balanced = false;
+               for(size_t u = 0; u < route.options.upstreams.size(); ++u)
+                  balanced = balanced || route.options.upstreams[u].weight;
+               if(route.local_host.empty() || !balanced) {
+                  std::cerr << "Error: route " << route.name << " in " << path << " needs a listen address and "
+                            << "at least one upstream" << std::endl;
+                  return false;
+               }
+               for(size_t o = 0; o < r; ++o) {
+                  if(routes[o].local_host == route.local_host && routes[o].local_port == route.local_port) {
+                     std::cerr << "Error: routes " << routes[o].name << " and " << route.name << " in " << path
+                               << " listen on the same address" << std::endl;
+                     return false;
+                  }
+               }
+            }
+            return true;
+         }
+
+   private:
+      // Runs the command line parser over "--name value" pairs
+      static bool parse(proxy_options& options, std::vector<std::string> words)
+         {
+            std::vector<char*> argv;
+            for(size_t i = 0; i < words.size(); ++i)
+               argv.push_back(&words[i][0]);
+            argv.push_back(NULL);
+            return options.parse(static_cast<int>(words.size()), &argv[0], 0);
+         }
+
+      // Options of the process: its threads, logging, admin endpoint,
+      // allocator and reloads
+      static bool process_only(const std::string& name)
+         {
+            static const char* const names[] = { "workers", "engine", "log-level", "log-file", "admin", "allocator",
+                                                 "cpu-affinity", "steering", "handoff-socket", "drain-timeout",
+                                                 "memory-budget" };
+            for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+               if(name == names[i])
+                  return true;
+            }
+            return false;
+         }
+
+      static bool route_only(const std::string& name)
+         {
+            return name == "listen" || name == "upstream" || name == "sni-route";
+         }
+
+      // Route names end up in metric labels
+      static bool valid_name(const std::string& name)
+         {
+            if(name.empty())
+               return false;
+            for(size_t i = 0; i < name.size(); ++i) {
+               const char c = name[i];
+               if(!isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '-' && c != '.')
+                  return false;
+            }
+            return true;
+         }
+
+      static std::string trim(const std::string& s)
+         {
+            const size_t first = s.find_first_not_of(" \t\r");
+            if(first == std::string::npos)
+               return std::string();
+            return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+         }
+   };
+
    class bridge : public boost::enable_shared_from_this<bridge>
    {
    public:
-      static std::multimap<IpAddr, boost::shared_ptr<tcp_proxy::bridge>, IpAddrCompare> ssplice_pending_bridge_ptrs_;
+      class acceptor;
       typedef boost::shared_ptr<bridge> ptr_type;
       typedef boost::weak_ptr<bridge> weak_bridge_ptr_type;
+      typedef slot_map<ptr_type> registry_type;
       weak_bridge_ptr_type wbp_;
-      static unsigned long num_upstream_connections_;
-      static unsigned long num_downstream_connections_;
+      registry_type::handle_type registry_handle_;
 
-      bridge(struct event_base* evbase, struct evconnlistener* listener,
-             evutil_socket_t localhost_fd, IpAddr localhost_address, IpAddr upstream_server)
-         : upstream_server_(upstream_server),
+      bridge(acceptor* acceptor_inst, struct event_base* evbase, struct evconnlistener* listener,
+             evutil_socket_t localhost_fd, IpAddr localhost_address, IpAddr upstream_server, size_t upstream_index)
+         : registry_handle_(registry_type::invalid_handle),
+           acceptor_(acceptor_inst),
+           upstream_server_(upstream_server),
+           upstream_index_(upstream_index),
            localhost_address_(localhost_address),
            evbase_(evbase),
            upstream_evbuf_(NULL),
@@ -39,55 +586,250 @@ namespace tcp_proxy
            evlis_(listener),
            localhost_fd_(localhost_fd),
            upstream_bytes_read_(0),
-           downstream_bytes_read_(0)
+           downstream_bytes_read_(0),
+           upstream_connected_(false),
+           accept_usec_(monotonic_usec()),
+           connect_start_usec_(0),
+           lifetime_ev_(NULL),
+           linger_ev_(NULL),
+           idle_mark_(0)
          {
-            if(debug) {
-               std::cout << "Bridge: "<< this << "localhost fd = " << localhost_fd_ << std::endl;
-               this->num_downstream_connections_++;
+            output_cb_[0] = output_cb_[1] = NULL;
+            bev_options_ = acceptor_->bev_options();
+            downstream_rate_group_ = upstream_rate_group_ = NULL;
+            eof_[0] = eof_[1] = false;
+            proxy_header_len_ = 0;
+            tls_ = NULL;
+            finished_[0] = finished_[1] = false;
+            budget_blocked_[0] = budget_blocked_[1] = false;
+            splice_[0].fds[0] = splice_[0].fds[1] = -1;
+            splice_[1].fds[0] = splice_[1].fds[1] = -1;
+            acceptor_->metrics_.downstream_total.add();
+            acceptor_->metrics_.downstream_active.add();
+            if(logger::enabled(log_debug)) {
                sockaddr loc_sock, rem_sock;
                socklen_t len = sizeof(struct sockaddr_in);
                getpeername(localhost_fd, &rem_sock, &len);
                getsockname(localhost_fd, &loc_sock, &len);
                IpAddr loc_ep(loc_sock), rem_ep(rem_sock);
-               std::cout << __FUNCTION__ << ": num_downstream_connections = " << num_downstream_connections_ << " " << rem_ep.toStringFull() << "<-->" << loc_ep.toStringFull() << " " << std::endl;
+               PROXY_LOG_DEBUG("Bridge %p: localhost fd = %d; num_downstream_connections = %lu %s<-->%s", (void*)this,
+                               localhost_fd_, (unsigned long)acceptor_->metrics_.downstream_active.get(),
+                               rem_ep.toStringFull().c_str(), loc_ep.toStringFull().c_str());
             }
          }
 
       ~bridge()
          {
-            if(debug)
-               std::cout << "In bridge destructor " << std::endl;
+            PROXY_LOG_TRACE("In bridge destructor %p", (void*)this);
             //stop();
+            stop_splice();
+            if(lifetime_ev_)
+               event_free(lifetime_ev_);
+            if(linger_ev_)
+               event_free(linger_ev_);
+         }
+
+      // One direction of a splice relay: src -> pipe -> dst. The pipe holds
+      // whatever dst could not take yet, and src is only read when it is empty.
+      struct splice_pipe
+      {
+         bridge* owner;
+         evutil_socket_t src, dst;
+         int fds[2];
+         size_t pending;
+         bool eof;   // src has ended and dst has been shut down for writing
+         struct event* read_ev;
+         struct event* write_ev;
+         // Idle limits; the events are persistent, so a read restarts the clock
+         const struct timeval* read_timeout;
+         const struct timeval* write_timeout;
+      };
+
+      // Switches a connected bridge to the splice relay. Returns false (with
+      // nothing changed) if the pipes cannot be set up, so the caller falls
+      // back to bufferevents.
+      bool start_splice()
+         {
+            const evutil_socket_t upstream_fd = bufferevent_getfd(upstream_evbuf_);
+            if(!open_splice_pipe(splice_[0], localhost_fd_, upstream_fd)) {
+               return false;
+            }
+            if(!open_splice_pipe(splice_[1], upstream_fd, localhost_fd_)) {
+               close_splice_pipe(splice_[0]);
+               return false;
+            }
+            // The upstream bufferevent only keeps owning (and closing) the socket
+            bufferevent_disable(upstream_evbuf_, EV_READ | EV_WRITE);
+            int one = 1;
+            setsockopt(upstream_fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+            setsockopt(localhost_fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            setsockopt(localhost_fd_, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+            evutil_make_socket_nonblocking(localhost_fd_);
+            event_add(splice_[0].read_ev, splice_[0].read_timeout);
+            event_add(splice_[1].read_ev, splice_[1].read_timeout);
+            PROXY_LOG_DEBUG("Splicing downstream fd = %d <-> upstream fd = %d", localhost_fd_, upstream_fd);
+            return true;
+         }
+
+      void stop_splice()
+         {
+            close_splice_pipe(splice_[0]);
+            close_splice_pipe(splice_[1]);
+         }
+
+      bool open_splice_pipe(splice_pipe& p, evutil_socket_t src, evutil_socket_t dst)
+         {
+            if(pipe2(p.fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+               PROXY_LOG_ERROR("Could not create splice pipe: %s", strerror(errno));
+               p.fds[0] = p.fds[1] = -1;
+               return false;
+            }
+            p.owner = this;
+            p.src = src;
+            p.dst = dst;
+            p.pending = 0;
+            p.eof = false;
+            p.read_timeout = acceptor_->timeouts_.idle_read;
+            p.write_timeout = acceptor_->timeouts_.idle_write;
+            p.read_ev = event_new(evbase_, src, EV_READ | EV_PERSIST, on_splice_event, &p);
+            p.write_ev = event_new(evbase_, dst, EV_WRITE | EV_PERSIST, on_splice_event, &p);
+            return true;
+         }
+
+      static void close_splice_pipe(splice_pipe& p)
+         {
+            if(p.fds[0] < 0)
+               return;
+            event_free(p.read_ev);
+            event_free(p.write_ev);
+            close(p.fds[0]);
+            close(p.fds[1]);
+            p.fds[0] = p.fds[1] = -1;
+         }
+
+      // Moves data along one direction until src runs dry or dst pushes back.
+      // An EOF from src reaches this with the pipe empty, so it is passed on
+      // right away. Returns false on error, which closes the bridge.
+      static bool splice_relay(splice_pipe& p)
+         {
+            // Bound the work done per wakeup so one bulk flow cannot starve the loop
+            for(int round = 0; round < splice_max_rounds; ++round) {
+               if(p.pending > 0) {
+                  ssize_t n = splice(p.fds[0], NULL, p.dst, NULL, p.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                  if(n > 0) {
+                     p.pending -= n;
+                     continue;
+                  }
+                  if(n < 0 && errno == EAGAIN) {
+                     // dst is full: stop reading src until the pipe drains
+                     event_del(p.read_ev);
+                     event_add(p.write_ev, p.write_timeout);
+                     return true;
+                  }
+                  return false;
+               }
+               ssize_t n = splice(p.src, NULL, p.fds[1], NULL, splice_chunk_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+               if(n > 0) {
+                  if(&p == &p.owner->splice_[0])
+                     p.owner->count_downstream_read(n);
+                  else
+                     p.owner->count_upstream_read(n);
+                  p.pending = n;
+                  continue;
+               }
+               if(n < 0 && errno == EAGAIN) {
+                  event_del(p.write_ev);
+                  event_add(p.read_ev, p.read_timeout);
+                  return true;
+               }
+               if(n == 0) {
+                  event_del(p.read_ev);
+                  event_del(p.write_ev);
+                  shutdown(p.dst, SHUT_WR);
+                  p.eof = true;
+                  return true;
+               }
+               return false;
+            }
+            // Out of rounds: come back for whatever is left in the pipe
+            if(p.pending > 0) {
+               event_del(p.read_ev);
+               event_add(p.write_ev, p.write_timeout);
+            }
+            return true;
+         }
+
+      static void on_splice_event(evutil_socket_t fd, short what, void* arg)
+         {
+            splice_pipe* p = static_cast<splice_pipe*>(arg);
+            if(what & EV_TIMEOUT) {
+               // Persistent events re-arm themselves, so a false alarm needs nothing
+               if(p->owner->timed_out(fd == p->src))
+                  p->owner->stop();
+               return;
+            }
+            if(!splice_relay(*p)) {
+               PROXY_LOG_DEBUG("Splice relay closed on fd %d: %s", fd, strerror(errno));
+               p->owner->acceptor_->metrics_.failed.add();
+               p->owner->stop();
+            } else if(p->eof && p->owner->finish_direction(p == &p->owner->splice_[0] ? 0 : 1)) {
+               p->owner->stop();
+            }
          }
 
       void close_upstream()
          {
             // Close the upstream connection
-            if(debug) {
-               std::cout << "In close_upstream for bridge " << this << std::endl;
-            }
+            PROXY_LOG_TRACE("In close_upstream for bridge %p", (void*)this);
             //upstream_evbuf_.own(true);
             //upstream_evbuf_.free();
+            if(!upstream_evbuf_)
+               return;
+            unwatch_output(upstream_evbuf_, 0);
+            if(upstream_rate_group_) {
+               acceptor_->rates()->leave(upstream_rate_group_, upstream_evbuf_);
+               upstream_rate_group_ = NULL;
+            }
             bufferevent_free(upstream_evbuf_);
-            num_upstream_connections_--;
-            if(debug) {
-               std::cout << __FUNCTION__ << ":num_upstream_connections = " << num_upstream_connections_ << std::endl;
+            upstream_evbuf_ = NULL;
+            if(upstream_connected_) {
+               upstream_connected_ = false;
+               upstream_stats().connections_active.sub();
             }
+            PROXY_LOG_DEBUG("%s: upstream bytes read = %lld, downstream bytes read = %lld", __FUNCTION__,
+                            (long long)upstream_bytes_read_, (long long)downstream_bytes_read_);
          }
 
       void close_downstream()
          {
             // Close the upstream connection
-            if(debug) {
-               std::cout << "In close_downstream for bridge " << this << std::endl;
-            }
+            PROXY_LOG_TRACE("In close_downstream for bridge %p", (void*)this);
             //downstream_evbuf_.own(true);
             //downstream_evbuf_.free();
-            bufferevent_free(downstream_evbuf_);
-            num_downstream_connections_--;
-            if(debug) {
-               std::cout << __FUNCTION__ << ": num_downstream_connections = " << num_downstream_connections_ << std::endl;
+            if(downstream_evbuf_) {
+               unwatch_output(downstream_evbuf_, 1);
+               if(downstream_rate_group_) {
+                  acceptor_->rates()->leave(downstream_rate_group_, downstream_evbuf_);
+                  downstream_rate_group_ = NULL;
+               }
+               // OpenSSL drops the session of a connection freed without a
+               // shutdown from the cache; most clients just close, and should
+               // still resume
+               if(SSL* ssl = bufferevent_openssl_get_ssl(downstream_evbuf_))
+                  SSL_set_shutdown(ssl, SSL_get_shutdown(ssl) | SSL_SENT_SHUTDOWN);
+               bufferevent_free(downstream_evbuf_);
+               downstream_evbuf_ = NULL;
+            } else {
+               // The downstream bufferevent is only created once upstream connects
+               if(tls_) {
+                  SSL_free(tls_);
+                  tls_ = NULL;
+               }
+               evutil_closesocket(localhost_fd_);
             }
+            acceptor_->metrics_.downstream_active.sub();
+            PROXY_LOG_DEBUG("%s: num_downstream_connections = %lu", __FUNCTION__,
+                            (unsigned long)acceptor_->metrics_.downstream_active.get());
          }
 
       static void on_downstream_read(struct bufferevent* bev, void* cbarg)
@@ -106,10 +848,19 @@ namespace tcp_proxy
             //bridge_inst->upstream_evbuf_.output().append(bridge_inst->downstream_evbuf_.input());
             // evbuffer_add_buffer(bufferevent_get_output(bridge_inst->upstream_evbuf_.get_mPtr()),
             //                     bufferevent_get_input(bridge_inst->downstream_evbuf_.get_mPtr()));
-            evbuffer_add_buffer(bufferevent_get_output(bridge_inst->upstream_evbuf_),
-                                bufferevent_get_input(bridge_inst->downstream_evbuf_));
+            struct evbuffer* output = bufferevent_get_output(bridge_inst->upstream_evbuf_);
+            struct evbuffer* input = bufferevent_get_input(bridge_inst->downstream_evbuf_);
+            const size_t n = evbuffer_get_length(input);
+            bridge_inst->count_downstream_read(n);
+            const bool throttled = !bridge_inst->acceptor_->charge_global(n);
+            evbuffer_add_buffer(output, input);
             //bridge_inst->downstream_evbuf_.disable(EV_READ);
-            bufferevent_disable(bridge_inst->downstream_evbuf_, EV_READ);
+            // Keep reading until upstream has a high watermark's worth queued;
+            // on_upstream_write resumes us once it drains to the low watermark.
+            if(evbuffer_get_length(output) >= bridge_inst->acceptor_->options().upstream_watermarks.high)
+               bufferevent_disable(bridge_inst->downstream_evbuf_, EV_READ);
+            else if(throttled || bridge_inst->acceptor_->lease_.over())
+               bridge_inst->block_reading(0, throttled);
          }
 
       static void on_downstream_write(struct bufferevent* bev, void* cbarg)
@@ -119,7 +870,10 @@ namespace tcp_proxy
             bridge *bridge_inst = static_cast<bridge *>(cbarg);
 
             //bridge_inst->upstream_evbuf_.enable(EV_READ);
-            bufferevent_enable(bridge_inst->upstream_evbuf_, EV_READ);
+            if(bridge_inst->eof_[1])
+               bridge_inst->maybe_pass_eof(1);
+            else if(!bridge_inst->budget_blocked_[1])
+               bufferevent_enable(bridge_inst->upstream_evbuf_, EV_READ);
          }
 
       static void on_downstream_event(struct bufferevent* bev, short events, void* cbarg)
@@ -129,7 +883,10 @@ namespace tcp_proxy
 
             if (events & BEV_EVENT_ERROR)
             {
-               std::cerr << "Error: Downstream connection error" << std::endl;
+               // A TLS client's errors are OpenSSL's rather than the socket's
+               const unsigned long tls_error = bufferevent_get_openssl_error(bev);
+               PROXY_LOG_WARN("Downstream connection error: %s", tls_error ? ERR_reason_error_string(tls_error) :
+                              evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
                // // Close the downstream connection
                // evbuf.own(true);
                // evbuf.free();
@@ -138,9 +895,10 @@ namespace tcp_proxy
                // bridge_inst->upstream_evbuf_.own(true);
                // bridge_inst->upstream_evbuf_.free();
                //bridge_inst->close_upstream();
+               bridge_inst->count_failure();
                bridge_inst->stop();
             } else if (events & BEV_EVENT_EOF) {
-               std::cerr << "Downstream connection EOF" << std::endl;
+               PROXY_LOG_DEBUG("Downstream connection EOF");
                // Close the downstream connection
                // evbuf.own(true);
                // evbuf.free();
@@ -149,9 +907,9 @@ namespace tcp_proxy
                // bridge_inst->upstream_evbuf_.own(true);
                // bridge_inst->upstream_evbuf_.free();
                // bridge_inst->close_upstream();
-               bridge_inst->stop();
+               //bridge_inst->stop();
+               bridge_inst->on_eof(0);
             } else if (events & BEV_EVENT_TIMEOUT) {
-               std::cerr << "Error: Downstream connection TIMEDOUT" << std::endl;
                // Close the downstream connection
                // evbuf.own(true);
                // evbuf.free();
@@ -160,7 +918,10 @@ namespace tcp_proxy
                // bridge_inst->upstream_evbuf_.own(true);
                // bridge_inst->upstream_evbuf_.free();
                // bridge_inst->close_upstream();
-               bridge_inst->stop();
+               if(bridge_inst->timed_out(events & BEV_EVENT_READING))
+                  bridge_inst->stop();
+               else
+                  bufferevent_enable(bev, EV_READ);
             }
          }
 
@@ -177,10 +938,17 @@ namespace tcp_proxy
             //bridge_inst->downstream_evbuf_.output().append(bridge_inst->upstream_evbuf_.input());
             // evbuffer_add_buffer(bufferevent_get_output(bridge_inst->downstream_evbuf_.get_mPtr()),
             //                     bufferevent_get_input(bridge_inst->upstream_evbuf_.get_mPtr()));
-            evbuffer_add_buffer(bufferevent_get_output(bridge_inst->downstream_evbuf_),
-                                bufferevent_get_input(bridge_inst->upstream_evbuf_));
+            struct evbuffer* output = bufferevent_get_output(bridge_inst->downstream_evbuf_);
+            struct evbuffer* input = bufferevent_get_input(bridge_inst->upstream_evbuf_);
+            const size_t n = evbuffer_get_length(input);
+            bridge_inst->count_upstream_read(n);
+            const bool throttled = !bridge_inst->acceptor_->charge_global(n);
+            evbuffer_add_buffer(output, input);
             //bridge_inst->upstream_evbuf_.disable(EV_READ);
-            bufferevent_disable(bridge_inst->upstream_evbuf_, EV_READ);
+            if(evbuffer_get_length(output) >= bridge_inst->acceptor_->options().downstream_watermarks.high)
+               bufferevent_disable(bridge_inst->upstream_evbuf_, EV_READ);
+            else if(throttled || bridge_inst->acceptor_->lease_.over())
+               bridge_inst->block_reading(1, throttled);
          }
 
       static void on_upstream_write(struct bufferevent* bev, void* cbarg)
@@ -189,165 +957,434 @@ namespace tcp_proxy
             //    std::cout << "In upstream write " << std::endl;
             bridge* bridge_inst = static_cast<bridge *>(cbarg);
             //bridge_inst->downstream_evbuf_.enable(EV_READ);
-            bufferevent_enable(bridge_inst->downstream_evbuf_, EV_READ);
+            if(bridge_inst->eof_[0])
+               bridge_inst->maybe_pass_eof(0);
+            else if(!bridge_inst->budget_blocked_[0])
+               bufferevent_enable(bridge_inst->downstream_evbuf_, EV_READ);
+         }
+
+      // A side sent EOF, ending direction d ([0] downstream -> upstream,
+      // [1] upstream -> downstream). libevent has stopped reading it; the
+      // EOF is passed on once the other side's output has been written.
+      void on_eof(unsigned int d)
+         {
+            eof_[d] = true;
+            // The write callback now fires only on an empty buffer
+            bufferevent_setwatermark(d ? downstream_evbuf_ : upstream_evbuf_, EV_WRITE, 0, 0);
+            maybe_pass_eof(d);
+         }
+
+      // Shuts down the write half of direction d's destination once its
+      // output is empty, which may finish (and destroy) the bridge
+      void maybe_pass_eof(unsigned int d)
+         {
+            struct bufferevent* dst = d ? downstream_evbuf_ : upstream_evbuf_;
+            if(finished_[d] || evbuffer_get_length(bufferevent_get_output(dst)) > 0)
+               return;
+            // A TLS client gets its close_notify first
+            SSL* ssl = d ? bufferevent_openssl_get_ssl(dst) : NULL;
+            if(ssl)
+               SSL_shutdown(ssl);
+            shutdown(bufferevent_getfd(dst), SHUT_WR);
+            if(finish_direction(d))
+               stop();
+         }
+
+      // Direction d has passed its EOF on. Returns true once both have,
+      // and the bridge is done; until then the linger limit runs.
+      bool finish_direction(unsigned int d)
+         {
+            finished_[d] = true;
+            acceptor_->metrics_.half_closes.add();
+            PROXY_LOG_DEBUG("Bridge %p: %s half closed", (void*)this, d ? "downstream" : "upstream");
+            if(finished_[0] && finished_[1])
+               return true;
+            if(!linger_ev_ && acceptor_->timeouts_.linger) {
+               linger_ev_ = evtimer_new(evbase_, on_linger, this);
+               evtimer_add(linger_ev_, acceptor_->timeouts_.linger);
+            }
+            return false;
+         }
+
+      static void on_linger(evutil_socket_t fd, short what, void* arg)
+         {
+            bridge* bridge_inst = static_cast<bridge*>(arg);
+            PROXY_LOG_DEBUG("Bridge %p half closed for too long, closing", arg);
+            bridge_inst->acceptor_->metrics_.timeouts_linger.add();
+            bridge_inst->count_failure();
+            bridge_inst->stop();
+         }
+
+      // Stops reading into direction d ([0] downstream -> upstream, [1]
+      // upstream -> downstream) until the acceptor finds the memory budget
+      // has room and the global rate limit has tokens again; `throttled`
+      // when the rate limit is why
+      void block_reading(unsigned int d, bool throttled)
+         {
+            budget_blocked_[d] = true;
+            bufferevent_disable(d ? upstream_evbuf_ : downstream_evbuf_, EV_READ);
+            acceptor_->block(registry_handle_, d, throttled);
+         }
+
+      void unblock_reading(unsigned int d)
+         {
+            budget_blocked_[d] = false;
+            if(eof_[d])
+               return;
+            struct bufferevent* src = d ? upstream_evbuf_ : downstream_evbuf_;
+            struct bufferevent* dst = d ? downstream_evbuf_ : upstream_evbuf_;
+            const watermarks& w = d ? acceptor_->options().downstream_watermarks : acceptor_->options().upstream_watermarks;
+            // Otherwise the write callback resumes it as usual
+            if(src && dst && evbuffer_get_length(bufferevent_get_output(dst)) < w.high)
+               bufferevent_enable(src, EV_READ);
+         }
+
+      // Bytes queued in an output buffer count against the memory budget
+      // until written out or freed. Output [0] is upstream's, [1] downstream's.
+      static void on_output_changed(struct evbuffer* buf, const struct evbuffer_cb_info* info, void* arg)
+         {
+            budget_lease& lease = static_cast<bridge*>(arg)->acceptor_->lease_;
+            if(info->n_added)
+               lease.charge(info->n_added);
+            if(info->n_deleted)
+               lease.discharge(info->n_deleted);
+         }
+
+      void watch_output(struct bufferevent* bev, unsigned int i)
+         {
+            struct evbuffer* output = bufferevent_get_output(bev);
+            acceptor_->lease_.charge(evbuffer_get_length(output));
+            output_cb_[i] = evbuffer_add_cb(output, on_output_changed, this);
+         }
+
+      void unwatch_output(struct bufferevent* bev, unsigned int i)
+         {
+            if(!output_cb_[i])
+               return;
+            struct evbuffer* output = bufferevent_get_output(bev);
+            evbuffer_remove_cb_entry(output, output_cb_[i]);
+            output_cb_[i] = NULL;
+            acceptor_->lease_.discharge(evbuffer_get_length(output));
+         }
+
+      // Wires up both legs once the upstream socket is connected, whether
+      // the connect just completed or the socket came warm from the pool.
+      void on_upstream_connected()
+         {
+            upstream_connected_ = true;
+            upstream_stats().connect_usec.record(monotonic_usec() - connect_start_usec_);
+            upstream_stats().connections_total.add();
+            upstream_stats().connections_active.add();
+            if(logger::enabled(log_debug)) {
+               sockaddr loc_sock;
+               socklen_t len = sizeof(loc_sock);
+               getsockname(bufferevent_getfd(upstream_evbuf_), &loc_sock, &len);
+               PROXY_LOG_DEBUG("US Conn. %lu - Connected to upstream (%s<-->%s); upstream fd = %d; bridge ptr: %p",
+                               (unsigned long)upstream_stats().connections_total.get(), IpAddr(loc_sock).toStringFull().c_str(),
+                               upstream_server_.toStringFull().c_str(), bufferevent_getfd(upstream_evbuf_), (void*)this);
+            }
+            //evbuf.setTcpNoDelay();
+            int one = 1;
+            setsockopt(bufferevent_getfd(upstream_evbuf_), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            // A pooled socket may already hold bytes the backend sent first
+            // (e.g. a banner); those have to go out through the bufferevent.
+            const bool pending_input = evbuffer_get_length(bufferevent_get_input(upstream_evbuf_)) > 0;
+            // TLS records cannot be spliced, unless the kernel handles them
+            // (kTLS, in which case the session was dropped already)
+            bool splice = acceptor_->options().relay == relay_splice && !pending_input && !tls_;
+            if(proxy_header_len_) {
+               // The header precedes the client's bytes. The splice relay
+               // writes it to the socket, which has room right after the
+               // connect, and falls back to bufferevents if it did not fit.
+               ssize_t sent = 0;
+               if(splice) {
+                  sent = std::max<ssize_t>(0, send(bufferevent_getfd(upstream_evbuf_), proxy_header_,
+                                                   proxy_header_len_, MSG_NOSIGNAL));
+                  splice = (sent == proxy_header_len_);
+               }
+               evbuffer_add(bufferevent_get_output(upstream_evbuf_), proxy_header_ + sent, proxy_header_len_ - sent);
+               proxy_header_len_ = 0;
+            }
+            if(splice && start_splice())
+               return;
+            //set the call backs for downstream and upstream
+            // if (downstream_evbuf_.newForSocket(localhost_fd_, on_downstream_read, on_downstream_write,
+            //                                                 on_downstream_event, (void *)this, evbase_->base()))
+            // {
+            //    downstream_evbuf_.enable(EV_READ | EV_WRITE);
+            //    downstream_evbuf_.setTcpNoDelay();
+            //    downstream_evbuf_.setTcpKeepAlive();
+            //    downstream_evbuf_.own(false);
+            //    if(debug) {
+            //       std::cout << "Enabled downstream_evbuf ";
+            //       std::cout << "; downstream fd = " << downstream_evbuf_.getBufEventFd() << std::endl;
+            //    }
+            // }
+
+            if(tls_) {
+               // The handshake is done, so the session starts out open; it
+               // goes with the bufferevent, which frees it
+               downstream_evbuf_ = bufferevent_openssl_socket_new(evbase_, localhost_fd_, tls_, BUFFEREVENT_SSL_OPEN,
+                                                                  bev_options_);
+               if(downstream_evbuf_) {
+                  tls_ = NULL;
+                  // A client that closes without close_notify still ends its stream
+                  bufferevent_openssl_set_allow_dirty_shutdown(downstream_evbuf_, 1);
+               }
+            } else {
+               downstream_evbuf_ = bufferevent_socket_new(evbase_, localhost_fd_, bev_options_);
+            }
+            if (downstream_evbuf_ == NULL)
+            {
+               PROXY_LOG_ERROR("Failed to create libevent buffer event");
+               stop();
+               return;
+            }
+
+            bufferevent_setcb(downstream_evbuf_, on_downstream_read, on_downstream_write,
+                              on_downstream_event, (void *)this);
+            // The write callback (which resumes upstream reads) fires once
+            // the output has drained to the low watermark.
+            bufferevent_setwatermark(downstream_evbuf_, EV_WRITE,
+                                     acceptor_->options().downstream_watermarks.low, 0);
+            watch_output(downstream_evbuf_, 1);
+            //bufferevent_enable(downstream_evbuf_, EV_READ | EV_WRITE);
+            bufferevent_enable(downstream_evbuf_, EV_READ);
+            bufferevent_enable(downstream_evbuf_, EV_WRITE);
+            one = 1;
+            setsockopt(bufferevent_getfd(downstream_evbuf_), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            setsockopt(bufferevent_getfd(downstream_evbuf_), SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+            PROXY_LOG_TRACE("Enabled downstream_evbuf; downstream fd = %d", bufferevent_getfd(downstream_evbuf_));
+
+            // if (downstream_evbuf_.newForSocket(localhost_fd_, on_downstream_read, on_downstream_write,
+            //                                                 on_downstream_event, (void *)this, evbase_->base()))
+            // {
+            //    downstream_evbuf_.enable(EV_READ | EV_WRITE);
+            //    downstream_evbuf_.setTcpNoDelay();
+            //    downstream_evbuf_.setTcpKeepAlive();
+            //    downstream_evbuf_.own(false);
+            //    if(debug) {
+            //       std::cout << "Enabled downstream_evbuf ";
+            //       std::cout << "; downstream fd = " << downstream_evbuf_.getBufEventFd() << std::endl;
+            //    }
+            // }
+
+            // upstream_evbuf_.set_cb(on_upstream_read, on_upstream_write, on_upstream_event, (void*)this);
+            // upstream_evbuf_.enable(EV_READ);
+            // upstream_evbuf_.enable(EV_WRITE);
+            // upstream_evbuf_.setTcpNoDelay();
+            // upstream_evbuf_.setTcpKeepAlive();
+            // upstream_evbuf_.own(false);
+            bufferevent_setcb(upstream_evbuf_, on_upstream_read, on_upstream_write,
+                              on_upstream_event, (void *)this);
+            bufferevent_setwatermark(upstream_evbuf_, EV_WRITE,
+                                     acceptor_->options().upstream_watermarks.low, 0);
+            watch_output(upstream_evbuf_, 0);
+            // Bandwidth limits; spliced bridges bypass the bufferevents and are not limited
+            if(bev_options_ & BEV_OPT_THREADSAFE) {
+               downstream_rate_group_ = acceptor_->rates()->join_client(downstream_evbuf_, client_key_);
+               upstream_rate_group_ = acceptor_->rates()->join_upstream(upstream_evbuf_, upstream_index_);
+            }
+            //bufferevent_enable(upstream_evbuf_, EV_READ | EV_WRITE);
+            bufferevent_enable(upstream_evbuf_, EV_READ);
+            bufferevent_enable(upstream_evbuf_, EV_WRITE);
+            one = 1;
+            setsockopt(bufferevent_getfd(upstream_evbuf_), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            setsockopt(bufferevent_getfd(upstream_evbuf_), SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+            PROXY_LOG_TRACE("Enabled upstream_evbuf and reset its callbacks");
+            // Replaces the connect timeout
+            bufferevent_set_timeouts(downstream_evbuf_, acceptor_->timeouts_.idle_read, acceptor_->timeouts_.idle_write);
+            bufferevent_set_timeouts(upstream_evbuf_, acceptor_->timeouts_.idle_read, acceptor_->timeouts_.idle_write);
+            // Records read along with the end of the handshake are already
+            // decrypted and would wait for the socket to become readable again
+            SSL* ssl = bufferevent_openssl_get_ssl(downstream_evbuf_);
+            bool pending_output = false;
+            if(ssl && SSL_has_pending(ssl)) {
+               char buf[4096];
+               int n;
+               while((n = SSL_read(ssl, buf, sizeof(buf))) > 0)
+                  evbuffer_add(bufferevent_get_input(downstream_evbuf_), buf, n);
+               pending_output = evbuffer_get_length(bufferevent_get_input(downstream_evbuf_)) > 0;
+            }
+            if(pending_input)
+               on_upstream_read(upstream_evbuf_, this);
+            if(pending_output && downstream_evbuf_)
+               on_downstream_read(downstream_evbuf_, this);
          }
 
       static void on_upstream_event(struct bufferevent* bev, short events, void* cbarg)
          {
             //EvBufferEvent evbuf(bev);
-            sockaddr rem_sock, loc_sock;
-            socklen_t len = sizeof(struct sockaddr_in);
-            int ret = getpeername(bufferevent_getfd(bev), &rem_sock, &len);
-            std::cout << "upstream event for fd" << bufferevent_getfd(bev) << " ; events = " << events << std::endl;
-            if(ret == 0) {
-               ret = getsockname(bufferevent_getfd(bev), &loc_sock, &len);
-               if(ret == 0) {
-                  IpAddr remote_server(rem_sock);
-                  IpAddr local_server(loc_sock);
-                  auto bridge_inst_it = ssplice_pending_bridge_ptrs_.find(rem_sock);
-                  if(bridge_inst_it == ssplice_pending_bridge_ptrs_.end()) {
-                     std::cerr << "Could not find a bridge for upstream_server " << remote_server.toStringFull() << std::endl;
-                     exit(1);
-                  }
-
-                  ptr_type bridge_inst = bridge_inst_it->second;
-                  // bridge* b = static_cast<bridge *>(cbarg);
-                  // ptr_type bridge_inst = boost::shared_ptr<bridge>(b);
-                  ssplice_pending_bridge_ptrs_.erase(bridge_inst_it);
-                  if(debug)
-                     std::cout << __FUNCTION__ << ":ssplice_pending_bridge_ptrs.size() = " << ssplice_pending_bridge_ptrs_.size() << std::endl;
-                  if (events & BEV_EVENT_CONNECTED)
-                  {
-                     num_upstream_connections_++;
-                     std::cout << "US Conn. " << num_upstream_connections_ << " - Connected to upstream (" << local_server.toStringFull() << "<-->" << remote_server.toStringFull() << ")" << std::endl;
-                     if(debug)
-                        std::cout << "; upstream fd= " << bufferevent_getfd(bev) << "; bridge ptr: "<< bridge_inst.get() << std::endl;
-                     //evbuf.setTcpNoDelay();
-                     int one = 1;
-                     setsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
-                     //set the call backs for downstream and upstream
-                     // if (bridge_inst->downstream_evbuf_.newForSocket(bridge_inst->localhost_fd_, on_downstream_read, on_downstream_write,
-                     //                                                 on_downstream_event, (void *)bridge_inst.get(), bridge_inst->evbase_->base()))
-                     // {
-                     //    bridge_inst->downstream_evbuf_.enable(EV_READ | EV_WRITE);
-                     //    bridge_inst->downstream_evbuf_.setTcpNoDelay();
-                     //    bridge_inst->downstream_evbuf_.setTcpKeepAlive();
-                     //    bridge_inst->downstream_evbuf_.own(false);
-                     //    if(debug) {
-                     //       std::cout << "Enabled downstream_evbuf ";
-                     //       std::cout << "; downstream fd = " << bridge_inst->downstream_evbuf_.getBufEventFd() << std::endl;
-                     //    }
-                     // }
-
-                     bridge_inst->downstream_evbuf_ = bufferevent_socket_new(bridge_inst->evbase_, bridge_inst->localhost_fd_, BEV_OPT_CLOSE_ON_FREE);
-                     if (bridge_inst->downstream_evbuf_ == NULL)
-                     {
-                        std::cerr <<"Failed to create libevent buffer event" << std::endl;
-                        return;
-                     }
+            // The callback argument is the bridge that initiated the connect, so
+            // completion needs neither a lookup nor getpeername/getsockname.
+            // Holding a reference keeps the bridge alive should stop() run below.
+            ptr_type bridge_inst = static_cast<bridge *>(cbarg)->wbp_.lock();
+            if(!bridge_inst) {
+               PROXY_LOG_ERROR("Upstream event for a destroyed bridge; events = %d", events);
+               return;
+            }
+            PROXY_LOG_TRACE("Upstream event for fd %d; events = %d", bufferevent_getfd(bev), events);
+            if (events & BEV_EVENT_CONNECTED)
+            {
+               bridge_inst->on_upstream_connected();
+            } else if (events & BEV_EVENT_ERROR) {
+               PROXY_LOG_WARN("Upstream connection to %s failed: %s", bridge_inst->upstream_server_.toStringFull().c_str(),
+                              evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+               // Close the upstream connection
+               // evbuf.own(true);
+               // evbuf.free();
+               // bridge_inst->close_upstream();
+               // Close the downstream connection
+               // bridge_inst->downstream_evbuf_.own(true);
+               // bridge_inst->downstream_evbuf_.free();
+               // bridge_inst->close_downstream();
+               bridge_inst->count_failure();
+               bridge_inst->stop();
+            } else if (events & BEV_EVENT_TIMEOUT) {
+               // Close the upstream connection
+               // evbuf.own(true);
+               // evbuf.free();
+               // bridge_inst->close_upstream();
+               // Close the downstream connection
+               // bridge_inst->downstream_evbuf_.own(true);
+               // bridge_inst->downstream_evbuf_.free();
+               // bridge_inst->close_downstream();
+               if(bridge_inst->timed_out(events & BEV_EVENT_READING))
+                  bridge_inst->stop();
+               else
+                  bufferevent_enable(bev, EV_READ);
+            } else if (events & BEV_EVENT_EOF) {
+               PROXY_LOG_DEBUG("Upstream connection EOF");
+               bridge_inst->on_eof(1);
+            }
+         }
 
-                     bufferevent_setcb(bridge_inst->downstream_evbuf_, on_downstream_read, on_downstream_write,
-                                       on_downstream_event, (void *)bridge_inst.get());
-                     //bufferevent_enable(bridge_inst->downstream_evbuf_, EV_READ | EV_WRITE);
-                     bufferevent_enable(bridge_inst->downstream_evbuf_, EV_READ);
-                     bufferevent_enable(bridge_inst->downstream_evbuf_, EV_WRITE);
-                     one = 1;
-                     setsockopt(bufferevent_getfd(bridge_inst->downstream_evbuf_), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
-                     setsockopt(bufferevent_getfd(bridge_inst->downstream_evbuf_), SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
-                     if(debug) {
-                        std::cout << "Enabled downstream_evbuf ";
-                        std::cout << "; downstream fd = " << bufferevent_getfd(bridge_inst->downstream_evbuf_) << std::endl;
-                     }
+      upstream_metrics& upstream_stats()
+         {
+            return acceptor_->metrics_.upstreams[upstream_index_];
+         }
 
-                     // if (bridge_inst->downstream_evbuf_.newForSocket(bridge_inst->localhost_fd_, on_downstream_read, on_downstream_write,
-                     //                                                 on_downstream_event, (void *)bridge_inst.get(), bridge_inst->evbase_->base()))
-                     // {
-                     //    bridge_inst->downstream_evbuf_.enable(EV_READ | EV_WRITE);
-                     //    bridge_inst->downstream_evbuf_.setTcpNoDelay();
-                     //    bridge_inst->downstream_evbuf_.setTcpKeepAlive();
-                     //    bridge_inst->downstream_evbuf_.own(false);
-                     //    if(debug) {
-                     //       std::cout << "Enabled downstream_evbuf ";
-                     //       std::cout << "; downstream fd = " << bridge_inst->downstream_evbuf_.getBufEventFd() << std::endl;
-                     //    }
-                     // }
-
-                     // bridge_inst->upstream_evbuf_.set_cb(on_upstream_read, on_upstream_write, on_upstream_event, (void*)bridge_inst.get());
-                     // bridge_inst->upstream_evbuf_.enable(EV_READ);
-                     // bridge_inst->upstream_evbuf_.enable(EV_WRITE);
-                     // bridge_inst->upstream_evbuf_.setTcpNoDelay();
-                     // bridge_inst->upstream_evbuf_.setTcpKeepAlive();
-                     // bridge_inst->upstream_evbuf_.own(false);
-                     bufferevent_setcb(bridge_inst->upstream_evbuf_, on_upstream_read, on_upstream_write,
-                                       on_upstream_event, (void *)bridge_inst.get());
-                     //bufferevent_enable(bridge_inst->upstream_evbuf_, EV_READ | EV_WRITE);
-                     bufferevent_enable(bridge_inst->upstream_evbuf_, EV_READ);
-                     bufferevent_enable(bridge_inst->upstream_evbuf_, EV_WRITE);
-                     one = 1;
-                     setsockopt(bufferevent_getfd(bridge_inst->upstream_evbuf_), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
-                     setsockopt(bufferevent_getfd(bridge_inst->upstream_evbuf_), SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
-                     if(debug)
-                        std::cout << "Enabled upstream_evbuf and reset its callbacks" << std::endl;
-                  } else if (events & BEV_EVENT_ERROR) {
-                     std::cout << "Error: Upstream connection to " << bridge_inst->upstream_server_.toStringFull() << " failed" << std::endl;
-                     // Close the upstream connection
-                     // evbuf.own(true);
-                     // evbuf.free();
-                     // bridge_inst->close_upstream();
-                     // Close the downstream connection
-                     // bridge_inst->downstream_evbuf_.own(true);
-                     // bridge_inst->downstream_evbuf_.free();
-                     // bridge_inst->close_downstream();
-                     bridge_inst->stop();
-                  } else if (events & BEV_EVENT_TIMEOUT) {
-                     std::cerr << "Error: Upstream connection to " << bridge_inst->upstream_server_.toStringFull() << "TIMEDOUT" << std::endl;
-                     // Close the upstream connection
-                     // evbuf.own(true);
-                     // evbuf.free();
-                     // bridge_inst->close_upstream();
-                     // Close the downstream connection
-                     // bridge_inst->downstream_evbuf_.own(true);
-                     // bridge_inst->downstream_evbuf_.free();
-                     // bridge_inst->close_downstream();
-                     bridge_inst->stop();
-                  }
-               } else {
-                  std::cout << strerror(errno) << "events = " << events << std::endl;
+      // Whether a timeout closes the bridge. A write timeout before the
+      // upstream has connected is the connect timeout. A read timeout on one
+      // leg only makes the bridge idle if the other leg has read nothing
+      // since the last check either, since a one-way transfer keeps a leg
+      // quiet for as long as it runs.
+      bool timed_out(bool reading)
+         {
+            worker_metrics& m = acceptor_->metrics_;
+            if(!upstream_connected_) {
+               PROXY_LOG_WARN("Upstream connection to %s TIMEDOUT", upstream_server_.toStringFull().c_str());
+               m.timeouts_connect.add();
+            } else if(reading) {
+               const int64_t total = upstream_bytes_read_ + downstream_bytes_read_;
+               if(total != idle_mark_) {
+                  idle_mark_ = total;
+                  return false;
                }
+               PROXY_LOG_DEBUG("Bridge %p idle, closing", (void*)this);
+               m.timeouts_idle_read.add();
             } else {
-               std::cout << strerror(errno) << "events = " << events << std::endl;
+               PROXY_LOG_WARN("Bridge %p: a peer stopped taking data, closing", (void*)this);
+               m.timeouts_idle_write.add();
             }
+            count_failure();
+            return true;
+         }
+
+      static void on_lifetime(evutil_socket_t fd, short what, void* arg)
+         {
+            bridge* bridge_inst = static_cast<bridge*>(arg);
+            PROXY_LOG_DEBUG("Bridge %p reached its maximum lifetime, closing", arg);
+            bridge_inst->acceptor_->metrics_.timeouts_lifetime.add();
+            bridge_inst->count_failure();
+            bridge_inst->stop();
+         }
+
+      void count_downstream_read(size_t n)
+         {
+            if(downstream_bytes_read_ == 0 && n > 0)
+               upstream_stats().first_byte_sent_usec.record(monotonic_usec() - accept_usec_);
+            downstream_bytes_read_ += n;
+            upstream_stats().bytes_sent.add(n);
+         }
+
+      void count_upstream_read(size_t n)
+         {
+            if(upstream_bytes_read_ == 0 && n > 0)
+               upstream_stats().first_byte_received_usec.record(monotonic_usec() - accept_usec_);
+            upstream_bytes_read_ += n;
+            upstream_stats().bytes_received.add(n);
+         }
+
+      // An error or timeout on an upstream that never connected is also a
+      // connect error for that upstream
+      void count_failure()
+         {
+            if(!upstream_connected_ && upstream_index_ != no_upstream)
+               upstream_stats().connect_errors.add();
+            acceptor_->metrics_.failed.add();
          }
 
       void stop() {
+         if(lifetime_ev_) {
+            event_free(lifetime_ev_);
+            lifetime_ev_ = NULL;
+         }
+         if(linger_ev_) {
+            event_free(linger_ev_);
+            linger_ev_ = NULL;
+         }
+         stop_splice();
          close_upstream();
          close_downstream();
-         // Unref the current bridge instance from global list of bridge instances
-         for(auto it = tcp_proxy::bridge::acceptor::bridge_instances_.begin() ;
-             it < tcp_proxy::bridge::acceptor::bridge_instances_.end(); it++) {
-            // found nth element..print and break.
-            if((*it).get() == this) {
-               std::cout << "Unrefing bridge @ " << this << "from global bridge instance list "<< std::endl;
-               tcp_proxy::bridge::acceptor::bridge_instances_.erase(it);
-               break;
-            }
+         if(upstream_index_ != no_upstream) {
+            upstream_stats().duration_usec.record(monotonic_usec() - accept_usec_);
+            acceptor_->balancer_.release(upstream_index_);
+            upstream_index_ = no_upstream;
          }
+         // Unref the current bridge instance from the worker's registry. This
+         // may destroy the bridge, so it has to be the last thing stop() does.
+         PROXY_LOG_TRACE("Unrefing bridge @ %p from worker bridge instance list", (void*)this);
+         acceptor_->bridge_instances_.erase(registry_handle_);
       }
 
       void start()
          {
             ptr_type p = wbp_.lock();
             if(!p) {
-               std::cerr << "Error: Could not instantiate shared ptr for bridge" << std::endl;
+               PROXY_LOG_ERROR("Could not instantiate shared ptr for bridge");
                stop();
             } else {
-               ssplice_pending_bridge_ptrs_.insert(std::pair<IpAddr, ptr_type> (upstream_server_, p));
-               if(debug)
-                  std::cout << __FUNCTION__ << ":ssplice_pending_bridge_ptrs.size() = " << ssplice_pending_bridge_ptrs_.size() << std::endl;
-               upstream_evbuf_ = bufferevent_socket_new(evbase_, -1, BEV_OPT_CLOSE_ON_FREE);
+               if(acceptor_->timeouts_.lifetime) {
+                  lifetime_ev_ = evtimer_new(evbase_, on_lifetime, this);
+                  evtimer_add(lifetime_ev_, acceptor_->timeouts_.lifetime);
+               }
+               connect_start_usec_ = monotonic_usec();
+               // A warm pooled connection skips the connect round trip entirely,
+               // unless the pool's are not locked and this bridge needs them to be
+               upstream_pool* pool = acceptor_->pools_.empty() ? NULL : acceptor_->pools_[upstream_index_].get();
+               if(pool && (bev_options_ & ~pool->bev_options()))
+                  pool = NULL;
+               upstream_evbuf_ = pool ? pool->acquire() : NULL;
+               if(upstream_evbuf_) {
+                  PROXY_LOG_TRACE("Took pooled upstream_evbuf_ (%p) for connection %s<->%s; bridge ptr = %p", (void*)upstream_evbuf_,
+                                  localhost_address_.toStringFull().c_str(), upstream_server_.toStringFull().c_str(), (void*)this);
+                  bufferevent_setcb(upstream_evbuf_, on_upstream_read, on_upstream_write,
+                                    on_upstream_event, (void*)this);
+                  on_upstream_connected();
+                  return;
+               }
+               if(acceptor_->options().tcp.fastopen_connect) {
+                  start_fastopen();
+                  return;
+               }
+               // The pending connect is tracked by the bufferevent itself: its
+               // callback argument is this bridge.
+               upstream_evbuf_ = bufferevent_socket_new(evbase_, -1, bev_options_);
                if (upstream_evbuf_ == NULL)
                {
-                  std::cerr <<"Failed to create libevent buffer event" << std::endl;
+                  PROXY_LOG_ERROR("Failed to create libevent buffer event");
+                  stop();
                   return;
                }
 
@@ -357,12 +1394,10 @@ namespace tcp_proxy
                //bufferevent_disable(upstream_evbuf_, EV_READ | EV_WRITE);
                bufferevent_disable(upstream_evbuf_, EV_READ);
                bufferevent_disable(upstream_evbuf_, EV_READ);
-               if(debug) {
-                  //std::cout << "Created upstream_eventbuf_ (evlistener = )" << upstream_evbuf_.get_mPtr() << ") ";
-                  std::cout << "Created upstream_eventbuf_ (evlistener = )" << upstream_evbuf_ << ") ";
-                  std::cout << "for connection " << localhost_address_.toStringFull() << "<->"<< upstream_server_.toStringFull();
-                  std::cout << "; bridge ptr= " << this << std::endl;
-               }
+               // The connect waits for writability, so the write timeout bounds it
+               bufferevent_set_timeouts(upstream_evbuf_, NULL, acceptor_->timeouts_.connect);
+               PROXY_LOG_TRACE("Created upstream_eventbuf_ (%p) for connection %s<->%s; bridge ptr = %p", (void*)upstream_evbuf_,
+                               localhost_address_.toStringFull().c_str(), upstream_server_.toStringFull().c_str(), (void*)this);
                // if (upstream_evbuf_.newForSocket(-1, on_upstream_read, on_upstream_write,
                //                                  on_upstream_event, (void*)this, evbase_->base()))
                // {
@@ -379,16 +1414,70 @@ namespace tcp_proxy
                // if (!upstream_evbuf_.connect(upstream_server_))
                if (bufferevent_socket_connect(upstream_evbuf_, (sockaddr*)upstream_server_.addr(), upstream_server_.addrLen()) != 0)
                {
-                  std::cerr << "Error: Client failed to connect to " << upstream_server_.toStringFull() << std::endl;
+                  PROXY_LOG_WARN("Client failed to connect to %s", upstream_server_.toStringFull().c_str());
+                  count_failure();
+                  stop();
                } else {
-                  if(debug)
-                     std::cout << "Inititated connection " << localhost_address_.toStringFull() << "<->"<< upstream_server_.toStringFull() << std::endl;
+                  PROXY_LOG_DEBUG("Initiated connection %s<->%s", localhost_address_.toStringFull().c_str(), upstream_server_.toStringFull().c_str());
                }
             }
          }
 
    private:
+      // With TCP_FASTOPEN_CONNECT, connect() returns at once and the SYN
+      // leaves with the first client bytes, so the bridge is wired up
+      // straight away as with a pooled socket. (libevent would report that
+      // immediate success as a write event, not as a connect.) A refused
+      // connect then shows up as an error on the first write or read.
+      void start_fastopen()
+         {
+            evutil_socket_t fd = socket(upstream_server_.addr()->sa_family, SOCK_STREAM, 0);
+            if(fd < 0) {
+               PROXY_LOG_ERROR("Could not create upstream socket: %s", strerror(errno));
+               count_failure();
+               stop();
+               return;
+            }
+            evutil_make_socket_nonblocking(fd);
+            acceptor_->options().tcp.apply_upstream(fd);
+            const int r = connect(fd, upstream_server_.addr(), upstream_server_.addrLen());
+            if(r != 0 && errno != EINPROGRESS) {
+               PROXY_LOG_WARN("Client failed to connect to %s: %s", upstream_server_.toStringFull().c_str(), strerror(errno));
+               evutil_closesocket(fd);
+               count_failure();
+               stop();
+               return;
+            }
+            upstream_evbuf_ = bufferevent_socket_new(evbase_, fd, bev_options_);
+            if(upstream_evbuf_ == NULL) {
+               PROXY_LOG_ERROR("Failed to create libevent buffer event");
+               evutil_closesocket(fd);
+               stop();
+               return;
+            }
+            bufferevent_setcb(upstream_evbuf_, on_upstream_read, on_upstream_write,
+                              on_upstream_event, (void*)this);
+            if(r == 0) {
+               PROXY_LOG_TRACE("Fast open connect to %s; bridge ptr = %p", upstream_server_.toStringFull().c_str(), (void*)this);
+               on_upstream_connected();
+               return;
+            }
+            // Client fast open is off in the kernel: a normal handshake is
+            // under way, which libevent can wait for
+            bufferevent_disable(upstream_evbuf_, EV_READ);
+            bufferevent_set_timeouts(upstream_evbuf_, NULL, acceptor_->timeouts_.connect);
+            if(bufferevent_socket_connect(upstream_evbuf_, NULL, 0) != 0) {
+               PROXY_LOG_WARN("Client failed to connect to %s", upstream_server_.toStringFull().c_str());
+               count_failure();
+               stop();
+            }
+         }
+
+      acceptor* acceptor_;
       IpAddr upstream_server_;
+      // Backend chosen by the acceptor's balancer; released once in stop()
+      size_t upstream_index_;
+      static const size_t no_upstream = ~size_t(0);
       IpAddr localhost_address_;
       //EvBaseLoop* evbase_;
       struct event_base* evbase_;
@@ -398,40 +1487,234 @@ namespace tcp_proxy
       struct evconnlistener* evlis_;
       evutil_socket_t localhost_fd_;
       int64_t upstream_bytes_read_, downstream_bytes_read_;
+      bool upstream_connected_;
+      // Lifecycle timestamps (monotonic_usec) feeding the upstream's histograms
+      uint64_t accept_usec_;
+      uint64_t connect_start_usec_;
+      struct event* lifetime_ev_;
+      // Runs from the first half-close until both directions have finished
+      struct event* linger_ev_;
+      // Bytes read by both legs as of the last read timeout
+      int64_t idle_mark_;
+      // Budget accounting of the output buffers, and which directions the
+      // budget has paused; indexed like splice_
+      struct evbuffer_cb_entry* output_cb_[2];
+      bool budget_blocked_[2];
+      // The options of both legs' bufferevents, and the rate-limit group
+      // each leg is in, NULL if none; only locked legs join groups
+      int bev_options_;
+      rate_group* downstream_rate_group_;
+      rate_group* upstream_rate_group_;
+      // Per direction, indexed like splice_: the source has sent EOF, and
+      // the EOF has been passed on to the destination
+      bool eof_[2];
+      bool finished_[2];
+   public:
+      // The client's address, which keys its rate-limit group
+      std::string client_key_;
+      // The PROXY protocol header, sent to the upstream ahead of any data
+      char proxy_header_[proxy_header_max];
+      uint8_t proxy_header_len_;
+      // The client's TLS session once its handshake is done, until the
+      // downstream bufferevent takes it over; NULL for plain TCP
+      SSL* tls_;
+   private:
+      // [0] moves downstream -> upstream, [1] upstream -> downstream
+      splice_pipe splice_[2];
+      static const size_t splice_chunk_size = 65536;
+      static const int splice_max_rounds = 16;
    public:
 
       class acceptor
       {
       public:
-         static std::vector<ptr_type> bridge_instances_;
-         acceptor(struct event_base* evbase, const std::string& local_host, unsigned short local_port,
-                  const std::string& upstream_host, unsigned short upstream_port)
-            : evbase_(evbase), upstream_server_(upstream_host.c_str(), upstream_port),
-              localhost_address_(local_host.c_str(), local_port), listener_(NULL)
-            {}
+         // Bookkeeping is per acceptor, and every worker thread owns its own
+         // acceptor, so none of this is shared between event loops.
+         // Bridges and their reference counts share one block from this
+         // pool. Declared first so it outlives every bridge of the acceptor.
+         block_pool bridge_pool_;
+         registry_type bridge_instances_;
+         worker_metrics metrics_;
+         // This worker's share of the --memory-budget
+         budget_lease lease_;
+         upstream_balancer balancer_;
+         // One warm pool per backend, indexed like the balancer; empty when pooling is off
+         std::vector<boost::shared_ptr<upstream_pool> > pools_;
+         // The --*-timeout limits as libevent common timeouts, NULL when
+         // off. Every bridge waits equally long, so libevent keeps each in
+         // a queue ordered by deadline rather than in the timer heap, and
+         // arming or refreshing one is O(1).
+         struct
+         {
+            const struct timeval* connect;
+            const struct timeval* idle_read;
+            const struct timeval* idle_write;
+            const struct timeval* lifetime;
+            const struct timeval* linger;
+            const struct timeval* preamble;   // never NULL
+         } timeouts_;
+
+         acceptor(struct event_base* evbase, const proxy_options& options,
+                  const std::string& local_host, unsigned short local_port, const upstream_health* health,
+                  int cpu, memory_budget* budget, rate_group_set* rates, const tls_server_context* tls)
+            : metrics_(options.upstreams.size()),
+              lease_(budget, metrics_.buffered_bytes),
+              balancer_(options.upstreams, options.balance, health),
+              options_(options), evbase_(evbase),
+              localhost_address_(local_host.c_str(), local_port), listener_(NULL), cpu_(cpu), rates_(rates)
+            {
+               budget_ev_ = evtimer_new(evbase_, on_budget_check, this);
+               timeouts_.connect = common_timeout(options.timeouts.connect_ms);
+               timeouts_.idle_read = common_timeout(options.timeouts.idle_read_ms);
+               timeouts_.idle_write = common_timeout(options.timeouts.idle_write_ms);
+               timeouts_.lifetime = common_timeout(options.timeouts.lifetime_ms);
+               timeouts_.linger = common_timeout(options.timeouts.linger_ms);
+               timeouts_.preamble = common_timeout(options.timeouts.connect_ms ? options.timeouts.connect_ms
+                                                   : preamble_timeout_ms);
+               if(options.send_proxy != proxy_protocol_off)
+                  proxy_writer_.reset(new proxy_header_writer(options.send_proxy, localhost_address_.addr()));
+               tls_ = tls;
+               if(options.pool_size) {
+                  for(size_t i = 0; i < balancer_.size(); ++i)
+                     pools_.push_back(boost::shared_ptr<upstream_pool>(
+                                         new upstream_pool(evbase, balancer_.address(i), options.pool_size,
+                                                           options.pool_max_idle_ms, bev_options())));
+               }
+            }
 
          ~acceptor()
             {
-               if(debug)
-                  std::cout << "In acceptor destructor " << std::endl;
+               PROXY_LOG_TRACE("In acceptor destructor");
+               while(!bridge_instances_.empty()) {
+                  ptr_type p = bridge_instances_.back();
+                  p->stop();
+               }
+               for(size_t i = 0; i < pools_.size(); ++i) {
+                  const upstream_pool::stats& st = pools_[i]->get_stats();
+                  PROXY_LOG_INFO("Upstream pool %s: %llu hits, %llu misses, %llu refills (avg %llu us, max %llu us), "
+                                 "%llu refill failures, %llu evictions", balancer_.address(i).toStringFull().c_str(),
+                                 (unsigned long long)st.hits, (unsigned long long)st.misses, (unsigned long long)st.refills,
+                                 (unsigned long long)(st.refills ? st.refill_usec_total / st.refills : 0),
+                                 (unsigned long long)st.refill_usec_max,
+                                 (unsigned long long)st.refill_failures, (unsigned long long)st.evictions);
+               }
+               if(listener_)
+                  evconnlistener_free(listener_);
+               event_free(budget_ev_);
+               for(std::set<preamble*>::iterator it = preambles_.begin(); it != preambles_.end(); ++it) {
+                  event_free((*it)->ev);
+                  if((*it)->ssl)
+                     SSL_free((*it)->ssl);
+                  evutil_closesocket((*it)->fd);
+                  delete *it;
+               }
+            }
+
+         const proxy_options& options() const
+            {
+               return options_;
             }
+
+         // Binds a listener of its own, or serves `inherited` when it is not -1
+         bool listen(evutil_socket_t inherited = -1)
+            {
+               if(inherited >= 0) {
+                  // Already listening: a backlog of 0 leaves it as it is
+                  evutil_make_socket_nonblocking(inherited);
+                  listener_ = evconnlistener_new(evbase_, onAccept, this, LEV_OPT_CLOSE_ON_FREE, 0, inherited);
+               } else {
+                  // SO_REUSEPORT lets every worker bind its own listener to the same
+                  // address; the kernel then spreads incoming connections across them.
+                  listener_ = evconnlistener_new_bind(evbase_, onAccept, this,
+                                                      LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT, -1,
+                                                      localhost_address_.addr(), localhost_address_.addrLen());
+               }
+               if(!listener_) {
+                  PROXY_LOG_ERROR("Could not listen on %s: %s", localhost_address_.toStringFull().c_str(),
+                                  evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+                  return false;
+               }
+               options_.tcp.apply_listener(evconnlistener_get_fd(listener_));
+               if(cpu_ >= 0 && options_.affinity.steering == steer_incoming_cpu)
+                  set_incoming_cpu(evconnlistener_get_fd(listener_), cpu_);
+               return true;
+            }
+
+         evutil_socket_t listen_fd() const
+            {
+               return listener_ ? evconnlistener_get_fd(listener_) : -1;
+            }
+
+         // The options of a new bridge's bufferevents: a leg that joins a
+         // rate-limit group is shared with the thread running the group's
+         // refills, so it has to be locked
+         int bev_options() const
+            {
+               return BEV_OPT_CLOSE_ON_FREE | (rates_ && rates_->grouped() ? BEV_OPT_THREADSAFE : 0);
+            }
+
+         // The bandwidth limits of the route, shared by every worker
+         rate_group_set* rates() const
+            {
+               return rates_;
+            }
+
+         // Counts n relayed bytes against the global limit; false once it is
+         // used up, when the bridge should stop reading
+         bool charge_global(size_t n)
+            {
+               return !rates_ || rates_->global().take(n);
+            }
+
+         // Called by a bridge that stopped reading direction d for the
+         // budget or, when `throttled`, the global rate limit
+         void block(registry_type::handle_type h, unsigned int d, bool throttled)
+            {
+               if(lease_.over())
+                  metrics_.budget_pauses.add();
+               const blocked_read b = { h, d, throttled };
+               budget_blocked_.push_back(b);
+               if(!evtimer_pending(budget_ev_, NULL)) {
+                  struct timeval tv = { 0, budget_check_ms * 1000 };
+                  evtimer_add(budget_ev_, &tv);
+               }
+            }
+
+         // Stops accepting and lets the bridges finish; the worker's loop
+         // exits once every acceptor on it is idle. Runs on that loop.
+         void drain()
+            {
+               if(listener_) {
+                  evconnlistener_free(listener_);
+                  listener_ = NULL;
+               }
+               PROXY_LOG_INFO("Stopped accepting on %s, draining %zu bridge(s)",
+                              localhost_address_.toStringFull().c_str(), bridge_instances_.size());
+            }
+
+         // Connections still sending their preamble count too: they would
+         // be reset if the loop exited under them
+         bool idle() const
+            {
+               return bridge_instances_.empty() && preambles_.empty();
+            }
+
+         // Gets ready to accept; the worker then runs the loop, which
+         // serves every acceptor on it
          bool accept_connections()
             {
                try
                {
-                  std::cout << "Waiting to accept connections" << std::endl << std::endl;
+                  PROXY_LOG_INFO("Waiting to accept connections on %s", localhost_address_.toStringFull().c_str());
                   // listener_.newListener(localhost_address_, onAccept,
                   //                       (void *)this, evbase_->base());
-                  listener_ = evconnlistener_new_bind(evbase_, onAccept, this, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
-                                                      localhost_address_.addr(), localhost_address_.addrLen());
-                  if(!listener_) {
-                     std::cerr << "acceptor exception: " << std::endl;
+                  if(!listener_ && !listen()) {
                      return false;
                   }
-                  //evbase_->loop();
-                  event_base_loop(evbase_, 0);
+                  for(size_t i = 0; i < pools_.size(); ++i)
+                     pools_[i]->refill();
                } catch(std::exception& e) {
-                  std::cerr << "acceptor exception: " << e.what() << std::endl;
+                  PROXY_LOG_ERROR("acceptor exception: %s", e.what());
                   return false;
                }
                return true;
@@ -450,62 +1733,729 @@ namespace tcp_proxy
                //    std::cout << "Accepted connection: " << rem_ep.toStringFull() << "<-->" << loc_ep.toStringFull() << " ";
                // }
                acceptor *acceptor_inst = static_cast<acceptor *>(cbarg);
-               ptr_type p = boost::shared_ptr<bridge>(new bridge(acceptor_inst->evbase_, listener, listener_fd,
-                                                                 acceptor_inst->localhost_address_,
-                                                                 acceptor_inst->upstream_server_));
+               if(acceptor_inst->cpu_ >= 0) {
+                  worker_metrics& m = acceptor_inst->metrics_;
+                  (incoming_cpu(listener_fd) == acceptor_inst->cpu_ ? m.flows_local : m.flows_remote).add();
+               }
+               if(acceptor_inst->options_.accept_proxy || !acceptor_inst->options_.sni_routes.empty() ||
+                  acceptor_inst->tls_) {
+                  preamble pre;
+                  pre.owner = acceptor_inst;
+                  pre.listener = listener;
+                  pre.fd = listener_fd;
+                  memcpy(&pre.peer, address, std::min<size_t>(socklen, sizeof(pre.peer)));
+                  pre.stage = acceptor_inst->options_.accept_proxy ? preamble_proxy : preamble_sni;
+                  pre.proxied = false;
+                  pre.route = -1;
+                  pre.ssl = NULL;
+                  pre.ev = NULL;
+                  // With deferred accept the first bytes are usually there already
+                  if(!acceptor_inst->read_preamble(pre))
+                     acceptor_inst->wait_for_preamble(pre);
+                  return;
+               }
+               acceptor_inst->start_bridge(listener, listener_fd, address, NULL, -1, NULL);
+            }
+      private:
+         // `client` is where the connection comes from and `local` where it
+         // arrived, NULL for this socket's own address. `route` is the
+         // backend chosen by SNI, -1 to balance; `ssl` the client's TLS
+         // session, which the bridge takes over.
+         void start_bridge(struct evconnlistener* listener, evutil_socket_t fd, const struct sockaddr* client,
+                           const struct sockaddr* local, long route, SSL* ssl)
+            {
+               const size_t upstream_index = route < 0 ? balancer_.acquire(client) : balancer_.acquire_at(route);
+               if(upstream_index == upstream_balancer::none) {
+                  PROXY_LOG_WARN("No backend for the connection from %s, which matched no SNI route; closing",
+                                 IpAddr(*client).toStringFull().c_str());
+                  metrics_.failed.add();
+                  if(ssl)
+                     SSL_free(ssl);
+                  evutil_closesocket(fd);
+                  return;
+               }
+               // ptr_type p = boost::shared_ptr<bridge>(new bridge(...));
+               ptr_type p = boost::allocate_shared<bridge>(pool_allocator<bridge>(&bridge_pool_),
+                                                           this, evbase_, listener, fd,
+                                                           localhost_address_,
+                                                           balancer_.address(upstream_index),
+                                                           upstream_index);
                p->wbp_ = p;
-               bridge_instances_.push_back(p);
-               if(debug)
-                  std::cout << " ; loc fd = " << listener_fd << "; bridge ptr = " << p.get() << std::endl;
+               p->client_key_ = client_key(client);
+               p->tls_ = ssl;
+               if(proxy_writer_) {
+                  struct sockaddr_storage own;
+                  socklen_t own_len = sizeof(own);
+                  if(!local && proxy_writer_->needs_destination() &&
+                     getsockname(fd, reinterpret_cast<struct sockaddr*>(&own), &own_len) == 0)
+                     local = reinterpret_cast<struct sockaddr*>(&own);
+                  p->proxy_header_len_ = static_cast<uint8_t>(proxy_writer_->write(client, local, p->proxy_header_));
+               }
+               p->registry_handle_ = bridge_instances_.insert(p);
+               PROXY_LOG_TRACE("Accepted loc fd = %d; bridge ptr = %p", fd, (void*)p.get());
                p->start();
             }
-      private:
+
+         // What a connection goes through before the bridge can start: a
+         // PROXY header (--accept-proxy), the server name in its ClientHello
+         // (--sni-route) and the TLS handshake (--tls-cert). The ClientHello
+         // is only peeked at; the header and the handshake are consumed.
+         enum preamble_stage
+         {
+            preamble_proxy,
+            preamble_sni,
+            preamble_tls
+         };
+
+         struct preamble
+         {
+            acceptor* owner;
+            struct evconnlistener* listener;
+            evutil_socket_t fd;
+            struct sockaddr_storage peer;
+            // The addresses a PROXY header named, when `proxied`
+            struct sockaddr_storage src, dst;
+            preamble_stage stage;
+            bool proxied;
+            long route;
+            SSL* ssl;
+            struct event* ev;
+         };
+
+         // Takes in what has arrived and starts the bridge once everything
+         // is there. Returns false while more bytes are needed; true once the
+         // connection is either bridged or closed.
+         bool read_preamble(preamble& pre)
+            {
+               const struct sockaddr* peer = reinterpret_cast<const struct sockaddr*>(&pre.peer);
+               if(pre.stage == preamble_proxy) {
+                  char buf[proxy_header_accept_max];
+                  const ssize_t n = recv(pre.fd, buf, sizeof(buf), MSG_PEEK);
+                  if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                     return false;
+                  size_t consumed = 0;
+                  const proxy_parse_result r = n > 0 ? parse_proxy_header(buf, n, pre.src, pre.dst, consumed) :
+                                                       proxy_parse_invalid;
+                  if(r == proxy_parse_incomplete)
+                     return false;
+                  // The header itself is dropped, only the client's bytes are relayed
+                  if(r == proxy_parse_invalid || recv(pre.fd, buf, consumed, 0) != ssize_t(consumed)) {
+                     PROXY_LOG_WARN("Connection from %s did not start with a valid PROXY header, closing",
+                                    IpAddr(*peer).toStringFull().c_str());
+                     metrics_.proxy_header_errors.add();
+                     evutil_closesocket(pre.fd);
+                     return true;
+                  }
+                  // LOCAL (e.g. the balancer's health checks) and UNKNOWN headers
+                  // leave the connection's own addresses in place
+                  pre.proxied = pre.src.ss_family != AF_UNSPEC;
+                  pre.stage = preamble_sni;
+               }
+               if(pre.stage == preamble_sni) {
+                  if(!options_.sni_routes.empty()) {
+                     // The ClientHello stays in the socket and reaches the
+                     // backend (or the handshake below) untouched
+                     char buf[tls_record_max];
+                     const ssize_t n = recv(pre.fd, buf, sizeof(buf), MSG_PEEK);
+                     if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                        return false;
+                     const char* name = NULL;
+                     size_t name_len = 0;
+                     const sni_parse_result r = n > 0 ? parse_client_hello_sni(buf, n, name, name_len) : sni_incomplete;
+                     if(r == sni_incomplete) {
+                        if(n > 0)
+                           return false;
+                        PROXY_LOG_DEBUG("Connection from %s closed before its ClientHello", IpAddr(*peer).toStringFull().c_str());
+                        metrics_.sni_incomplete.add();
+                        evutil_closesocket(pre.fd);
+                        return true;
+                     }
+                     if(r == sni_found)
+                        pre.route = options_.sni_routes.route(name, name_len, sni_scratch_);
+                     (pre.route < 0 ? metrics_.sni_default : metrics_.sni_matched).add();
+                  }
+                  pre.stage = preamble_tls;
+               }
+               if(tls_) {
+                  if(!pre.ssl && !(pre.ssl = tls_->accept(pre.fd))) {
+                     PROXY_LOG_ERROR("Could not create a TLS session");
+                     evutil_closesocket(pre.fd);
+                     return true;
+                  }
+                  const tls_handshake_result r = tls_server_context::handshake(pre.ssl);
+                  if(r == tls_handshake_pending)
+                     return false;
+                  if(r == tls_handshake_failed) {
+                     PROXY_LOG_DEBUG("TLS handshake with %s failed: %s", IpAddr(*peer).toStringFull().c_str(),
+                                     ERR_reason_error_string(ERR_peek_error()));
+                     metrics_.tls_failed.add();
+                     SSL_free(pre.ssl);
+                     evutil_closesocket(pre.fd);
+                     return true;
+                  }
+                  (SSL_session_reused(pre.ssl) ? metrics_.tls_resumed : metrics_.tls_full).add();
+                  // With kTLS both ways the socket reads and writes plaintext,
+                  // so the bridge relays it like plain TCP, splice included
+                  if(tls_->kernel_offloaded(pre.ssl)) {
+                     metrics_.tls_ktls.add();
+                     SSL_free(pre.ssl);
+                     pre.ssl = NULL;
+                  }
+               }
+               if(pre.proxied)
+                  start_bridge(pre.listener, pre.fd, reinterpret_cast<struct sockaddr*>(&pre.src),
+                               reinterpret_cast<struct sockaddr*>(&pre.dst), pre.route, pre.ssl);
+               else
+                  start_bridge(pre.listener, pre.fd, peer, NULL, pre.route, pre.ssl);
+               return true;
+            }
+
+         // Waits for the rest, for as long as an upstream connect may take
+         // or preamble_timeout_ms when that is unbounded: a client that
+         // never finishes would otherwise hold its socket for good.
+         // Edge-triggered, since the bytes peeked at stay readable; a
+         // handshake may also wait for room to write.
+         void wait_for_preamble(const preamble& pre)
+            {
+               preamble* w = new preamble(pre);
+               w->ev = event_new(evbase_, w->fd, EV_READ | (tls_ ? EV_WRITE : 0) | EV_PERSIST | EV_ET, on_preamble, w);
+               event_add(w->ev, timeouts_.preamble);
+               preambles_.insert(w);
+            }
+
+         static void on_preamble(evutil_socket_t fd, short what, void* arg)
+            {
+               static const char* const waiting_for[] = { "PROXY header", "ClientHello", "TLS handshake" };
+               preamble* w = static_cast<preamble*>(arg);
+               acceptor* self = w->owner;
+               if(what & EV_TIMEOUT) {
+                  PROXY_LOG_WARN("No %s from %s in time, closing", waiting_for[w->stage],
+                                 IpAddr(*reinterpret_cast<const struct sockaddr*>(&w->peer)).toStringFull().c_str());
+                  worker_metrics& m = self->metrics_;
+                  (w->stage == preamble_proxy ? m.proxy_header_errors :
+                   w->stage == preamble_sni ? m.sni_incomplete : m.tls_failed).add();
+                  if(w->ssl)
+                     SSL_free(w->ssl);
+                  evutil_closesocket(fd);
+               } else if(!self->read_preamble(*w)) {
+                  return;
+               }
+               event_free(w->ev);
+               self->preambles_.erase(w);
+               delete w;
+            }
+
+         const struct timeval* common_timeout(unsigned int ms) const
+            {
+               if(!ms)
+                  return NULL;
+               struct timeval tv = { static_cast<time_t>(ms / 1000), static_cast<suseconds_t>((ms % 1000) * 1000) };
+               return event_base_init_common_timeout(evbase_, &tv);
+            }
+
+         // The budget and the global bucket are shared with the other
+         // workers, whose writes and reads change them without telling us,
+         // so blocked bridges poll for room. Bridges closed in the meantime
+         // are no longer in the registry.
+         static void on_budget_check(evutil_socket_t fd, short what, void* arg)
+            {
+               acceptor* self = static_cast<acceptor*>(arg);
+               const bool throttled = self->rates_ && self->rates_->global().empty();
+               if(throttled) {
+                  // Bridges waiting only on the budget are not rate limited
+                  uint64_t n = 0;
+                  for(size_t i = 0; i < self->budget_blocked_.size(); ++i)
+                     n += self->budget_blocked_[i].throttled;
+                  self->rates_->add_throttled(tier_global, n * budget_check_ms * 1000);
+               }
+               if(throttled || !self->lease_.can_resume()) {
+                  struct timeval tv = { 0, budget_check_ms * 1000 };
+                  evtimer_add(self->budget_ev_, &tv);
+                  return;
+               }
+               std::vector<blocked_read> blocked;
+               blocked.swap(self->budget_blocked_);
+               for(size_t i = 0; i < blocked.size(); ++i) {
+                  ptr_type* p = self->bridge_instances_.find(blocked[i].handle);
+                  if(p)
+                     (*p)->unblock_reading(blocked[i].direction);
+               }
+            }
+
+         static const int budget_check_ms = 10;
+         static const unsigned int preamble_timeout_ms = 10000;
          //ptr_type bridge_session_;
          //EvBaseLoop* evbase_;
+         const proxy_options& options_;
          struct event_base* evbase_;
-         IpAddr upstream_server_;
          IpAddr localhost_address_;
          //EvConnListener listener_;
          struct evconnlistener* listener_;
+         // Bridges paused by the memory budget or the global rate limit, and
+         // the timer that resumes them
+         struct blocked_read
+         {
+            registry_type::handle_type handle;
+            unsigned int direction;
+            bool throttled;   // by the rate limit, not (only) the budget
+         };
+         std::vector<blocked_read> budget_blocked_;
+         struct event* budget_ev_;
+         // The CPU this acceptor's worker is pinned to, -1 if it is not
+         int cpu_;
+         // The groups and bucket enforcing the route's bandwidth limits,
+         // shared with the other workers; NULL when there are none
+         rate_group_set* rates_;
+         // Writes the PROXY headers for upstreams; NULL when not sending any
+         boost::scoped_ptr<proxy_header_writer> proxy_writer_;
+         // Connections still sending their PROXY header or ClientHello
+         std::set<preamble*> preambles_;
+         std::string sni_scratch_;
+         // Terminates TLS on accepted connections; NULL for plain TCP
+         const tls_server_context* tls_;
       };
    };
-}
 
-std::multimap<IpAddr, boost::shared_ptr<tcp_proxy::bridge>, IpAddrCompare> tcp_proxy::bridge::ssplice_pending_bridge_ptrs_;
-std::vector<boost::shared_ptr<tcp_proxy::bridge> > tcp_proxy::bridge::acceptor::bridge_instances_;
-unsigned long tcp_proxy::bridge::num_downstream_connections_ = 0;
-unsigned long tcp_proxy::bridge::num_upstream_connections_ = 0;
+   // What the workers share for one route: the backends' probed state, the
+   // bandwidth limits the admin endpoint changes and the TLS context.
+   // Owned by the main thread and outlives the workers.
+   struct route_state
+   {
+      explicit route_state(const route_config& c)
+         : config(c), health(c.options.upstreams.size()), limits(c.options.rate_limit)
+         {
+            for(size_t i = 0; i < c.options.upstreams.size(); ++i)
+               upstream_addrs.push_back(c.options.upstreams[i].addr);
+         }
+
+      // NULL when active checks are off
+      const upstream_health* probed() const
+         {
+            return checker ? &health : NULL;
+         }
+
+      // NULL for plain TCP
+      const tls_server_context* tls_context() const
+         {
+            return config.options.tls.enabled() ? &tls : NULL;
+         }
+
+      const route_config& config;
+      std::vector<IpAddr> upstream_addrs;
+      upstream_health health;
+      boost::scoped_ptr<health_checker> checker;
+      rate_limits limits;
+      // Enforces `limits` on the main thread's loop for every worker
+      boost::scoped_ptr<rate_group_set> rates;
+      tls_server_context tls;
+   };
+
+   typedef std::vector<boost::shared_ptr<route_state> > route_list;
+
+   // A worker is one thread running its own event loop, with a listener,
+   // an acceptor and bridges of its own for every route; on the relay
+   // path, workers only share the memory budget and the bandwidth limits.
+   class worker
+   {
+   public:
+      typedef boost::shared_ptr<worker> ptr_type;
+
+      // The acceptors are indexed like `routes`. The io_uring engine
+      // serves a single route.
+      worker(unsigned int id, const proxy_options& options, const route_list& routes, memory_budget* budget)
+         : id_(id),
+           cpu_(options.affinity.cpu_of(id)),
+           evbase_(NULL),
+           drain_ev_(NULL),
+           finished_(false)
+         {
+            if(options.engine == engine_io_uring) {
+               const route_config& route = routes[0]->config;
+               const proxy_options& ro = route.options;
+               const uring_engine::limits to_upstream = { ro.upstream_watermarks.low, ro.upstream_watermarks.high };
+               const uring_engine::limits to_downstream = { ro.downstream_watermarks.low,
+                                                            ro.downstream_watermarks.high };
+               uring_.reset(new uring_engine(IpAddr(route.local_host.c_str(), route.local_port), ro.upstreams,
+                                             ro.balance, routes[0]->probed(), to_upstream, to_downstream, ro.tcp,
+                                             options.affinity.steering, cpu_, ro.timeouts, budget,
+                                             ro.send_proxy));
+            } else {
+               evbase_ = event_base_new();
+               for(size_t r = 0; r < routes.size(); ++r) {
+                  const route_config& route = routes[r]->config;
+                  acceptors_.push_back(boost::shared_ptr<bridge::acceptor>(
+                                          new bridge::acceptor(evbase_, route.options, route.local_host,
+                                                               route.local_port, routes[r]->probed(), cpu_, budget,
+                                                               routes[r]->rates.get(), routes[r]->tls_context())));
+               }
+            }
+         }
+
+      ~worker()
+         {
+            // The acceptors free bufferevents that belong to evbase_
+            acceptors_.clear();
+            if(drain_ev_)
+               event_free(drain_ev_);
+            if(evbase_)
+               event_base_free(evbase_);
+         }
+
+      // `inherited` is a listener taken over from another process, or -1
+      bool listen(size_t route, int inherited = -1)
+         {
+            return uring_ ? uring_->listen(inherited) : acceptors_[route]->listen(inherited);
+         }
+
+      int listen_fd(size_t route) const
+         {
+            return uring_ ? uring_->listen_fd() : acceptors_[route]->listen_fd();
+         }
+
+      int cpu() const
+         {
+            return cpu_;
+         }
+
+      void start()
+         {
+            thread_ = boost::thread(boost::bind(&worker::run, this));
+         }
+
+      // May be called from any thread
+      void stop()
+         {
+            if(uring_)
+               uring_->stop();
+            else
+               event_base_loopexit(evbase_, NULL);
+         }
+
+      // Stops accepting and lets the bridges finish; may be called from
+      // any thread
+      void drain()
+         {
+            if(uring_)
+               uring_->drain();
+            else
+               event_base_once(evbase_, -1, EV_TIMEOUT, on_drain, this, NULL);
+         }
+
+      // True once the loop has returned
+      bool finished() const
+         {
+            return finished_;
+         }
+
+      void join()
+         {
+            thread_.join();
+         }
+
+      const worker_metrics& metrics(size_t route) const
+         {
+            return uring_ ? uring_->metrics_ : acceptors_[route]->metrics_;
+         }
+
+   private:
+      void run()
+         {
+            logger::set_thread_name("worker-" + std::to_string(id_));
+            if(cpu_ >= 0 && pin_current_thread(cpu_))
+               PROXY_LOG_DEBUG("Worker %u running on CPU %d", id_, cpu_);
+            else
+               PROXY_LOG_DEBUG("Worker %u running", id_);
+            if(uring_) {
+               uring_->run();
+               uring_->log_stats(id_);
+            } else {
+               bool ready = true;
+               for(size_t r = 0; ready && r < acceptors_.size(); ++r)
+                  ready = acceptors_[r]->accept_connections();
+               //evbase_->loop();
+               if(ready)
+                  event_base_loop(evbase_, 0);
+            }
+            if(cpu_ >= 0) {
+               uint64_t local = 0, remote = 0;
+               for(size_t r = 0; r < std::max<size_t>(1, acceptors_.size()); ++r) {
+                  local += metrics(r).flows_local.get();
+                  remote += metrics(r).flows_remote.get();
+               }
+               PROXY_LOG_INFO("Worker %u on CPU %d: %llu of %llu flows arrived on this CPU", id_, cpu_,
+                              (unsigned long long)local, (unsigned long long)(local + remote));
+            }
+            if(uring_) {
+               finished_ = true;
+               return;
+            }
+            const slab::stats st = slab::thread_stats();
+            size_t in_use = 0, capacity = 0;
+            for(size_t r = 0; r < acceptors_.size(); ++r) {
+               in_use += acceptors_[r]->bridge_pool_.in_use();
+               capacity += acceptors_[r]->bridge_pool_.capacity();
+            }
+            PROXY_LOG_DEBUG("Worker %u: %zu of %zu pooled bridge blocks in use; libevent made %llu allocations, "
+                            "%llu of them from the heap", id_, in_use, capacity, (unsigned long long)st.allocations,
+                            (unsigned long long)st.heap_calls);
+            finished_ = true;
+         }
+
+      // Runs on the worker's loop
+      static void on_drain(evutil_socket_t fd, short what, void* arg)
+         {
+            worker* self = static_cast<worker*>(arg);
+            for(size_t r = 0; r < self->acceptors_.size(); ++r)
+               self->acceptors_[r]->drain();
+            self->drain_ev_ = event_new(self->evbase_, -1, EV_PERSIST, on_drain_check, self);
+            struct timeval tv = { 0, drain_check_ms * 1000 };
+            event_add(self->drain_ev_, &tv);
+         }
+
+      // Polls for the last bridge of every route while draining
+      static void on_drain_check(evutil_socket_t fd, short what, void* arg)
+         {
+            worker* self = static_cast<worker*>(arg);
+            for(size_t r = 0; r < self->acceptors_.size(); ++r) {
+               if(!self->acceptors_[r]->idle())
+                  return;
+            }
+            event_base_loopexit(self->evbase_, NULL);
+         }
+
+      static const int drain_check_ms = 100;
+      unsigned int id_;
+      int cpu_;   // -1 when not pinned
+      struct event_base* evbase_;
+      struct event* drain_ev_;
+      // Either the acceptors or uring_ is set, as chosen by --engine
+      std::vector<boost::shared_ptr<bridge::acceptor> > acceptors_;
+      boost::shared_ptr<uring_engine> uring_;
+      boost::thread thread_;
+      std::atomic<bool> finished_;
+   };
+
+   // State owned by the main thread, which only handles signals while the
+   // workers relay traffic.
+   struct server_context
+   {
+      server_context()
+         : evbase(NULL), argv(NULL), drain_timeout_ms(0), drain_ev(NULL), drain_deadline_usec(0)
+         {}
+
+      struct event_base* evbase;
+      route_list routes;
+      std::vector<worker::ptr_type> workers;
+      // What SIGHUP re-executes
+      char** argv;
+      boost::scoped_ptr<handoff_server> handoff;
+      boost::scoped_ptr<metrics_endpoint> admin;
+      // Set once a successor has taken over the listeners
+      unsigned int drain_timeout_ms;
+      struct event* drain_ev;
+      uint64_t drain_deadline_usec;
+   };
+}
 
 void onCtrlC(evutil_socket_t fd, short what, void* arg)
 {
-   EvEvent* ev = (EvEvent*)arg;
-   std::cout << "Ctrl-C --exiting loop" << std::endl;
-   // Destroy all the bridge instances
-   tcp_proxy::bridge::acceptor::bridge_instances_.erase(tcp_proxy::bridge::acceptor::bridge_instances_.begin(),
-                                                        tcp_proxy::bridge::acceptor::bridge_instances_.end());
-   tcp_proxy::bridge::ssplice_pending_bridge_ptrs_.erase(tcp_proxy::bridge::ssplice_pending_bridge_ptrs_.begin(),
-                                                         tcp_proxy::bridge::ssplice_pending_bridge_ptrs_.end());
-   ev->exitLoop();
+   tcp_proxy::server_context* ctx = static_cast<tcp_proxy::server_context*>(arg);
+   PROXY_LOG_INFO("Ctrl-C --exiting loop");
+   // Ask every worker loop to exit; bridges are destroyed with their acceptor
+   for(size_t i = 0; i < ctx->workers.size(); ++i)
+      ctx->workers[i]->stop();
+   event_base_loopexit(ctx->evbase, NULL);
+}
+
+// SIGHUP starts a fresh copy of the proxy that takes over the listeners
+void onReload(evutil_socket_t fd, short what, void* arg)
+{
+   tcp_proxy::server_context* ctx = static_cast<tcp_proxy::server_context*>(arg);
+   PROXY_LOG_INFO("Reload requested");
+   ctx->handoff->spawn(ctx->argv);
+}
+
+void onDrainCheck(evutil_socket_t fd, short what, void* arg)
+{
+   tcp_proxy::server_context* ctx = static_cast<tcp_proxy::server_context*>(arg);
+   uint64_t active = 0;
+   bool finished = true;
+   for(size_t i = 0; i < ctx->workers.size(); ++i) {
+      finished = finished && ctx->workers[i]->finished();
+      for(size_t r = 0; r < ctx->routes.size(); ++r)
+         active += ctx->workers[i]->metrics(r).downstream_active.get();
+   }
+   if(finished) {
+      PROXY_LOG_INFO("All connections drained, exiting");
+      event_base_loopexit(ctx->evbase, NULL);
+   } else if(tcp_proxy::monotonic_usec() >= ctx->drain_deadline_usec) {
+      PROXY_LOG_WARN("Drain timeout reached, closing %llu remaining connection(s)", (unsigned long long)active);
+      onCtrlC(fd, what, arg);
+   }
+}
+
+// The successor serves the listeners now: stop accepting, let the bridges
+// finish and exit
+void onHandedOver(void* arg)
+{
+   tcp_proxy::server_context* ctx = static_cast<tcp_proxy::server_context*>(arg);
+   // The successor serves metrics on the same socket
+   ctx->admin.reset();
+   for(size_t i = 0; i < ctx->workers.size(); ++i)
+      ctx->workers[i]->drain();
+   PROXY_LOG_INFO("Draining for up to %u ms", ctx->drain_timeout_ms);
+   ctx->drain_deadline_usec = tcp_proxy::monotonic_usec() + uint64_t(ctx->drain_timeout_ms) * 1000;
+   ctx->drain_ev = event_new(ctx->evbase, -1, EV_PERSIST, onDrainCheck, ctx);
+   struct timeval tv = { 0, 100000 };
+   event_add(ctx->drain_ev, &tv);
+}
+
+// GET /rate-limit lists the bandwidth limits in bytes per second (0 =
+// unlimited), prefixed by the route when there are several; PUT
+// /rate-limit?client=<bytes>&upstream=<bytes>&global=<bytes>[&route=<name>]
+// changes the ones given, with the same k/m/g suffixes as the options, of
+// the named route or else of every route
+void onRateLimit(struct evhttp_request* req, void* arg)
+{
+   tcp_proxy::server_context* ctx = static_cast<tcp_proxy::server_context*>(arg);
+   lev::EvHttpRequest request(req);
+   if(request.cmd() == EVHTTP_REQ_PUT || request.cmd() == EVHTTP_REQ_POST) {
+      const char* query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+      struct evkeyvalq params;
+      if(!query || evhttp_parse_query_str(query, &params) != 0) {
+         request.sendError(HTTP_BADREQUEST, "Bad Request");
+         return;
+      }
+      uint64_t rates[tcp_proxy::tier_count];
+      bool given[tcp_proxy::tier_count];
+      bool valid = true;
+      for(int t = 0; t < tcp_proxy::tier_count; ++t) {
+         const char* value = evhttp_find_header(&params, tcp_proxy::rate_tier_name(tcp_proxy::rate_tier(t)));
+         given[t] = (value != NULL);
+         if(value && !tcp_proxy::memory_budget::parse_size(value, rates[t]))
+            valid = false;
+      }
+      const char* route = evhttp_find_header(&params, "route");
+      const std::string route_name = route ? route : "";
+      evhttp_clear_headers(&params);
+      bool found = !route;
+      for(size_t r = 0; r < ctx->routes.size(); ++r)
+         found = found || ctx->routes[r]->config.name == route_name;
+      if(!valid || !found) {
+         request.sendError(HTTP_BADREQUEST, "Bad Request");
+         return;
+      }
+      for(size_t r = 0; r < ctx->routes.size(); ++r) {
+         const std::string& name = ctx->routes[r]->config.name;
+         if(route && name != route_name)
+            continue;
+         for(int t = 0; t < tcp_proxy::tier_count; ++t) {
+            if(!given[t])
+               continue;
+            ctx->routes[r]->limits.set(tcp_proxy::rate_tier(t), rates[t]);
+            PROXY_LOG_INFO("Rate limit per %s of route %s set to %llu bytes/s",
+                           tcp_proxy::rate_tier_name(tcp_proxy::rate_tier(t)), name.c_str(),
+                           (unsigned long long)rates[t]);
+         }
+      }
+      for(size_t r = 0; r < ctx->routes.size(); ++r)
+         ctx->routes[r]->rates->apply();
+   } else if(request.cmd() != EVHTTP_REQ_GET) {
+      request.sendError(405, "Method Not Allowed");
+      return;
+   }
+   evhttp_add_header(request.outputHdrs(), "Content-Type", "text/plain");
+   for(size_t r = 0; r < ctx->routes.size(); ++r) {
+      const tcp_proxy::route_state& route = *ctx->routes[r];
+      for(int t = 0; t < tcp_proxy::tier_count; ++t)
+         evbuffer_add_printf(evhttp_request_get_output_buffer(req), "%s%s%s %llu\n",
+                             ctx->routes.size() > 1 ? route.config.name.c_str() : "",
+                             ctx->routes.size() > 1 ? " " : "", tcp_proxy::rate_tier_name(tcp_proxy::rate_tier(t)),
+                             (unsigned long long)route.limits.get(tcp_proxy::rate_tier(t)));
+   }
+   request.sendReply(HTTP_OK, "OK");
 }
 
 int main(int argc, char* argv[])
 {
-   if (argc != 6)
+   // The process' own options; each route has its own copy of the rest
+   tcp_proxy::proxy_options options;
+   std::vector<tcp_proxy::route_config> route_configs;
+   if(argc == 3 && std::string(argv[1]) == "--config") {
+      if(!tcp_proxy::config_file::load(argv[2], options, route_configs))
+         return 1;
+   } else if (argc < 6)
    {
-      std::cerr << "usage: tcpproxy <local host ip> <local port> <forward host ip> <forward port> <debug-true/false>" << std::endl;
+      std::cerr << "usage: tcpproxy --config <file>\n       tcpproxy <local host ip> <local port> <forward host ip> <forward port> <debug-1/0> [--log-level trace|debug|info|warn|error|off] [--log-file <path>] [--workers <n, 0 = one per core>] [--engine libevent|io_uring] [--relay bufferevent|splice] [--upstream-watermarks <low>:<high>] [--downstream-watermarks <low>:<high>] [--pool-size <warm upstream connections per worker>] [--pool-max-idle <ms>] [--upstream <host>:<port>[@<weight>]]... [--balance round-robin|least-conn|hash] [--health-interval <ms, 0 = off>] [--health-timeout <ms>] [--health-rise <n>] [--health-fall <n>] [--health-send <bytes>] [--health-expect <bytes>] [--admin <host>:<port>] [--allocator slab|malloc] [--cpu-affinity off|auto|<cpu list>] [--steering off|incoming-cpu|bpf] [--fastopen <listener queue, 0 = off>] [--upstream-fastopen on|off] [--defer-accept <seconds, 0 = off>] [--handoff-socket <path>] [--drain-timeout <ms>] [--connect-timeout <ms>] [--idle-read-timeout <ms>] [--idle-write-timeout <ms>] [--max-lifetime <ms>] [--linger-timeout <ms after a half-close>] [--memory-budget <bytes>[k|m|g], 0 = off] [--rate-client <bytes/s>] [--rate-upstream <bytes/s>] [--rate-global <bytes/s>] [--send-proxy off|v1|v2] [--accept-proxy on|off] [--sni-route <name or *.domain>=<host>:<port>]... [--tls-cert <pem>] [--tls-key <pem>] [--tls-session-cache <sessions, 0 = off>] [--tls-tickets on|off] [--tls-ticket-key <80-byte file>] [--ktls on|off] (timeouts: 0 = off)" << std::endl;
       return 1;
+   } else {
+      const unsigned short local_port   = static_cast<unsigned short>(::atoi(argv[2]));
+      const unsigned short forward_port = static_cast<unsigned short>(::atoi(argv[4]));
+      const std::string local_host      = argv[1];
+      const std::string forward_host    = argv[3];
+      options.min_log_level = boost::lexical_cast<bool>(argv[5]) ? tcp_proxy::log_debug : tcp_proxy::log_info;
+      options.upstreams.push_back(tcp_proxy::upstream_spec(IpAddr(forward_host.c_str(), forward_port), 1));
+      if(!options.parse(argc, argv, 6))
+         return 1;
+      tcp_proxy::route_config route;
+      route.name = "default";
+      route.local_host = local_host;
+      route.local_port = local_port;
+      route.options = options;
+      route_configs.push_back(route);
    }
+   // Has to precede every libevent allocation
+   if(options.slab_alloc)
+      tcp_proxy::slab::install();
+   lev::debug = (options.min_log_level <= tcp_proxy::log_debug);
+   tcp_proxy::logger::set_level(options.min_log_level);
+   tcp_proxy::logger::set_thread_name("main");
+   if(!tcp_proxy::logger::start(options.log_file))
+      return 1;
+
+   if(options.engine == tcp_proxy::engine_io_uring) {
+      if(!tcp_proxy::uring::supported()) {
+         PROXY_LOG_ERROR("io_uring is not available (%s); falling back to the libevent engine", strerror(errno));
+         options.engine = tcp_proxy::engine_libevent;
+      } else if(route_configs.size() > 1) {
+         PROXY_LOG_ERROR("The io_uring engine serves a single route, not %zu", route_configs.size());
+         tcp_proxy::logger::stop();
+         return 1;
+      }
+   }
+   for(size_t r = 0; r < route_configs.size(); ++r) {
+      tcp_proxy::proxy_options& ro = route_configs[r].options;
+      ro.engine = options.engine;
+      ro.tcp.check_kernel();
+      if(options.engine == tcp_proxy::engine_io_uring && (ro.relay == tcp_proxy::relay_splice || ro.pool_size))
+         PROXY_LOG_WARN("--relay splice and --pool-size do not apply to the io_uring engine");
+      if(ro.rate_limit.any() && (options.engine == tcp_proxy::engine_io_uring || ro.relay == tcp_proxy::relay_splice))
+         PROXY_LOG_WARN("Bandwidth limits only apply to the libevent engine's bufferevent relay");
+      if((ro.accept_proxy || !ro.sni_routes.empty() || ro.tls.enabled()) &&
+         options.engine == tcp_proxy::engine_io_uring) {
+         PROXY_LOG_ERROR("--accept-proxy, --sni-route and --tls-cert are only supported by the libevent engine");
+         tcp_proxy::logger::stop();
+         return 1;
+      }
+   }
+
+   // Worker loops are stopped from the signal loop, which needs libevent's
+   // cross-thread notification.
+   evthread_use_pthreads();
+
    //EvBaseLoop evbase;
    struct event_base* evbase = event_base_new();
-   const unsigned short local_port   = static_cast<unsigned short>(::atoi(argv[2]));
-   const unsigned short forward_port = static_cast<unsigned short>(::atoi(argv[4]));
-   const std::string local_host      = argv[1];
-   const std::string forward_host    = argv[3];
-   debug = boost::lexical_cast<bool>(argv[5]);
+   tcp_proxy::server_context ctx;
+   ctx.evbase = evbase;
+   ctx.argv = argv;
+   ctx.drain_timeout_ms = options.drain_timeout_ms;
+   std::vector<tcp_proxy::worker::ptr_type>& workers = ctx.workers;
+   boost::scoped_ptr<tcp_proxy::metrics_endpoint>& admin = ctx.admin;
+   tcp_proxy::route_list& routes = ctx.routes;
 
    signal(SIGPIPE, SIG_IGN);
    //EvEvent ctrlc;
-   struct event *evnt_ctrlc = event_new(evbase, SIGINT, EV_PERSIST | EV_SIGNAL, onCtrlC, NULL);
+   struct event *evnt_ctrlc = event_new(evbase, SIGINT, EV_PERSIST | EV_SIGNAL, onCtrlC, &ctx);
    event_add(evnt_ctrlc, NULL);
    //ctrlc.newSignal(onCtrlC, SIGINT, evbase);
    //ctrlc.start();
@@ -513,23 +2463,157 @@ int main(int argc, char* argv[])
    // EvEvent evstop;
    // evstop.newSignal(onCtrlC, SIGHUP, evbase);
    // evstop.start();
-   struct event *evnt_stop = event_new(evbase, SIGHUP, EV_PERSIST | EV_SIGNAL, onCtrlC, NULL);
+   // struct event *evnt_stop = event_new(evbase, SIGHUP, EV_PERSIST | EV_SIGNAL, onCtrlC, &ctx);
+   struct event *evnt_stop = event_new(evbase, SIGHUP, EV_PERSIST | EV_SIGNAL, onReload, &ctx);
    event_add(evnt_stop, NULL);
 
+   // Take the listeners over from a running proxy if there is one: either
+   // the one that started this process on SIGHUP, or one serving hand-off
+   // requests on --handoff-socket. Each goes to the route listening on its
+   // address; one whose route is gone is closed, and a new route binds.
+   std::vector<std::vector<int> > inherited(route_configs.size());
+   int inherited_admin = -1;
+   const int handoff_sock = tcp_proxy::handoff_connect(options.handoff_socket);
+   if(handoff_sock >= 0) {
+      std::vector<int> received;
+      if(!tcp_proxy::receive_handoff(handoff_sock, received, inherited_admin)) {
+         // Closing our end tells the old process to carry on
+         for(size_t i = 0; i < received.size(); ++i)
+            close(received[i]);
+         if(inherited_admin >= 0)
+            close(inherited_admin);
+         close(handoff_sock);
+         tcp_proxy::logger::stop();
+         return 1;
+      }
+      PROXY_LOG_INFO("Taking over %zu listening socket(s) from the running proxy", received.size());
+      for(size_t i = 0; i < received.size(); ++i) {
+         size_t r = 0;
+         while(r < route_configs.size() &&
+               !tcp_proxy::listening_on(received[i], IpAddr(route_configs[r].local_host.c_str(),
+                                                            route_configs[r].local_port)))
+            ++r;
+         if(r < route_configs.size()) {
+            inherited[r].push_back(received[i]);
+         } else {
+            PROXY_LOG_WARN("Closing an inherited listener that no route listens on any more");
+            close(received[i]);
+         }
+      }
+      // Every inherited listener needs a worker, or whatever is queued on it
+      // would be reset once the old process lets go
+      for(size_t r = 0; r < inherited.size(); ++r) {
+         if(inherited[r].size() > options.num_workers) {
+            PROXY_LOG_INFO("Running %zu workers instead of %u, one per inherited listener",
+                           inherited[r].size(), options.num_workers);
+            options.num_workers = static_cast<unsigned int>(inherited[r].size());
+         }
+      }
+   }
+
+   // Backends are probed from this thread's loop; the workers only read
+   // the resulting up/down state.
+   for(size_t r = 0; r < route_configs.size(); ++r) {
+      tcp_proxy::route_config& route = route_configs[r];
+      boost::shared_ptr<tcp_proxy::route_state> state(new tcp_proxy::route_state(route));
+      state->rates.reset(new tcp_proxy::rate_group_set(evbase, state->limits, route.options.upstreams.size()));
+      if(route.options.health.interval_ms)
+         state->checker.reset(new tcp_proxy::health_checker(evbase, route.options.health, state->upstream_addrs,
+                                                            state->health));
+      if(route.options.tls.enabled() && !state->tls.init(route.options.tls)) {
+         tcp_proxy::logger::stop();
+         return 1;
+      }
+      routes.push_back(state);
+   }
+
+   tcp_proxy::memory_budget budget(options.memory_budget);
+
+   std::vector<tcp_proxy::route_metrics> route_stats;
+   int ret = 0;
    try
    {
-      tcp_proxy::bridge::acceptor acceptor(evbase,
-                                           local_host, local_port,
-                                           forward_host, forward_port);
-      std::cout << "Created acceptor object @ " << &acceptor << std::endl;
-      acceptor.accept_connections();
+      // Bind every listener before starting any thread so that bind errors
+      // are reported up front.
+      for(unsigned int i = 0; i < options.num_workers; ++i) {
+         tcp_proxy::worker::ptr_type w(new tcp_proxy::worker(i, options, routes, &budget));
+         for(size_t r = 0; r < routes.size(); ++r) {
+            if(!w->listen(r, i < inherited[r].size() ? inherited[r][i] : -1))
+               throw std::runtime_error("failed to create listener");
+         }
+         workers.push_back(w);
+      }
+      for(size_t r = 0; r < routes.size(); ++r) {
+         const tcp_proxy::route_state& route = *routes[r];
+         route_stats.push_back(tcp_proxy::route_metrics(route.config.name, route.upstream_addrs, route.probed(),
+                                                        route.rates.get()));
+         for(size_t i = 0; i < workers.size(); ++i)
+            route_stats.back().workers.push_back(&workers[i]->metrics(r));
+      }
+      // The program is shared by a route's whole reuseport group; listeners
+      // are numbered in the order the workers started listening
+      if(options.affinity.steering == tcp_proxy::steer_bpf) {
+         std::vector<int> cpu_of_index;
+         for(size_t i = 0; i < workers.size(); ++i)
+            cpu_of_index.push_back(workers[i]->cpu());
+         for(size_t r = 0; r < routes.size(); ++r)
+            tcp_proxy::attach_cpu_steering(workers[0]->listen_fd(r), cpu_of_index);
+      }
+      PROXY_LOG_INFO("Started %zu worker(s) serving %zu route(s)", workers.size(), routes.size());
+      for(size_t i = 0; i < workers.size(); ++i)
+         workers[i]->start();
+      for(size_t r = 0; r < routes.size(); ++r) {
+         if(routes[r]->checker)
+            routes[r]->checker->start();
+      }
+      if(options.admin_enabled) {
+         admin.reset(new tcp_proxy::metrics_endpoint(evbase, route_stats));
+         admin->add_route("/rate-limit", onRateLimit, &ctx);
+         if(inherited_admin >= 0 ? !admin->adopt(inherited_admin, options.admin_address)
+                                 : !admin->bind(options.admin_address))
+            throw std::runtime_error("failed to start the admin endpoint");
+      } else if(inherited_admin >= 0) {
+         close(inherited_admin);
+      }
+      // Everything is served from here on, so the old process may let go
+      if(handoff_sock >= 0) {
+         tcp_proxy::send_handoff_ready(handoff_sock);
+         close(handoff_sock);
+      }
+      ctx.handoff.reset(new tcp_proxy::handoff_server(evbase, onHandedOver, &ctx));
+      std::vector<int> listen_fds;
+      for(size_t i = 0; i < workers.size(); ++i) {
+         for(size_t r = 0; r < routes.size(); ++r)
+            listen_fds.push_back(workers[i]->listen_fd(r));
+      }
+      if(listen_fds.size() > tcp_proxy::handoff_max_fds)
+         PROXY_LOG_WARN("%zu listeners are more than a reload can hand over (%zu)", listen_fds.size(),
+                        tcp_proxy::handoff_max_fds);
+      ctx.handoff->set_sockets(listen_fds, admin ? admin->listen_fd() : -1);
+      if(!options.handoff_socket.empty())
+         ctx.handoff->listen(options.handoff_socket);
+      event_base_loop(evbase, 0);
    } catch(std::exception& e)
    {
-      std::cerr << "Error: " << e.what() << std::endl;
-      event_base_free(evbase);
-      return 1;
+      PROXY_LOG_ERROR("%s", e.what());
+      ret = 1;
+   }
+   admin.reset();
+   for(size_t i = 0; i < workers.size(); ++i) {
+      workers[i]->stop();
+      workers[i]->join();
    }
+   tcp_proxy::metrics_endpoint::log_latencies(route_stats);
+   workers.clear();
+   routes.clear();
+   ctx.handoff.reset();
+   if(ctx.drain_ev)
+      event_free(ctx.drain_ev);
+   event_free(evnt_ctrlc);
+   event_free(evnt_stop);
    event_base_free(evbase);
+   tcp_proxy::logger::stop();
+   return ret;
 }
 
 /*
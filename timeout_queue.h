@@ -0,0 +1,102 @@
+#ifndef _TIMEOUT_QUEUE_H
+#define _TIMEOUT_QUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace tcp_proxy
+{
+   // Per-connection time limits in milliseconds, 0 = off
+   struct timeout_options
+   {
+      timeout_options()
+         : connect_ms(10000), idle_read_ms(0), idle_write_ms(0), lifetime_ms(0), linger_ms(30000)
+         {}
+
+      unsigned int connect_ms;      // upstream connect
+      unsigned int idle_read_ms;    // nothing read from either side
+      unsigned int idle_write_ms;   // queued data the peer does not take
+      unsigned int lifetime_ms;     // from accept, however busy
+      unsigned int linger_ms;       // from the first EOF until both directions have finished
+   };
+
+   struct timeout_link
+   {
+      timeout_link()
+         : owner(NULL), prev(NULL), next(NULL), since(0), linked(false)
+         {}
+
+      void* owner;
+      timeout_link* prev;
+      timeout_link* next;
+      uint64_t since;   // when it was (re)armed, in monotonic_usec
+      bool linked;
+   };
+
+   // Timeouts that all last equally long, in O(1): (re)arming appends the
+   // entry at the tail, so the queue stays ordered by deadline and expiry
+   // only ever looks at the head. This is what libevent's common timeouts
+   // do, for code that does not run on libevent.
+   class timeout_queue
+   {
+   public:
+      explicit timeout_queue(unsigned int duration_ms = 0)
+         : duration_usec_(uint64_t(duration_ms) * 1000), head_(NULL), tail_(NULL)
+         {}
+
+      bool enabled() const
+         {
+            return duration_usec_ != 0;
+         }
+
+      void arm(timeout_link& l, uint64_t now)
+         {
+            if(!enabled())
+               return;
+            cancel(l);
+            l.since = now;
+            l.prev = tail_;
+            l.next = NULL;
+            if(tail_)
+               tail_->next = &l;
+            else
+               head_ = &l;
+            tail_ = &l;
+            l.linked = true;
+         }
+
+      void cancel(timeout_link& l)
+         {
+            if(!l.linked)
+               return;
+            if(l.prev)
+               l.prev->next = l.next;
+            else
+               head_ = l.next;
+            if(l.next)
+               l.next->prev = l.prev;
+            else
+               tail_ = l.prev;
+            l.prev = l.next = NULL;
+            l.linked = false;
+         }
+
+      // The owner of the oldest entry if it has expired, taking it off the
+      // queue; NULL otherwise
+      void* pop_expired(uint64_t now)
+         {
+            if(!head_ || now - head_->since < duration_usec_)
+               return NULL;
+            timeout_link* l = head_;
+            cancel(*l);
+            return l->owner;
+         }
+
+   private:
+      uint64_t duration_usec_;
+      timeout_link* head_;
+      timeout_link* tail_;
+   };
+}
+
+#endif // _TIMEOUT_QUEUE_H
@@ -0,0 +1,165 @@
+#ifndef _TLS_SERVER_H
+#define _TLS_SERVER_H
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "proxy_log.h"
+
+namespace tcp_proxy
+{
+   struct tls_options
+   {
+      tls_options()
+         : session_cache(20000), tickets(true), ktls(true)
+         {}
+
+      bool enabled() const
+         {
+            return !cert_file.empty();
+         }
+
+      std::string cert_file;         // PEM chain, leaf first
+      std::string key_file;          // PEM; the certificate file when empty
+      unsigned int session_cache;    // sessions kept for resumption by id, 0 = off
+      bool tickets;                  // stateless resumption
+      std::string ticket_key_file;   // 80 bytes shared by every process that
+                                     // should resume the others' tickets
+      bool ktls;                     // let the kernel do the record layer
+   };
+
+   enum tls_handshake_result
+   {
+      tls_handshake_pending,   // waiting for the client
+      tls_handshake_done,
+      tls_handshake_failed
+   };
+
+   // The server side of TLS termination: one SSL_CTX for every worker, so
+   // they share the session cache and the ticket keys, and a client resumes
+   // whichever worker its next connection lands on.
+   class tls_server_context
+   {
+   public:
+      tls_server_context()
+         : ctx_(NULL), ktls_(false)
+         {}
+
+      ~tls_server_context()
+         {
+            if(ctx_)
+               SSL_CTX_free(ctx_);
+         }
+
+      bool init(const tls_options& options)
+         {
+            ctx_ = SSL_CTX_new(TLS_server_method());
+            if(!ctx_)
+               return fail("Could not create the TLS context");
+            SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+            // Clients that close without close_notify end their stream with an
+            // EOF, as libevent expects of a dirty shutdown, not an error
+            SSL_CTX_set_options(ctx_, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+            if(SSL_CTX_use_certificate_chain_file(ctx_, options.cert_file.c_str()) != 1)
+               return fail("Could not load the certificate " + options.cert_file);
+            const std::string& key = options.key_file.empty() ? options.cert_file : options.key_file;
+            if(SSL_CTX_use_PrivateKey_file(ctx_, key.c_str(), SSL_FILETYPE_PEM) != 1 ||
+               SSL_CTX_check_private_key(ctx_) != 1)
+               return fail("Could not load the private key " + key);
+
+            // Resumption: by session id from the cache, and by ticket. With
+            // tickets off, TLS 1.3 resumes from the cache too.
+            static const unsigned char id_context[] = "tcpproxy";
+            SSL_CTX_set_session_id_context(ctx_, id_context, sizeof(id_context) - 1);
+            if(options.session_cache) {
+               SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_SERVER);
+               SSL_CTX_sess_set_cache_size(ctx_, options.session_cache);
+            } else {
+               SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_OFF);
+            }
+            if(!options.tickets) {
+               SSL_CTX_set_options(ctx_, SSL_OP_NO_TICKET);
+            } else if(!options.ticket_key_file.empty()) {
+               unsigned char keys[80];
+               FILE* f = fopen(options.ticket_key_file.c_str(), "rb");
+               const bool read = f && fread(keys, 1, sizeof(keys), f) == sizeof(keys);
+               if(f)
+                  fclose(f);
+               if(!read || SSL_CTX_set_tlsext_ticket_keys(ctx_, keys, sizeof(keys)) != 1)
+                  return fail("Could not load 80 bytes of ticket keys from " + options.ticket_key_file);
+               memset(keys, 0, sizeof(keys));
+            }
+            ktls_ = options.ktls;
+#ifdef SSL_OP_ENABLE_KTLS
+            if(ktls_)
+               SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS);
+#endif
+            return true;
+         }
+
+      // A server session on an accepted socket; NULL on failure
+      SSL* accept(int fd) const
+         {
+            SSL* ssl = SSL_new(ctx_);
+            if(ssl && SSL_set_fd(ssl, fd) != 1) {
+               SSL_free(ssl);
+               return NULL;
+            }
+            if(ssl)
+               SSL_set_accept_state(ssl);
+            return ssl;
+         }
+
+      // Advances the handshake as far as the bytes that have arrived allow
+      static tls_handshake_result handshake(SSL* ssl)
+         {
+            ERR_clear_error();
+            const int r = SSL_do_handshake(ssl);
+            if(r == 1)
+               return tls_handshake_done;
+            const int err = SSL_get_error(ssl, r);
+            if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+               return tls_handshake_pending;
+            return tls_handshake_failed;
+         }
+
+      // Whether the kernel encrypts and decrypts the records (kTLS), so
+      // the socket carries plaintext as far as the relay is concerned and
+      // the session can be dropped once its buffers are empty
+      bool kernel_offloaded(SSL* ssl) const
+         {
+#ifdef SSL_OP_ENABLE_KTLS
+            return ktls_ && BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) &&
+                   !SSL_has_pending(ssl);
+#else
+            (void)ssl;
+            return false;
+#endif
+         }
+
+   private:
+      tls_server_context(const tls_server_context&);
+      tls_server_context& operator=(const tls_server_context&);
+
+      static bool fail(const std::string& what)
+         {
+            char reason[256];
+            ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+            PROXY_LOG_ERROR("%s: %s", what.c_str(), reason);
+            return false;
+         }
+
+      SSL_CTX* ctx_;
+      bool ktls_;
+   };
+}
+
+#endif // _TLS_SERVER_H
@@ -0,0 +1,367 @@
+#ifndef _UPSTREAM_BALANCER_H
+#define _UPSTREAM_BALANCER_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+extern "C" {
+#include <netinet/in.h>
+#include <sys/socket.h>
+}
+
+#include "./lev-master/include/lev.h"
+#include "upstream_health.h"
+
+namespace tcp_proxy
+{
+   enum balance_policy
+   {
+      balance_round_robin,    // weighted, in a smooth interleaved order
+      balance_least_conn,     // fewest active connections relative to weight
+      balance_hash            // consistent hashing on the client address
+   };
+
+   struct upstream_spec
+   {
+      upstream_spec(const lev::IpAddr& a, unsigned int w)
+         : addr(a), weight(w)
+         {}
+
+      static const unsigned int max_weight = 1000;
+
+      // Parses "<host>:<port>[@<weight>]"
+      static bool parse(const std::string& value, upstream_spec& spec)
+         {
+            const size_t at = value.find('@');
+            unsigned int weight = 1;
+            if(at != std::string::npos) {
+               try
+               {
+                  weight = boost::lexical_cast<unsigned int>(value.substr(at + 1));
+               } catch(boost::bad_lexical_cast&) {
+                  return false;
+               }
+            }
+            lev::IpAddr addr;
+            if(weight == 0 || weight > max_weight || !addr.assign(value.substr(0, at).c_str()))
+               return false;
+            spec = upstream_spec(addr, weight);
+            return true;
+         }
+
+      lev::IpAddr addr;
+      unsigned int weight;
+   };
+
+   // Chooses a backend per connection. Every table is built up front, so
+   // picking never allocates: round robin walks a precomputed schedule
+   // (O(1)), least-connections keeps an indexed heap (O(log n)) and hashing
+   // searches a sorted ring of virtual nodes (O(log n)). One balancer lives
+   // in each worker, so the active counts are per worker.
+   //
+   // Ejected backends are skipped: when the shared health generation moves,
+   // the next accept rebuilds the tables from the new up/down snapshot,
+   // within the capacity reserved up front. Should every backend be down,
+   // all of them are tried again rather than refusing every client.
+   class upstream_balancer
+   {
+   public:
+      static const unsigned int hash_points_per_weight = 160;
+      // What acquire() returns when every backend has weight 0, i.e. is
+      // only reached through an SNI route
+      static const size_t none = size_t(-1);
+
+      upstream_balancer(const std::vector<upstream_spec>& upstreams, balance_policy policy,
+                        const upstream_health* health)
+         : upstreams_(upstreams), policy_(policy), health_(health), seen_generation_(0),
+           up_(upstreams.size(), 1), active_(upstreams.size(), 0), total_weight_(0), cursor_(0)
+         {
+            for(size_t i = 0; i < upstreams_.size(); ++i)
+               total_weight_ += upstreams_[i].weight;
+            switch(policy_) {
+            case balance_round_robin:
+               build_schedule();
+               break;
+            case balance_least_conn:
+               build_heap();
+               break;
+            case balance_hash:
+               build_ring();
+               break;
+            }
+         }
+
+      size_t size() const
+         {
+            return upstreams_.size();
+         }
+
+      balance_policy policy() const
+         {
+            return policy_;
+         }
+
+      const lev::IpAddr& address(size_t index) const
+         {
+            return upstreams_[index].addr;
+         }
+
+      unsigned long active(size_t index) const
+         {
+            return active_[index];
+         }
+
+      // False when no backend takes balanced connections
+      bool balances() const
+         {
+            return total_weight_ != 0;
+         }
+
+      // Picks a backend for a connection from `client` and counts it as
+      // active until release() is called with the returned index; `none`
+      // if no backend takes balanced connections.
+      size_t acquire(const struct sockaddr* client)
+         {
+            if(!total_weight_)
+               return none;
+            if(health_ && health_->generation() != seen_generation_)
+               sync_health();
+            size_t index = 0;
+            switch(policy_) {
+            case balance_round_robin:
+               index = schedule_[cursor_];
+               if(++cursor_ == schedule_.size())
+                  cursor_ = 0;
+               break;
+            case balance_least_conn:
+               index = heap_[0];
+               break;
+            case balance_hash:
+               index = ring_lookup(hash_client(client));
+               break;
+            }
+            active_[index]++;
+            if(policy_ == balance_least_conn)
+               sift_down(heap_pos_[index]);
+            return index;
+         }
+
+      // Counts a connection to a backend chosen elsewhere (by an SNI route)
+      size_t acquire_at(size_t index)
+         {
+            active_[index]++;
+            if(policy_ == balance_least_conn)
+               sift_down(heap_pos_[index]);
+            return index;
+         }
+
+      void release(size_t index)
+         {
+            active_[index]--;
+            if(policy_ == balance_least_conn)
+               sift_up(heap_pos_[index]);
+         }
+
+   private:
+      void sync_health()
+         {
+            seen_generation_ = health_->generation();
+            bool any_up = false;
+            for(size_t i = 0; i < up_.size(); ++i) {
+               up_[i] = health_->up(i);
+               any_up = any_up || (up_[i] && upstreams_[i].weight);
+            }
+            if(!any_up)
+               std::fill(up_.begin(), up_.end(), 1);
+            switch(policy_) {
+            case balance_round_robin:
+               build_schedule();
+               break;
+            case balance_least_conn:
+               for(size_t i = heap_.size() / 2; i-- > 0;)
+                  sift_down(i);
+               break;
+            case balance_hash:
+               filter_ring();
+               break;
+            }
+         }
+
+      // Smooth weighted round robin (as in nginx), run once over a full
+      // cycle: weights {5,1,1} give a a b a c a a instead of a a a a a b c.
+      void build_schedule()
+         {
+            std::vector<long>& current = wrr_current_;
+            current.assign(upstreams_.size(), 0);
+            long total = 0;
+            for(size_t i = 0; i < upstreams_.size(); ++i)
+               total += weight_of(i);
+            schedule_.clear();
+            schedule_.reserve(total);
+            cursor_ = 0;
+            for(long n = 0; n < total; ++n) {
+               size_t best = 0;
+               for(size_t i = 0; i < upstreams_.size(); ++i) {
+                  current[i] += weight_of(i);
+                  if(current[i] > current[best])
+                     best = i;
+               }
+               current[best] -= total;
+               schedule_.push_back(static_cast<uint32_t>(best));
+            }
+         }
+
+      void build_heap()
+         {
+            for(size_t i = 0; i < upstreams_.size(); ++i) {
+               heap_.push_back(static_cast<uint32_t>(i));
+               heap_pos_.push_back(static_cast<uint32_t>(i));
+            }
+         }
+
+      // Weight of a backend in the current rotation
+      unsigned int weight_of(size_t index) const
+         {
+            return up_[index] ? upstreams_[index].weight : 0;
+         }
+
+      // a before b when active_a / weight_a < active_b / weight_b; ejected
+      // and weight-0 backends sink below every healthy one
+      bool less_loaded(uint32_t a, uint32_t b) const
+         {
+            if((weight_of(a) != 0) != (weight_of(b) != 0))
+               return weight_of(a) != 0;
+            const uint64_t la = uint64_t(active_[a]) * upstreams_[b].weight;
+            const uint64_t lb = uint64_t(active_[b]) * upstreams_[a].weight;
+            return la < lb || (la == lb && a < b);
+         }
+
+      void swap_heap(size_t i, size_t j)
+         {
+            std::swap(heap_[i], heap_[j]);
+            heap_pos_[heap_[i]] = static_cast<uint32_t>(i);
+            heap_pos_[heap_[j]] = static_cast<uint32_t>(j);
+         }
+
+      void sift_up(size_t i)
+         {
+            while(i > 0 && less_loaded(heap_[i], heap_[(i - 1) / 2])) {
+               swap_heap(i, (i - 1) / 2);
+               i = (i - 1) / 2;
+            }
+         }
+
+      void sift_down(size_t i)
+         {
+            for(;;) {
+               size_t best = i;
+               const size_t l = 2 * i + 1, r = 2 * i + 2;
+               if(l < heap_.size() && less_loaded(heap_[l], heap_[best]))
+                  best = l;
+               if(r < heap_.size() && less_loaded(heap_[r], heap_[best]))
+                  best = r;
+               if(best == i)
+                  return;
+               swap_heap(i, best);
+               i = best;
+            }
+         }
+
+      static uint64_t mix(uint64_t h)
+         {
+            // splitmix64 finalizer
+            h ^= h >> 30;
+            h *= 0xbf58476d1ce4e5b9ULL;
+            h ^= h >> 27;
+            h *= 0x94d049bb133111ebULL;
+            h ^= h >> 31;
+            return h;
+         }
+
+      static uint64_t hash_bytes(const void* data, size_t len, uint64_t seed)
+         {
+            // FNV-1a
+            const unsigned char* p = static_cast<const unsigned char*>(data);
+            uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+            for(size_t i = 0; i < len; ++i) {
+               h ^= p[i];
+               h *= 0x100000001b3ULL;
+            }
+            return mix(h);
+         }
+
+      // Only the address takes part, so every connection from one client
+      // lands on the same backend regardless of its source port.
+      static uint64_t hash_client(const struct sockaddr* client)
+         {
+            if(client && client->sa_family == AF_INET6) {
+               const struct sockaddr_in6* sin6 = reinterpret_cast<const struct sockaddr_in6*>(client);
+               return hash_bytes(&sin6->sin6_addr, sizeof(sin6->sin6_addr), 0);
+            }
+            if(client && client->sa_family == AF_INET) {
+               const struct sockaddr_in* sin = reinterpret_cast<const struct sockaddr_in*>(client);
+               return hash_bytes(&sin->sin_addr, sizeof(sin->sin_addr), 0);
+            }
+            return 0;
+         }
+
+      // Each backend owns weight * hash_points_per_weight points on the
+      // ring, derived from its address, so adding or removing one backend
+      // only moves the clients that hashed next to its points.
+      void build_ring()
+         {
+            for(size_t i = 0; i < upstreams_.size(); ++i) {
+               const std::string name = upstreams_[i].addr.toStringFull();
+               const unsigned int points = upstreams_[i].weight * hash_points_per_weight;
+               for(unsigned int p = 0; p < points; ++p)
+                  ring_.push_back(std::make_pair(hash_bytes(name.data(), name.size(), p), static_cast<uint32_t>(i)));
+            }
+            std::sort(ring_.begin(), ring_.end());
+            all_ring_ = ring_;
+         }
+
+      // Drops the points of ejected backends; the survivors stay sorted
+      void filter_ring()
+         {
+            ring_.clear();
+            for(size_t i = 0; i < all_ring_.size(); ++i) {
+               if(up_[all_ring_[i].second])
+                  ring_.push_back(all_ring_[i]);
+            }
+         }
+
+      size_t ring_lookup(uint64_t h) const
+         {
+            std::vector<std::pair<uint64_t, uint32_t> >::const_iterator it =
+               std::lower_bound(ring_.begin(), ring_.end(), std::make_pair(h, uint32_t(0)));
+            if(it == ring_.end())
+               it = ring_.begin();
+            return it->second;
+         }
+
+      std::vector<upstream_spec> upstreams_;
+      balance_policy policy_;
+      const upstream_health* health_;   // NULL when active checks are off
+      uint64_t seen_generation_;
+      std::vector<char> up_;
+      std::vector<unsigned long> active_;
+      unsigned long total_weight_;
+      // round robin
+      std::vector<uint32_t> schedule_;
+      size_t cursor_;
+      std::vector<long> wrr_current_;
+      // least connections: heap_ holds backend indexes, heap_pos_ their slots
+      std::vector<uint32_t> heap_;
+      std::vector<uint32_t> heap_pos_;
+      // consistent hashing: every point, and the points of healthy backends
+      std::vector<std::pair<uint64_t, uint32_t> > all_ring_;
+      std::vector<std::pair<uint64_t, uint32_t> > ring_;
+   };
+}
+
+#endif // _UPSTREAM_BALANCER_H
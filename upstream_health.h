@@ -0,0 +1,251 @@
+#ifndef _UPSTREAM_HEALTH_H
+#define _UPSTREAM_HEALTH_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "./lev-master/include/lev.h"
+#include "proxy_log.h"
+
+namespace tcp_proxy
+{
+   struct health_check_options
+   {
+      health_check_options()
+         : interval_ms(0), timeout_ms(1000), rise(2), fall(3)
+         {}
+
+      // Turns the \r, \n, \t and \\ escapes of a command line argument into bytes
+      static std::string unescape(const std::string& value)
+         {
+            std::string out;
+            for(size_t i = 0; i < value.size(); ++i) {
+               if(value[i] != '\\' || i + 1 == value.size()) {
+                  out += value[i];
+                  continue;
+               }
+               switch(value[++i]) {
+               case 'r': out += '\r'; break;
+               case 'n': out += '\n'; break;
+               case 't': out += '\t'; break;
+               default:  out += value[i]; break;
+               }
+            }
+            return out;
+         }
+
+      unsigned int interval_ms;   // 0 disables active checks
+      unsigned int timeout_ms;
+      unsigned int rise;          // consecutive passes that bring a backend back
+      unsigned int fall;          // consecutive failures that eject it
+      std::string send;           // written once connected, if not empty
+      std::string expect;         // must appear in the reply, if not empty
+   };
+
+   // Up/down state of every backend, written by the health checker and read
+   // by the balancers of all workers. Each change bumps the generation so a
+   // balancer notices with a single load per accept.
+   class upstream_health
+   {
+   public:
+      explicit upstream_health(size_t count)
+         : up_(new std::atomic<bool>[count]), count_(count), generation_(0)
+         {
+            for(size_t i = 0; i < count_; ++i)
+               up_[i].store(true, std::memory_order_relaxed);
+         }
+
+      ~upstream_health()
+         {
+            delete[] up_;
+         }
+
+      size_t size() const
+         {
+            return count_;
+         }
+
+      bool up(size_t index) const
+         {
+            return up_[index].load(std::memory_order_relaxed);
+         }
+
+      uint64_t generation() const
+         {
+            return generation_.load(std::memory_order_acquire);
+         }
+
+      void set(size_t index, bool up)
+         {
+            up_[index].store(up, std::memory_order_relaxed);
+            generation_.fetch_add(1, std::memory_order_release);
+         }
+
+   private:
+      upstream_health(const upstream_health&);
+      upstream_health& operator=(const upstream_health&);
+
+      std::atomic<bool>* up_;
+      size_t count_;
+      std::atomic<uint64_t> generation_;
+   };
+
+   // Probes every backend on a timer of its own. Runs on the main thread's
+   // event loop, which carries no relay traffic, so a slow or hanging
+   // backend can only delay its own probe.
+   class health_checker
+   {
+   public:
+      health_checker(struct event_base* evbase, const health_check_options& options,
+                     const std::vector<lev::IpAddr>& upstreams, upstream_health& health)
+         : evbase_(evbase), options_(options), health_(health)
+         {
+            for(size_t i = 0; i < upstreams.size(); ++i) {
+               boost::shared_ptr<probe> p(new probe(this, i, upstreams[i]));
+               p->timer.newTimer(on_timer, evbase_);
+               p->timer.setUserData(p.get());
+               probes_.push_back(p);
+            }
+         }
+
+      ~health_checker()
+         {
+            for(size_t i = 0; i < probes_.size(); ++i)
+               finish(*probes_[i]);
+         }
+
+      void start()
+         {
+            for(size_t i = 0; i < probes_.size(); ++i) {
+               probes_[i]->timer.start(options_.interval_ms);
+               run(*probes_[i]);
+            }
+         }
+
+   private:
+      struct probe
+      {
+         probe(health_checker* c, size_t i, const lev::IpAddr& a)
+            : checker(c), index(i), addr(a), bev(NULL), passes(0), failures(0)
+            {}
+
+         health_checker* checker;
+         size_t index;
+         lev::IpAddr addr;
+         lev::EvEvent timer;
+         struct bufferevent* bev;   // non-NULL while a probe is in flight
+         unsigned int passes;
+         unsigned int failures;
+      };
+
+      static void on_timer(evutil_socket_t fd, short what, void* arg)
+         {
+            probe* p = static_cast<probe*>(static_cast<lev::EvEvent*>(arg)->userData());
+            // A probe still running after a whole interval has already timed out
+            if(!p->bev)
+               p->checker->run(*p);
+         }
+
+      void run(probe& p)
+         {
+            p.bev = bufferevent_socket_new(evbase_, -1, BEV_OPT_CLOSE_ON_FREE);
+            if(!p.bev) {
+               PROXY_LOG_ERROR("Health check: failed to create libevent buffer event");
+               return;
+            }
+            // The write timeout also bounds the connect
+            timeval tv = lev::EvEvent::tvMsecs(options_.timeout_ms);
+            bufferevent_set_timeouts(p.bev, &tv, &tv);
+            if(bufferevent_socket_connect(p.bev, (sockaddr*)p.addr.addr(), p.addr.addrLen()) != 0) {
+               finish(p);
+               record(p, false, "connect failed");
+               return;
+            }
+            bufferevent_setcb(p.bev, on_read, NULL, on_event, &p);
+         }
+
+      static void on_event(struct bufferevent* bev, short events, void* cbarg)
+         {
+            probe& p = *static_cast<probe*>(cbarg);
+            health_checker* self = p.checker;
+            if(events & BEV_EVENT_CONNECTED) {
+               if(self->options_.send.empty() && self->options_.expect.empty()) {
+                  self->finish(p);
+                  self->record(p, true, NULL);
+                  return;
+               }
+               if(!self->options_.send.empty())
+                  bufferevent_write(bev, self->options_.send.data(), self->options_.send.size());
+               bufferevent_enable(bev, EV_READ);
+               return;
+            }
+            const char* reason = (events & BEV_EVENT_TIMEOUT) ? "timed out" :
+               (events & BEV_EVENT_EOF) ? "closed before the expected reply" :
+               evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR());
+            self->finish(p);
+            self->record(p, false, reason);
+         }
+
+      static void on_read(struct bufferevent* bev, void* cbarg)
+         {
+            probe& p = *static_cast<probe*>(cbarg);
+            health_checker* self = p.checker;
+            const std::string& expect = self->options_.expect;
+            struct evbuffer* input = bufferevent_get_input(bev);
+            if(expect.empty()) {
+               self->finish(p);
+               self->record(p, true, NULL);
+               return;
+            }
+            if(evbuffer_search(input, expect.data(), expect.size(), NULL).pos >= 0) {
+               self->finish(p);
+               self->record(p, true, NULL);
+            } else if(evbuffer_get_length(input) > max_reply) {
+               self->finish(p);
+               self->record(p, false, "unexpected reply");
+            }
+         }
+
+      void finish(probe& p)
+         {
+            if(p.bev)
+               bufferevent_free(p.bev);
+            p.bev = NULL;
+         }
+
+      void record(probe& p, bool passed, const char* reason)
+         {
+            if(passed) {
+               p.failures = 0;
+               if(++p.passes >= options_.rise && !health_.up(p.index)) {
+                  PROXY_LOG_INFO("Upstream %s is healthy again after %u passed checks",
+                                 p.addr.toStringFull().c_str(), p.passes);
+                  health_.set(p.index, true);
+               }
+            } else {
+               p.passes = 0;
+               PROXY_LOG_DEBUG("Health check of %s failed: %s", p.addr.toStringFull().c_str(), reason);
+               if(++p.failures >= options_.fall && health_.up(p.index)) {
+                  PROXY_LOG_WARN("Upstream %s ejected after %u failed checks (%s)",
+                                 p.addr.toStringFull().c_str(), p.failures, reason);
+                  health_.set(p.index, false);
+               }
+            }
+         }
+
+      static const size_t max_reply = 65536;
+
+      struct event_base* evbase_;
+      const health_check_options& options_;
+      upstream_health& health_;
+      std::vector<boost::shared_ptr<probe> > probes_;
+   };
+}
+
+#endif // _UPSTREAM_HEALTH_H
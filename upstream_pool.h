@@ -0,0 +1,231 @@
+#ifndef _UPSTREAM_POOL_H
+#define _UPSTREAM_POOL_H
+
+#include <stdint.h>
+#include <list>
+
+extern "C" {
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+}
+
+#include "./lev-master/include/lev.h"
+#include "proxy_clock.h"
+#include "proxy_log.h"
+
+namespace tcp_proxy
+{
+   // Pre-connected upstream sockets for one backend, owned by one worker
+   // loop. The pool keeps `target` connections established, hands them out
+   // to accepted clients, refills as soon as one is taken and evicts members
+   // that sat idle too long or were closed by the backend.
+   class upstream_pool
+   {
+   public:
+      struct stats
+      {
+         stats()
+            : hits(0), misses(0), refills(0), refill_failures(0), evictions(0),
+              refill_usec_total(0), refill_usec_max(0)
+            {}
+
+         uint64_t hits;
+         uint64_t misses;
+         uint64_t refills;
+         uint64_t refill_failures;
+         uint64_t evictions;
+         uint64_t refill_usec_total;
+         uint64_t refill_usec_max;
+      };
+
+      // `bev_options` are those of the pooled bufferevents
+      upstream_pool(struct event_base* evbase, const lev::IpAddr& server, size_t target, unsigned int max_idle_ms,
+                    int bev_options = BEV_OPT_CLOSE_ON_FREE)
+         : evbase_(evbase), server_(server), target_(target), max_idle_usec_(uint64_t(max_idle_ms) * 1000),
+           bev_options_(bev_options), connecting_(0), backing_off_(false),
+           maintenance_ev_(event_new(evbase, -1, EV_PERSIST, on_maintenance, this)),
+           retry_ev_(evtimer_new(evbase, on_retry, this))
+         {
+            timeval tv = lev::EvEvent::tvMsecs(maintenance_interval_ms);
+            event_add(maintenance_ev_, &tv);
+         }
+
+      ~upstream_pool()
+         {
+            event_free(maintenance_ev_);
+            event_free(retry_ev_);
+            for(std::list<member>::iterator it = members_.begin(); it != members_.end(); ++it)
+               bufferevent_free(it->bev);
+         }
+
+      int bev_options() const
+         {
+            return bev_options_;
+         }
+
+      // Returns a connected upstream bufferevent with no callbacks set, or
+      // NULL when none is ready. The caller takes ownership.
+      struct bufferevent* acquire()
+         {
+            for(std::list<member>::iterator it = members_.begin(); it != members_.end(); ++it) {
+               if(!it->connected)
+                  continue;
+               struct bufferevent* bev = it->bev;
+               members_.erase(it);
+               bufferevent_disable(bev, EV_READ | EV_WRITE);
+               bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+               stats_.hits++;
+               refill();
+               return bev;
+            }
+            stats_.misses++;
+            refill();
+            return NULL;
+         }
+
+      // Opens connections until idle plus in-flight members reach the target
+      void refill()
+         {
+            while(!backing_off_ && members_.size() < target_) {
+               if(!connect_one())
+                  break;
+            }
+         }
+
+      size_t idle() const
+         {
+            return members_.size() - connecting_;
+         }
+
+      const stats& get_stats() const
+         {
+            return stats_;
+         }
+
+   private:
+      struct member
+      {
+         upstream_pool* pool;
+         std::list<member>::iterator self;
+         struct bufferevent* bev;
+         bool connected;
+         uint64_t since_usec;   // connect start, then connect completion
+      };
+
+      static const int maintenance_interval_ms = 1000;
+      static const int retry_interval_ms = 1000;
+
+      bool connect_one()
+         {
+            struct bufferevent* bev = bufferevent_socket_new(evbase_, -1, bev_options_);
+            if(!bev) {
+               PROXY_LOG_ERROR("Pool: failed to create libevent buffer event");
+               return false;
+            }
+            members_.push_back(member());
+            member& m = members_.back();
+            m.pool = this;
+            m.self = --members_.end();
+            m.bev = bev;
+            m.connected = false;
+            m.since_usec = monotonic_usec();
+            connecting_++;
+            // Install the callback only after the connect call so a synchronous
+            // failure is handled once, here, and not also through on_member_event
+            if(bufferevent_socket_connect(bev, (sockaddr*)server_.addr(), server_.addrLen()) != 0) {
+               connect_failed(m);
+               return false;
+            }
+            bufferevent_setcb(bev, NULL, NULL, on_member_event, &m);
+            return true;
+         }
+
+      void connect_failed(member& m)
+         {
+            stats_.refill_failures++;
+            remove(m);
+            if(!backing_off_) {
+               // Do not hammer a backend that refuses connections
+               PROXY_LOG_DEBUG("Pool: connect to %s failed, retrying in %d ms", server_.toStringFull().c_str(), retry_interval_ms);
+               backing_off_ = true;
+               timeval tv = lev::EvEvent::tvMsecs(retry_interval_ms);
+               event_add(retry_ev_, &tv);
+            }
+         }
+
+      void remove(member& m)
+         {
+            if(!m.connected)
+               connecting_--;
+            bufferevent_free(m.bev);
+            members_.erase(m.self);
+         }
+
+      static void on_member_event(struct bufferevent* bev, short events, void* cbarg)
+         {
+            member& m = *static_cast<member*>(cbarg);
+            upstream_pool* pool = m.pool;
+            if(events & BEV_EVENT_CONNECTED) {
+               const uint64_t now = monotonic_usec();
+               const uint64_t latency = now - m.since_usec;
+               pool->stats_.refills++;
+               pool->stats_.refill_usec_total += latency;
+               if(latency > pool->stats_.refill_usec_max)
+                  pool->stats_.refill_usec_max = latency;
+               m.connected = true;
+               m.since_usec = now;
+               pool->connecting_--;
+               int one = 1;
+               setsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+               setsockopt(bufferevent_getfd(bev), SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+               // Watch for the backend closing the idle connection
+               bufferevent_enable(bev, EV_READ);
+            } else if(!m.connected) {
+               pool->connect_failed(m);
+            } else {
+               PROXY_LOG_DEBUG("Pool: idle connection to %s closed by backend", pool->server_.toStringFull().c_str());
+               pool->stats_.evictions++;
+               pool->remove(m);
+               pool->refill();
+            }
+         }
+
+      static void on_maintenance(evutil_socket_t fd, short what, void* arg)
+         {
+            upstream_pool* pool = static_cast<upstream_pool*>(arg);
+            if(pool->max_idle_usec_) {
+               const uint64_t now = monotonic_usec();
+               std::list<member>::iterator it = pool->members_.begin();
+               while(it != pool->members_.end()) {
+                  member& m = *it++;
+                  if(m.connected && now - m.since_usec > pool->max_idle_usec_) {
+                     pool->stats_.evictions++;
+                     pool->remove(m);
+                  }
+               }
+            }
+            pool->refill();
+         }
+
+      static void on_retry(evutil_socket_t fd, short what, void* arg)
+         {
+            upstream_pool* pool = static_cast<upstream_pool*>(arg);
+            pool->backing_off_ = false;
+            pool->refill();
+         }
+
+      struct event_base* evbase_;
+      lev::IpAddr server_;
+      size_t target_;
+      uint64_t max_idle_usec_;
+      int bev_options_;
+      size_t connecting_;
+      bool backing_off_;
+      struct event* maintenance_ev_;
+      struct event* retry_ev_;
+      std::list<member> members_;
+      stats stats_;
+   };
+}
+
+#endif // _UPSTREAM_POOL_H
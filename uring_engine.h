@@ -0,0 +1,1299 @@
+#ifndef _URING_ENGINE_H
+#define _URING_ENGINE_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
+
+#include "./lev-master/include/lev.h"
+#include "object_pool.h"
+#include "proxy_clock.h"
+#include "proxy_log.h"
+#include "proxy_metrics.h"
+#include "tcp_tuning.h"
+#include "cpu_affinity.h"
+#include "timeout_queue.h"
+#include "memory_budget.h"
+#include "proxy_protocol.h"
+#include "upstream_balancer.h"
+
+namespace tcp_proxy
+{
+   // Minimal io_uring wrapper over the raw system calls: one submission and
+   // one completion queue, mapped once. Entries queued with get_sqe() reach
+   // the kernel on the next submit(), so everything queued while handling a
+   // batch of completions goes in with a single io_uring_enter.
+   class uring
+   {
+   public:
+      uring()
+         : fd_(-1), ring_(NULL), ring_size_(0), sqes_(NULL), sqes_size_(0), sq_tail_local_(0), enters_(0)
+         {}
+
+      ~uring()
+         {
+            if(sqes_)
+               munmap(sqes_, sqes_size_);
+            if(ring_)
+               munmap(ring_, ring_size_);
+            if(fd_ >= 0)
+               close(fd_);
+         }
+
+      // Has to run on the thread that will submit: the ring is set up for a
+      // single issuer, with completion work deferred until we ask for it.
+      bool init(unsigned int entries)
+         {
+            struct io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                      IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+            fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+            if(fd_ < 0 && errno == EINVAL) {
+               // Kernels before 6.1 know none of the flags above
+               memset(&p, 0, sizeof(p));
+               fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+            }
+            if(fd_ < 0)
+               return false;
+            if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+               errno = ENOSYS;
+               return false;
+            }
+            ring_size_ = std::max<size_t>(p.sq_off.array + p.sq_entries * sizeof(unsigned int),
+                                          p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+            void* ring = mmap(NULL, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              fd_, IORING_OFF_SQ_RING);
+            if(ring == MAP_FAILED)
+               return false;
+            ring_ = static_cast<char*>(ring);
+            sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+            void* sqes = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              fd_, IORING_OFF_SQES);
+            if(sqes == MAP_FAILED)
+               return false;
+            sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+            sq_head_ = reinterpret_cast<unsigned int*>(ring_ + p.sq_off.head);
+            sq_tail_ = reinterpret_cast<unsigned int*>(ring_ + p.sq_off.tail);
+            sq_mask_ = *reinterpret_cast<unsigned int*>(ring_ + p.sq_off.ring_mask);
+            sq_entries_ = p.sq_entries;
+            cq_head_ = reinterpret_cast<unsigned int*>(ring_ + p.cq_off.head);
+            cq_tail_ = reinterpret_cast<unsigned int*>(ring_ + p.cq_off.tail);
+            cq_mask_ = *reinterpret_cast<unsigned int*>(ring_ + p.cq_off.ring_mask);
+            cqes_ = reinterpret_cast<struct io_uring_cqe*>(ring_ + p.cq_off.cqes);
+            // Slot i of the index array always names entry i
+            unsigned int* array = reinterpret_cast<unsigned int*>(ring_ + p.sq_off.array);
+            for(unsigned int i = 0; i < sq_entries_; ++i)
+               array[i] = i;
+            sq_tail_local_ = *sq_tail_;
+            return true;
+         }
+
+      int fd() const
+         {
+            return fd_;
+         }
+
+      // Whether this kernel lets us set up a ring at all (it may be built
+      // without io_uring, or have it disabled by sysctl or seccomp)
+      static bool supported()
+         {
+            struct io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            const int fd = static_cast<int>(syscall(__NR_io_uring_setup, 2, &p));
+            if(fd < 0)
+               return false;
+            close(fd);
+            return true;
+         }
+
+      // A zeroed entry; a full queue is flushed to the kernel first
+      struct io_uring_sqe* get_sqe()
+         {
+            if(sq_tail_local_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+               submit(0);
+            struct io_uring_sqe* sqe = &sqes_[sq_tail_local_ & sq_mask_];
+            sq_tail_local_++;
+            memset(sqe, 0, sizeof(*sqe));
+            return sqe;
+         }
+
+      // Hands the queued entries to the kernel and, when wait_nr is set,
+      // waits for that many completions, all in one system call
+      int submit(unsigned int wait_nr)
+         {
+            const unsigned int to_submit = sq_tail_local_ - *sq_tail_;
+            if(!to_submit && !wait_nr)
+               return 0;
+            __atomic_store_n(sq_tail_, sq_tail_local_, __ATOMIC_RELEASE);
+            enters_++;
+            const int ret = static_cast<int>(syscall(__NR_io_uring_enter, fd_, to_submit, wait_nr,
+                                                     wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0));
+            return (ret < 0) ? -errno : ret;
+         }
+
+      // Completions are consumed in order: peek, handle, advance. The head
+      // is only published by commit(), once per batch.
+      struct io_uring_cqe* peek()
+         {
+            if(cq_head_local_ == cq_tail_cached_) {
+               cq_tail_cached_ = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+               if(cq_head_local_ == cq_tail_cached_)
+                  return NULL;
+            }
+            return &cqes_[cq_head_local_ & cq_mask_];
+         }
+
+      void advance()
+         {
+            cq_head_local_++;
+         }
+
+      void commit()
+         {
+            __atomic_store_n(cq_head_, cq_head_local_, __ATOMIC_RELEASE);
+         }
+
+      void begin()
+         {
+            cq_head_local_ = *cq_head_;
+            cq_tail_cached_ = cq_head_local_;
+         }
+
+      uint64_t enters() const
+         {
+            return enters_;
+         }
+
+   private:
+      uring(const uring&);
+      uring& operator=(const uring&);
+
+      int fd_;
+      char* ring_;
+      size_t ring_size_;
+      struct io_uring_sqe* sqes_;
+      size_t sqes_size_;
+      unsigned int* sq_head_;
+      unsigned int* sq_tail_;
+      unsigned int sq_mask_;
+      unsigned int sq_entries_;
+      unsigned int sq_tail_local_;
+      unsigned int* cq_head_;
+      unsigned int* cq_tail_;
+      unsigned int cq_mask_;
+      unsigned int cq_head_local_;
+      unsigned int cq_tail_cached_;
+      struct io_uring_cqe* cqes_;
+      uint64_t enters_;
+   };
+
+   // Equally sized buffers the kernel picks from when a recv completes.
+   // Sockets hold no buffer while idle; one is only taken when data has
+   // arrived, and goes back once it has been sent on. The buffers are
+   // handed over through a mapped ring (IORING_REGISTER_PBUF_RING) where
+   // the kernel supports it, and otherwise with IORING_OP_PROVIDE_BUFFERS
+   // requests queued alongside the rest of the batch.
+   class provided_buffers
+   {
+   public:
+      provided_buffers()
+         : ring_(NULL), buf_ring_(NULL), ring_bytes_(0), data_(NULL), data_bytes_(0),
+           count_(0), size_(0), group_(0), user_data_(0), tail_(0)
+         {}
+
+      ~provided_buffers()
+         {
+            if(buf_ring_)
+               munmap(buf_ring_, ring_bytes_);
+            if(data_)
+               munmap(data_, data_bytes_);
+         }
+
+      // count has to be a power of two. Requests queued on the ring carry
+      // user_data and only complete visibly on failure.
+      bool init(uring& ring, uint16_t group, unsigned int count, size_t size, uint64_t user_data)
+         {
+            ring_ = &ring;
+            count_ = count;
+            size_ = size;
+            group_ = group;
+            user_data_ = user_data;
+            data_bytes_ = count * size;
+            void* data = mmap(NULL, data_bytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(data == MAP_FAILED)
+               return false;
+            data_ = static_cast<char*>(data);
+            if(!init_ring()) {
+               PROXY_LOG_DEBUG("Mapped buffer ring unavailable; providing buffers with requests");
+               struct io_uring_sqe* sqe = ring_->get_sqe();
+               sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+               sqe->fd = static_cast<int>(count_);
+               sqe->addr = reinterpret_cast<uintptr_t>(data_);
+               sqe->len = static_cast<uint32_t>(size_);
+               sqe->off = 0;
+               sqe->buf_group = group_;
+               sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+               sqe->user_data = user_data_;
+            }
+            return true;
+         }
+
+      bool mapped() const
+         {
+            return buf_ring_ != NULL;
+         }
+
+      char* data(uint16_t id) const
+         {
+            return data_ + size_t(id) * size_;
+         }
+
+      // Returned buffers become visible to the kernel at the next publish()
+      void put(uint16_t id)
+         {
+            if(!buf_ring_) {
+               returned_.push_back(id);
+               return;
+            }
+            struct io_uring_buf* b = &buf_ring_->bufs[tail_ & (count_ - 1)];
+            b->addr = reinterpret_cast<uintptr_t>(data(id));
+            b->len = static_cast<uint32_t>(size_);
+            b->bid = id;
+            tail_++;
+         }
+
+      void publish()
+         {
+            if(buf_ring_) {
+               __atomic_store_n(&buf_ring_->tail, tail_, __ATOMIC_RELEASE);
+               return;
+            }
+            // One request per run of consecutive ids
+            std::sort(returned_.begin(), returned_.end());
+            for(size_t i = 0; i < returned_.size();) {
+               size_t j = i + 1;
+               while(j < returned_.size() && returned_[j] == returned_[j - 1] + 1)
+                  ++j;
+               struct io_uring_sqe* sqe = ring_->get_sqe();
+               sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+               sqe->fd = static_cast<int>(j - i);
+               sqe->addr = reinterpret_cast<uintptr_t>(data(returned_[i]));
+               sqe->len = static_cast<uint32_t>(size_);
+               sqe->off = returned_[i];
+               sqe->buf_group = group_;
+               sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+               sqe->user_data = user_data_;
+               i = j;
+            }
+            returned_.clear();
+         }
+
+   private:
+      // Registers the mapped ring, then checks with a recv over a socket
+      // pair that the kernel really takes buffers from it: some kernels
+      // accept the registration and still find the ring empty.
+      bool init_ring()
+         {
+            ring_bytes_ = count_ * sizeof(struct io_uring_buf);
+            void* mem = mmap(NULL, ring_bytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(mem == MAP_FAILED)
+               return false;
+            buf_ring_ = static_cast<struct io_uring_buf_ring*>(mem);
+            struct io_uring_buf_reg reg;
+            memset(&reg, 0, sizeof(reg));
+            reg.ring_addr = reinterpret_cast<uintptr_t>(buf_ring_);
+            reg.ring_entries = count_;
+            reg.bgid = group_;
+            if(syscall(__NR_io_uring_register, ring_->fd(), IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+               drop_ring();
+               return false;
+            }
+            for(unsigned int i = 0; i < count_; ++i)
+               put(static_cast<uint16_t>(i));
+            publish();
+
+            int res = -ENOBUFS;
+            unsigned int flags = 0;
+            int pair[2];
+            if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == 0) {
+               if(write(pair[1], "", 1) == 1) {
+                  struct io_uring_sqe* sqe = ring_->get_sqe();
+                  sqe->opcode = IORING_OP_RECV;
+                  sqe->fd = pair[0];
+                  sqe->flags = IOSQE_BUFFER_SELECT;
+                  sqe->buf_group = group_;
+                  sqe->user_data = user_data_;
+                  if(ring_->submit(1) >= 0) {
+                     ring_->begin();
+                     if(struct io_uring_cqe* cqe = ring_->peek()) {
+                        res = cqe->res;
+                        flags = cqe->flags;
+                        ring_->advance();
+                     }
+                     ring_->commit();
+                  }
+               }
+               close(pair[0]);
+               close(pair[1]);
+            }
+            if(res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+               put(static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT));
+               publish();
+               return true;
+            }
+            struct io_uring_buf_reg unreg;
+            memset(&unreg, 0, sizeof(unreg));
+            unreg.bgid = group_;
+            syscall(__NR_io_uring_register, ring_->fd(), IORING_UNREGISTER_PBUF_RING, &unreg, 1);
+            drop_ring();
+            return false;
+         }
+
+      void drop_ring()
+         {
+            munmap(buf_ring_, ring_bytes_);
+            buf_ring_ = NULL;
+            tail_ = 0;
+         }
+
+      provided_buffers(const provided_buffers&);
+      provided_buffers& operator=(const provided_buffers&);
+
+      uring* ring_;
+      struct io_uring_buf_ring* buf_ring_;
+      size_t ring_bytes_;
+      char* data_;
+      size_t data_bytes_;
+      unsigned int count_;
+      size_t size_;
+      uint16_t group_;
+      uint64_t user_data_;
+      uint16_t tail_;
+      std::vector<uint16_t> returned_;
+   };
+
+   // A worker's relay loop on io_uring, in place of libevent: a multishot
+   // accept on the worker's own SO_REUSEPORT listener, an async connect
+   // per upstream, then one multishot recv per socket drawing on the
+   // provided buffers. Received buffers are queued per direction and sent
+   // on as a chain of linked sends, so they reach the other socket in
+   // order without waiting for one another. All the work a batch of
+   // completions produces is submitted with the next wait, one
+   // io_uring_enter per loop iteration.
+   //
+   // Flow control mirrors the bufferevent path: once a direction has
+   // `high` bytes queued its recv is cancelled, and it is re-armed when the
+   // sends have drained the queue to `low`.
+   class uring_engine
+   {
+   public:
+      struct limits
+      {
+         size_t low;
+         size_t high;
+      };
+
+      static const unsigned int ring_entries = 4096;
+      static const uint16_t buffer_group = 0;
+      static const unsigned int buffer_count = 1024;
+      static const size_t buffer_size = 16384;
+
+      uring_engine(const lev::IpAddr& local, const std::vector<upstream_spec>& upstreams,
+                   balance_policy policy, const upstream_health* health,
+                   limits to_upstream, limits to_downstream, const tcp_tuning& tcp,
+                   steering_mode steering, int cpu, const timeout_options& timeouts, memory_budget* budget,
+                   proxy_protocol_version send_proxy)
+         : metrics_(upstreams.size()),
+           balancer_(upstreams, policy, health),
+           local_(local), proxy_writer_(send_proxy, local.addr()), tcp_(tcp), steering_(steering), cpu_(cpu), listen_fd_(-1), wake_fd_(-1), running_(true),
+           stop_requested_(false), drain_requested_(false), draining_(false), conns_(NULL),
+           now_(0), lease_(budget, metrics_.buffered_bytes), budget_check_armed_(false), completions_(0), messages_(0), sends_(0), buffers_returned_(false)
+         {
+            limits_[0] = to_upstream;
+            limits_[1] = to_downstream;
+            const unsigned int ms[timer_count] = { timeouts.connect_ms, timeouts.idle_read_ms,
+                                                   timeouts.idle_write_ms, timeouts.lifetime_ms, timeouts.linger_ms };
+            // Expiry is checked on a tick a quarter of the shortest timeout long
+            unsigned int tick_ms = 0;
+            for(unsigned int t = 0; t < timer_count; ++t) {
+               timeouts_[t] = timeout_queue(ms[t]);
+               if(ms[t] && (!tick_ms || ms[t] / 4 < tick_ms))
+                  tick_ms = ms[t] / 4;
+            }
+            if(tick_ms)
+               tick_ms = std::min(1000u, std::max(10u, tick_ms));
+            tick_.tv_sec = tick_ms / 1000;
+            tick_.tv_nsec = (tick_ms % 1000) * 1000000LL;
+            budget_check_.tv_sec = 0;
+            budget_check_.tv_nsec = budget_check_ms * 1000000LL;
+         }
+
+      ~uring_engine()
+         {
+            // Whatever is still open goes away with the ring; the kernel
+            // cancels the outstanding requests when it is closed.
+            while(conns_) {
+               conn* c = conns_;
+               for(int k = 0; k < 2; ++k) {
+                  if(c->fd[k] >= 0)
+                     close(c->fd[k]);
+               }
+               unlink(c);
+               c->~conn();
+               conn_pool_.release(c);
+            }
+            if(listen_fd_ >= 0)
+               close(listen_fd_);
+            if(wake_fd_ >= 0)
+               close(wake_fd_);
+         }
+
+      worker_metrics metrics_;
+
+      // Binds a listener of its own, or serves `inherited` when it is not -1
+      bool listen(int inherited = -1)
+         {
+            if(inherited >= 0) {
+               listen_fd_ = inherited;
+            } else {
+               listen_fd_ = socket(local_.addr()->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+               int one = 1;
+               if(listen_fd_ < 0 ||
+                  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+                  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+                  bind(listen_fd_, local_.addr(), local_.addrLen()) != 0 ||
+                  ::listen(listen_fd_, SOMAXCONN) != 0) {
+                  PROXY_LOG_ERROR("Could not listen on %s: %s", local_.toStringFull().c_str(), strerror(errno));
+                  return false;
+               }
+            }
+            tcp_.apply_listener(listen_fd_);
+            if(cpu_ >= 0 && steering_ == steer_incoming_cpu)
+               set_incoming_cpu(listen_fd_, cpu_);
+            wake_fd_ = eventfd(0, EFD_CLOEXEC);
+            if(wake_fd_ < 0) {
+               PROXY_LOG_ERROR("Could not create eventfd: %s", strerror(errno));
+               return false;
+            }
+            return true;
+         }
+
+      int listen_fd() const
+         {
+            return listen_fd_;
+         }
+
+      // May be called from any thread
+      void stop()
+         {
+            stop_requested_ = true;
+            wake();
+         }
+
+      // Stops accepting and returns from run() once the last connection
+      // has closed. May be called from any thread.
+      void drain()
+         {
+            drain_requested_ = true;
+            wake();
+         }
+
+      bool run()
+         {
+            if(!ring_.init(ring_entries) ||
+               !buffers_.init(ring_, buffer_group, buffer_count, buffer_size, tag(NULL, op_cancel))) {
+               PROXY_LOG_ERROR("Could not set up io_uring: %s", strerror(errno));
+               return false;
+            }
+            PROXY_LOG_INFO("Waiting to accept connections on %s (io_uring, %s provided buffers)",
+                           local_.toStringFull().c_str(), buffers_.mapped() ? "mapped" : "requested");
+            arm_accept();
+            arm_wakeup();
+            if(tick_.tv_sec || tick_.tv_nsec)
+               arm_tick();
+            while(running_) {
+               const int ret = ring_.submit(1);
+               if(ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+                  PROXY_LOG_ERROR("io_uring_enter failed: %s", strerror(-ret));
+                  return false;
+               }
+               now_ = monotonic_usec();
+               ring_.begin();
+               while(struct io_uring_cqe* cqe = ring_.peek()) {
+                  completions_++;
+                  dispatch(cqe->user_data, cqe->res, cqe->flags);
+                  ring_.advance();
+               }
+               ring_.commit();
+               flush();
+               if(draining_ && !conns_)
+                  running_ = false;
+            }
+            // Hands over the closes queued by the last batch
+            ring_.submit(0);
+            return true;
+         }
+
+      // Syscalls are counted where the loop makes them; `messages` are the
+      // reads that carried data
+      void log_stats(unsigned int id) const
+         {
+            PROXY_LOG_INFO("Worker %u io_uring: %llu enters for %llu completions, %llu messages relayed with "
+                           "%llu sends (%.3f enters per message)", id, (unsigned long long)ring_.enters(),
+                           (unsigned long long)completions_, (unsigned long long)messages_,
+                           (unsigned long long)sends_, messages_ ? double(ring_.enters()) / messages_ : 0.0);
+         }
+
+   private:
+      // What a completion belongs to, in the low bits of user_data; the
+      // rest is the connection, whose blocks are 16-byte aligned
+      enum op
+      {
+         op_accept = 0,
+         op_wakeup,
+         op_connect,
+         op_recv,          // + direction
+         op_send = 5,      // + direction
+         op_cancel = 7,
+         op_mask = 7
+      };
+
+      static const unsigned int inline_segments = 16;
+      // How often sources paused by the memory budget look for room
+      static const unsigned int budget_check_ms = 10;
+
+      // The limits each connection is held to, one queue each
+      enum timer
+      {
+         timer_connect,
+         timer_idle_read,    // nothing relayed in either direction
+         timer_idle_write,   // sends in flight that make no progress
+         timer_lifetime,
+         timer_linger,       // from the first half-close until both directions have finished
+         timer_count
+      };
+
+      struct segment
+      {
+         uint16_t buffer;
+         uint32_t len;
+      };
+
+      // Data read from fd[d] and queued for fd[1 - d]. Segments in
+      // [head, sending) are in flight, [sending, tail) wait for the chain
+      // in flight to complete.
+      struct direction
+      {
+         // The queue lives inline until a direction needs more room. A
+         // cancelled recv may still deliver whatever one enter drained
+         // from the socket, so the queue grows rather than drops.
+         segment* slots()
+            {
+               return spill.empty() ? inline_slots : &spill[0];
+            }
+
+         unsigned int capacity() const
+            {
+               return spill.empty() ? inline_segments : static_cast<unsigned int>(spill.size());
+            }
+
+         segment& at(unsigned int i)
+            {
+               return slots()[i & (capacity() - 1)];
+            }
+
+         void push(uint16_t buffer, uint32_t len)
+            {
+               if(tail - head == capacity()) {
+                  std::vector<segment> grown(capacity() * 2);
+                  for(unsigned int i = head; i != tail; ++i)
+                     grown[i & (grown.size() - 1)] = at(i);
+                  spill.swap(grown);
+               }
+               segment& s = at(tail++);
+               s.buffer = buffer;
+               s.len = len;
+               queued_bytes += len;
+            }
+
+         segment inline_slots[inline_segments];
+         std::vector<segment> spill;
+         unsigned int head;
+         unsigned int sending;
+         unsigned int tail;
+         size_t queued_bytes;
+         bool recv_armed;
+         bool paused;     // recv cancelled for flow control
+         bool starved;    // recv ran out of provided buffers
+         bool blocked;    // paused until the memory budget has room again
+         bool eof;
+         bool shut;       // the EOF has been passed on with shutdown(SHUT_WR)
+         bool dirty;      // has segments waiting to be sent
+      };
+
+      // fd[0] is the client, fd[1] the upstream
+      struct conn
+      {
+         int fd[2];
+         size_t upstream_index;
+         struct sockaddr_storage upstream_addr;
+         uint64_t accept_usec;
+         uint64_t connect_start_usec;
+         unsigned int inflight;
+         bool connected;
+         bool closing;
+         direction dir[2];
+         timeout_link timers[timer_count];
+         conn* prev;
+         conn* next;
+      };
+
+      static uint64_t tag(conn* c, unsigned int o)
+         {
+            return reinterpret_cast<uintptr_t>(c) | o;
+         }
+
+      upstream_metrics& upstream_stats(conn* c)
+         {
+            return metrics_.upstreams[c->upstream_index];
+         }
+
+      void dispatch(uint64_t user_data, int res, unsigned int flags)
+         {
+            conn* c = reinterpret_cast<conn*>(static_cast<uintptr_t>(user_data & ~uint64_t(op_mask)));
+            const unsigned int o = static_cast<unsigned int>(user_data & op_mask);
+            switch(o) {
+            case op_accept:
+               on_accept(res, flags);
+               break;
+            case op_wakeup:
+               // Timers are told apart by pointing at their timespec
+               if(c == reinterpret_cast<conn*>(&tick_))
+                  on_tick();
+               else if(c == reinterpret_cast<conn*>(&budget_check_))
+                  on_budget_check();
+               else
+                  on_wakeup();
+               break;
+            case op_connect:
+               on_connect(c, res);
+               break;
+            case op_recv:
+            case op_recv + 1:
+               on_recv(c, o - op_recv, res, flags);
+               break;
+            case op_send:
+            case op_send + 1:
+               on_send(c, o - op_send, res);
+               break;
+            case op_cancel:
+               // Closes and buffer hand-overs are not tracked, and only
+               // complete visibly when they fail; cancels are tracked
+               if(c) {
+                  c->inflight--;
+                  maybe_free(c);
+               } else if(res < 0) {
+                  PROXY_LOG_WARN("io_uring request failed: %s", strerror(-res));
+               }
+               break;
+            }
+         }
+
+      void arm_accept()
+         {
+            struct io_uring_sqe* sqe = ring_.get_sqe();
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = listen_fd_;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            sqe->user_data = tag(NULL, op_accept);
+         }
+
+      void arm_wakeup()
+         {
+            struct io_uring_sqe* sqe = ring_.get_sqe();
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = wake_fd_;
+            sqe->addr = reinterpret_cast<uintptr_t>(&wake_value_);
+            sqe->len = sizeof(wake_value_);
+            sqe->user_data = tag(NULL, op_wakeup);
+         }
+
+      void arm_tick()
+         {
+            struct io_uring_sqe* sqe = ring_.get_sqe();
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = reinterpret_cast<uintptr_t>(&tick_);
+            sqe->len = 1;
+            sqe->user_data = tag(reinterpret_cast<conn*>(&tick_), op_wakeup);
+         }
+
+      // Every queue is ordered by deadline, so this only visits the
+      // connections that did expire
+      void on_tick()
+         {
+            static counter worker_metrics::* const counters[timer_count] = {
+               &worker_metrics::timeouts_connect, &worker_metrics::timeouts_idle_read,
+               &worker_metrics::timeouts_idle_write, &worker_metrics::timeouts_lifetime, &worker_metrics::timeouts_linger
+            };
+            static const char* const names[timer_count] = { "connect", "idle read", "idle write", "lifetime", "linger" };
+            for(unsigned int t = 0; t < timer_count; ++t) {
+               while(void* owner = timeouts_[t].pop_expired(now_)) {
+                  conn* c = static_cast<conn*>(owner);
+                  // With sends stuck in flight it is the write limit that
+                  // applies, as reads stop under backpressure
+                  if(t == timer_idle_read && sending(c)) {
+                     timeouts_[t].arm(c->timers[t], now_);
+                     continue;
+                  }
+                  PROXY_LOG_DEBUG("Connection %p: %s timeout", owner, names[t]);
+                  (metrics_.*counters[t]).add();
+                  close_conn(c, true);
+               }
+            }
+            if(running_)
+               arm_tick();
+         }
+
+      // Stops reading a source while the budget is used up; its data stays
+      // in the socket buffer, where TCP pushes back on the sender
+      void block(conn* c, unsigned int d)
+         {
+            c->dir[d].blocked = true;
+            metrics_.budget_pauses.add();
+            budget_blocked_.push_back(std::make_pair(c, d));
+            pause(c, d);
+            arm_budget_check();
+         }
+
+      void arm_budget_check()
+         {
+            if(budget_check_armed_)
+               return;
+            budget_check_armed_ = true;
+            struct io_uring_sqe* sqe = ring_.get_sqe();
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = reinterpret_cast<uintptr_t>(&budget_check_);
+            sqe->len = 1;
+            sqe->user_data = tag(reinterpret_cast<conn*>(&budget_check_), op_wakeup);
+         }
+
+      // The budget is shared with the other workers, whose sends free it
+      // without telling us, so blocked sources poll for room
+      void on_budget_check()
+         {
+            budget_check_armed_ = false;
+            if(!lease_.can_resume()) {
+               arm_budget_check();
+               return;
+            }
+            std::vector<std::pair<conn*, unsigned int> > blocked;
+            blocked.swap(budget_blocked_);
+            for(size_t i = 0; i < blocked.size(); ++i) {
+               conn* c = blocked[i].first;
+               c->dir[blocked[i].second].blocked = false;
+               if(!c->closing)
+                  maybe_rearm(c, blocked[i].second);
+            }
+         }
+
+      void wake()
+         {
+            const uint64_t one = 1;
+            if(write(wake_fd_, &one, sizeof(one)) < 0)
+               PROXY_LOG_ERROR("Could not wake the io_uring loop: %s", strerror(errno));
+         }
+
+      void on_wakeup()
+         {
+            if(stop_requested_) {
+               running_ = false;
+               return;
+            }
+            arm_wakeup();
+            if(!drain_requested_ || draining_)
+               return;
+            // The listener lives on in the process that took over; closing
+            // our reference only ends our share of its accepts
+            draining_ = true;
+            struct io_uring_sqe* sqe = ring_.get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = tag(NULL, op_accept);
+            sqe->user_data = tag(NULL, op_cancel);
+            ring_.submit(0);
+            close(listen_fd_);
+            listen_fd_ = -1;
+            PROXY_LOG_INFO("Stopped accepting on %s, draining", local_.toStringFull().c_str());
+         }
+
+      void on_accept(int res, unsigned int flags)
+         {
+            if(!(flags & IORING_CQE_F_MORE) && running_ && !draining_)
+               arm_accept();
+            if(res == -ECANCELED && draining_)
+               return;
+            if(res < 0) {
+               PROXY_LOG_WARN("Accept on %s failed: %s", local_.toStringFull().c_str(), strerror(-res));
+               return;
+            }
+            metrics_.downstream_total.add();
+            metrics_.downstream_active.add();
+            if(cpu_ >= 0)
+               (incoming_cpu(res) == cpu_ ? metrics_.flows_local : metrics_.flows_remote).add();
+            // Only hashing needs the client address; the accept itself does
+            // not ask for it, since a multishot accept has nowhere to put it
+            struct sockaddr_storage client;
+            socklen_t client_len = sizeof(client);
+            const bool by_address = balancer_.policy() == balance_hash &&
+                                    getpeername(res, reinterpret_cast<struct sockaddr*>(&client), &client_len) == 0;
+            const size_t index = balancer_.acquire(by_address ? reinterpret_cast<struct sockaddr*>(&client) : NULL);
+            if(index == upstream_balancer::none) {
+               metrics_.failed.add();
+               metrics_.downstream_active.sub();
+               close(res);
+               return;
+            }
+
+            conn_pool_.fits(sizeof(conn));
+            conn* c = new(conn_pool_.allocate()) conn();
+            c->fd[0] = res;
+            c->fd[1] = -1;
+            c->upstream_index = index;
+            c->accept_usec = monotonic_usec();
+            for(unsigned int t = 0; t < timer_count; ++t)
+               c->timers[t].owner = c;
+            timeouts_[timer_lifetime].arm(c->timers[timer_lifetime], now_);
+            timeouts_[timer_connect].arm(c->timers[timer_connect], now_);
+            link(c);
+            PROXY_LOG_TRACE("Accepted fd = %d; conn ptr = %p", res, (void*)c);
+
+            const lev::IpAddr& upstream = balancer_.address(index);
+            memcpy(&c->upstream_addr, upstream.addr(), upstream.addrLen());
+            c->fd[1] = socket(upstream.addr()->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if(c->fd[1] < 0) {
+               PROXY_LOG_ERROR("Could not create upstream socket: %s", strerror(errno));
+               close_conn(c, true);
+               return;
+            }
+            tcp_.apply_upstream(c->fd[1]);
+            c->connect_start_usec = c->accept_usec;
+            struct io_uring_sqe* sqe = ring_.get_sqe();
+            sqe->opcode = IORING_OP_CONNECT;
+            sqe->fd = c->fd[1];
+            sqe->addr = reinterpret_cast<uintptr_t>(&c->upstream_addr);
+            sqe->off = upstream.addrLen();
+            sqe->user_data = tag(c, op_connect);
+            c->inflight++;
+         }
+
+      void on_connect(conn* c, int res)
+         {
+            c->inflight--;
+            if(c->closing) {
+               maybe_free(c);
+               return;
+            }
+            if(res < 0) {
+               PROXY_LOG_WARN("Upstream connection to %s failed: %s",
+                              balancer_.address(c->upstream_index).toStringFull().c_str(), strerror(-res));
+               close_conn(c, true);
+               return;
+            }
+            c->connected = true;
+            timeouts_[timer_connect].cancel(c->timers[timer_connect]);
+            timeouts_[timer_idle_read].arm(c->timers[timer_idle_read], now_);
+            upstream_metrics& us = upstream_stats(c);
+            us.connections_total.add();
+            us.connections_active.add();
+            us.connect_usec.record(monotonic_usec() - c->connect_start_usec);
+            int one = 1;
+            setsockopt(c->fd[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            setsockopt(c->fd[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if(proxy_writer_.version() != proxy_protocol_off && !send_proxy_header(c)) {
+               close_conn(c, true);
+               return;
+            }
+            arm_recv(c, 0);
+            arm_recv(c, 1);
+         }
+
+      // Writes the PROXY header before anything is relayed. A fresh
+      // connection's socket buffer takes it whole, so it goes out with a
+      // plain send() rather than through the ring.
+      bool send_proxy_header(conn* c)
+         {
+            struct sockaddr_storage client, local;
+            socklen_t client_len = sizeof(client), local_len = sizeof(local);
+            if(getpeername(c->fd[0], reinterpret_cast<struct sockaddr*>(&client), &client_len) != 0)
+               return false;
+            const struct sockaddr* dst = NULL;
+            if(proxy_writer_.needs_destination() &&
+               getsockname(c->fd[0], reinterpret_cast<struct sockaddr*>(&local), &local_len) == 0)
+               dst = reinterpret_cast<struct sockaddr*>(&local);
+            char header[proxy_header_max];
+            const size_t n = proxy_writer_.write(reinterpret_cast<struct sockaddr*>(&client), dst, header);
+            return send(c->fd[1], header, n, MSG_NOSIGNAL | MSG_DONTWAIT) == ssize_t(n);
+         }
+
+      void arm_recv(conn* c, unsigned int d)
+         {
+            struct io_uring_sqe* sqe = ring_.get_sqe();
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = c->fd[d];
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = buffer_group;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->user_data = tag(c, op_recv + d);
+            c->inflight++;
+            c->dir[d].recv_armed = true;
+         }
+
+      void on_recv(conn* c, unsigned int d, int res, unsigned int flags)
+         {
+            direction& dir = c->dir[d];
+            if(!(flags & IORING_CQE_F_MORE)) {
+               c->inflight--;
+               dir.recv_armed = false;
+            }
+            if(res > 0) {
+               const uint16_t buffer = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+               messages_++;
+               if(c->closing) {
+                  return_buffer(buffer);
+               } else {
+                  dir.push(buffer, static_cast<uint32_t>(res));
+                  lease_.charge(res);
+                  count_read(c, d, res);
+                  timeouts_[timer_idle_read].arm(c->timers[timer_idle_read], now_);
+                  mark_dirty(c, d);
+                  if(!dir.paused && dir.queued_bytes >= limits_[d].high)
+                     pause(c, d);
+                  else if(!dir.blocked && lease_.over())
+                     block(c, d);
+               }
+            } else if(res == 0) {
+               PROXY_LOG_DEBUG("%s connection EOF", d ? "Upstream" : "Downstream");
+               dir.eof = true;
+               if(!c->closing && dir.head == dir.tail)
+                  pass_eof(c, d);
+            } else if(res == -ENOBUFS) {
+               if(!c->closing && !dir.starved) {
+                  dir.starved = true;
+                  starved_.push_back(c);
+               }
+            } else if(res != -ECANCELED && !c->closing) {
+               PROXY_LOG_WARN("%s connection error: %s", d ? "Upstream" : "Downstream", strerror(-res));
+               close_conn(c, true);
+            }
+            if(c->closing)
+               maybe_free(c);
+            else
+               maybe_rearm(c, d);
+         }
+
+      void count_read(conn* c, unsigned int d, size_t n)
+         {
+            upstream_metrics& us = upstream_stats(c);
+            (d ? us.bytes_received : us.bytes_sent).add(n);
+            // The first segment ever queued in a direction is its first byte
+            if(c->dir[d].tail == 1)
+               (d ? us.first_byte_received_usec : us.first_byte_sent_usec).record(monotonic_usec() - c->accept_usec);
+         }
+
+      void mark_dirty(conn* c, unsigned int d)
+         {
+            if(!c->dir[d].dirty) {
+               c->dir[d].dirty = true;
+               dirty_.push_back(std::make_pair(c, d));
+            }
+         }
+
+      // Cancelling the multishot recv stops reading; the data stays in the
+      // socket buffer and TCP pushes back on the sender
+      void pause(conn* c, unsigned int d)
+         {
+            c->dir[d].paused = true;
+            if(!c->dir[d].recv_armed)
+               return;
+            struct io_uring_sqe* sqe = ring_.get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = tag(c, op_recv + d);
+            sqe->user_data = tag(c, op_cancel);
+            c->inflight++;
+         }
+
+      void maybe_rearm(conn* c, unsigned int d)
+         {
+            direction& dir = c->dir[d];
+            if(dir.recv_armed || dir.eof || dir.starved || dir.blocked || !c->connected)
+               return;
+            if(dir.paused) {
+               if(dir.queued_bytes > limits_[d].low)
+                  return;
+               dir.paused = false;
+            }
+            arm_recv(c, d);
+         }
+
+      // Sends every waiting segment of a direction as one chain; the links
+      // keep them in order. A new chain only starts once the previous one
+      // has completed.
+      void start_send(conn* c, unsigned int d)
+         {
+            direction& dir = c->dir[d];
+            if(dir.head != dir.sending || dir.sending == dir.tail)
+               return;
+            if(!c->timers[timer_idle_write].linked)
+               timeouts_[timer_idle_write].arm(c->timers[timer_idle_write], now_);
+            for(; dir.sending != dir.tail; ++dir.sending) {
+               const segment& s = dir.at(dir.sending);
+               struct io_uring_sqe* sqe = ring_.get_sqe();
+               sqe->opcode = IORING_OP_SEND;
+               sqe->fd = c->fd[1 - d];
+               sqe->addr = reinterpret_cast<uintptr_t>(buffers_.data(s.buffer));
+               sqe->len = s.len;
+               // MSG_WAITALL makes the kernel finish a short send itself, so
+               // a chain only breaks on a real error
+               sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+               if(dir.sending + 1 != dir.tail)
+                  sqe->flags = IOSQE_IO_LINK;
+               sqe->user_data = tag(c, op_send + d);
+               c->inflight++;
+               sends_++;
+            }
+         }
+
+      void on_send(conn* c, unsigned int d, int res)
+         {
+            direction& dir = c->dir[d];
+            c->inflight--;
+            // Links complete in order, so this is the oldest segment in flight
+            const segment s = dir.at(dir.head++);
+            dir.queued_bytes -= s.len;
+            lease_.discharge(s.len);
+            return_buffer(s.buffer);
+            if(c->closing) {
+               maybe_free(c);
+               return;
+            }
+            if(res < 0 || static_cast<uint32_t>(res) != s.len) {
+               PROXY_LOG_WARN("%s connection send error: %s", d ? "Downstream" : "Upstream",
+                              res < 0 ? strerror(-res) : "short send");
+               close_conn(c, true);
+               return;
+            }
+            // Progress: the write clock restarts, or stops with nothing in flight
+            timeouts_[timer_idle_read].arm(c->timers[timer_idle_read], now_);
+            if(sending(c))
+               timeouts_[timer_idle_write].arm(c->timers[timer_idle_write], now_);
+            else
+               timeouts_[timer_idle_write].cancel(c->timers[timer_idle_write]);
+            if(dir.head == dir.sending) {
+               if(dir.sending != dir.tail) {
+                  mark_dirty(c, d);
+               } else if(dir.eof && !dir.shut) {
+                  pass_eof(c, d);
+                  if(c->closing)
+                     return;
+               }
+            }
+            maybe_rearm(c, d);
+         }
+
+      // Everything read in direction d before its EOF has been sent: shut
+      // down the destination's write half and keep relaying the other
+      // direction. The connection closes once both have ended.
+      void pass_eof(conn* c, unsigned int d)
+         {
+            c->dir[d].shut = true;
+            shutdown(c->fd[1 - d], SHUT_WR);
+            metrics_.half_closes.add();
+            if(c->dir[1 - d].shut)
+               close_conn(c, false);
+            else if(!c->timers[timer_linger].linked)
+               timeouts_[timer_linger].arm(c->timers[timer_linger], now_);
+         }
+
+      static bool sending(const conn* c)
+         {
+            return c->dir[0].head != c->dir[0].sending || c->dir[1].head != c->dir[1].sending;
+         }
+
+      void return_buffer(uint16_t buffer)
+         {
+            buffers_.put(buffer);
+            buffers_returned_ = true;
+         }
+
+      // Runs after each batch of completions: starts the chains the batch
+      // queued and re-arms recvs that had run out of buffers
+      void flush()
+         {
+            for(size_t i = 0; i < dirty_.size(); ++i) {
+               conn* c = dirty_[i].first;
+               c->dir[dirty_[i].second].dirty = false;
+               if(!c->closing)
+                  start_send(c, dirty_[i].second);
+            }
+            dirty_.clear();
+            if(buffers_returned_) {
+               buffers_.publish();
+               buffers_returned_ = false;
+               std::vector<conn*> starved;
+               starved.swap(starved_);
+               for(size_t i = 0; i < starved.size(); ++i) {
+                  for(unsigned int d = 0; d < 2; ++d) {
+                     if(starved[i]->dir[d].starved) {
+                        starved[i]->dir[d].starved = false;
+                        maybe_rearm(starved[i], d);
+                     }
+                  }
+               }
+            }
+         }
+
+      // Buffers waiting to be sent go back right away; the ones in flight
+      // return with their completions, which the cancels hurry along
+      void close_conn(conn* c, bool failed)
+         {
+            if(c->closing)
+               return;
+            c->closing = true;
+            for(unsigned int t = 0; t < timer_count; ++t)
+               timeouts_[t].cancel(c->timers[t]);
+            if(failed) {
+               if(!c->connected)
+                  upstream_stats(c).connect_errors.add();
+               metrics_.failed.add();
+            }
+            for(unsigned int d = 0; d < 2; ++d) {
+               direction& dir = c->dir[d];
+               for(; dir.tail != dir.sending; --dir.tail) {
+                  const segment& s = dir.at(dir.tail - 1);
+                  dir.queued_bytes -= s.len;
+                  lease_.discharge(s.len);
+                  return_buffer(s.buffer);
+               }
+            }
+            for(unsigned int k = 0; k < 2; ++k) {
+               if(c->fd[k] < 0)
+                  continue;
+               struct io_uring_sqe* sqe = ring_.get_sqe();
+               sqe->opcode = IORING_OP_ASYNC_CANCEL;
+               sqe->fd = c->fd[k];
+               sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+               sqe->user_data = tag(c, op_cancel);
+               c->inflight++;
+            }
+            maybe_free(c);
+         }
+
+      void maybe_free(conn* c)
+         {
+            if(!c->closing || c->inflight)
+               return;
+            for(unsigned int k = 0; k < 2; ++k) {
+               if(c->fd[k] < 0)
+                  continue;
+               struct io_uring_sqe* sqe = ring_.get_sqe();
+               sqe->opcode = IORING_OP_CLOSE;
+               sqe->fd = c->fd[k];
+               sqe->user_data = tag(NULL, op_cancel);
+            }
+            if(c->dir[0].starved || c->dir[1].starved)
+               starved_.erase(std::remove(starved_.begin(), starved_.end(), c), starved_.end());
+            for(unsigned int d = 0; d < 2; ++d) {
+               if(c->dir[d].blocked)
+                  budget_blocked_.erase(std::find(budget_blocked_.begin(), budget_blocked_.end(), std::make_pair(c, d)));
+            }
+            upstream_metrics& us = upstream_stats(c);
+            if(c->connected)
+               us.connections_active.sub();
+            us.duration_usec.record(monotonic_usec() - c->accept_usec);
+            metrics_.downstream_active.sub();
+            balancer_.release(c->upstream_index);
+            PROXY_LOG_TRACE("Freeing conn ptr = %p", (void*)c);
+            unlink(c);
+            c->~conn();
+            conn_pool_.release(c);
+         }
+
+      void link(conn* c)
+         {
+            c->prev = NULL;
+            c->next = conns_;
+            if(conns_)
+               conns_->prev = c;
+            conns_ = c;
+         }
+
+      void unlink(conn* c)
+         {
+            if(c->prev)
+               c->prev->next = c->next;
+            else
+               conns_ = c->next;
+            if(c->next)
+               c->next->prev = c->prev;
+         }
+
+      uring_engine(const uring_engine&);
+      uring_engine& operator=(const uring_engine&);
+
+      upstream_balancer balancer_;
+      // The ring goes first on destruction, before the connections and
+      // buffers its requests may still point into
+      block_pool conn_pool_;
+      provided_buffers buffers_;
+      uring ring_;
+      lev::IpAddr local_;
+      proxy_header_writer proxy_writer_;   // used unless its version is off
+      tcp_tuning tcp_;
+      steering_mode steering_;
+      int cpu_;   // the worker's CPU, -1 when not pinned
+      limits limits_[2];
+      int listen_fd_;
+      int wake_fd_;
+      uint64_t wake_value_;
+      bool running_;
+      // Requests from other threads, acted on when the eventfd read completes
+      std::atomic<bool> stop_requested_;
+      std::atomic<bool> drain_requested_;
+      bool draining_;
+      conn* conns_;
+      timeout_queue timeouts_[timer_count];
+      struct __kernel_timespec tick_;   // zero when no timeout is set
+      uint64_t now_;                    // monotonic_usec as of the current batch
+      budget_lease lease_;
+      std::vector<std::pair<conn*, unsigned int> > budget_blocked_;
+      struct __kernel_timespec budget_check_;
+      bool budget_check_armed_;
+      std::vector<std::pair<conn*, unsigned int> > dirty_;
+      std::vector<conn*> starved_;
+      uint64_t completions_;
+      uint64_t messages_;
+      uint64_t sends_;
+      bool buffers_returned_;
+   };
+}
+
+#endif // _URING_ENGINE_H